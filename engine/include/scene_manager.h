@@ -3,13 +3,212 @@
 #include "scene.h"
 #include "hittable.h"
 #include "bounding_volume_hierarchy.h"
+#include "bvh_report.h"
+#include "dynamic_bounding_volume_hierarchy.h"
+#include "flat_bounding_volume_hierarchy.h"
+#include "instance.h"
+#include "primitive_arrays.h"
+#include "scene_cache.h"
+#include "scene_file.h"
+#include "tri_mesh.h"
+#include "wide_bounding_volume_hierarchy.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_set>
+
+/** Creates the objects of a world. */
+using WorldGenerator = std::function<std::vector<std::shared_ptr<Hittable>>()>;
+
+/** Moves the objects of a world to where they are at the given time (in seconds). */
+using WorldAnimator = std::function<void(const std::vector<std::shared_ptr<Hittable>> &world, float timeSeconds)>;
+
+/** Everything needed to refit (or rebuild) the BVH of a scene after its objects moved. */
+struct AnimatedScene {
+    std::vector<std::shared_ptr<Hittable>> world;
+    WorldAnimator animator;
+    FlatBVH bvh;
+    WideBVH wideBvh;
+    float builtCost {}; // SAH cost right after the last (re)build.
+};
+
+/** Where a registered scene is on its way to being shown. */
+enum class SceneStatus {
+    registered, // Not asked for yet.
+    queued,
+    building,
+    built,      // Done, but not handed over to the main thread by `publish_built_scenes()` yet.
+    ready,      // In `scenes`, along with its animated or editable state.
+    failed,
+};
+
+struct SceneProgress {
+    SceneStatus status;
+    float fraction; // Rough, since it only moves on between the phases of the build.
+    const char *phase;
+};
+
+/**
+ * Builds scenes on demand, each on one of a few threads of its own, so that only the scenes that are shown are ever
+ * built and the first one is ready no matter how many others are registered. Every build only writes to its own state,
+ * which the main thread moves into `scenes` (and `animatedScenes` or `editableScenes`) when it publishes it, so the
+ * main thread reads those without locking. The settings are read while building, so they must not change once a scene
+ * was requested.
+ */
 class SceneManager {
 public:
-    void init_scene(Scene scene, const std::function<std::shared_ptr<BVHNode>()> &&worldGenerator);
+    SceneManager() = default;
+
+    SceneManager(const SceneManager &) = delete;
+
+    SceneManager &operator=(const SceneManager &) = delete;
 
+    /** Drops the queued builds and waits for the ones in progress. */
+    ~SceneManager();
+
+    /**
+     * Registers a scene to be built once it is requested. Building it generates its world and builds its BVH, then
+     * prints a report of its quality and writes it to `reportDirectory`.
+     * Scenes with an animator are always built flat, since only `FlatBVH`s can be refit. Scenes named in
+     * `editableSceneNames` are built into a `DynamicBVH` instead, and can neither be animated nor hold instances.
+     * Scenes named in `gpuBuiltSceneNames` only have their primitives serialized: the engine builds their BVH with
+     * `build.comp`. They cannot be animated, edited or hold instances or meshes either.
+     *
+     * Static scenes are loaded from `cacheDirectory` instead, unless the build settings, `generatorVersion` or the
+     * contents of the input files (the assets the generator reads) changed since they were cached.
+     */
+    void init_scene(Scene scene, WorldGenerator &&worldGenerator, WorldAnimator &&animator = {}, std::vector<std::string> inputFiles = {});
+
+    /**
+     * Registers the scene of a scene file (see `SceneFile`) under the stem of its path, like `init_scene()`. The file is
+     * only loaded (and compiled first, if needed) once the scene is built, so `resolveMesh` is called on a building
+     * thread. The scene file and `inputFiles` (e.g., the assets of the meshes it references) are part of the cache key.
+     */
+    void init_scene_file(const std::string &path, SceneFile::MeshResolver resolveMesh, std::vector<std::string> inputFiles = {});
+
+    /** Queues the build of a registered scene, unless it was requested before. */
+    void request_scene(const std::string &name);
+
+    /** Requests the scene, then blocks until it is built and publishes it. Throws if its build failed. */
+    Scene *wait_for_scene(const std::string &name);
+
+    /** Moves every scene built since the last call into `scenes`, so it can be shown. Called by the main thread. */
+    void publish_built_scenes();
+
+    [[nodiscard]] SceneProgress get_progress(const std::string &name) const;
+
+    /** @return The scene, or `nullptr` if it was not published yet. */
     Scene *get_scene(const std::string &name);
 
+    /**
+     * Animates the objects of an animated scene and refits its BVHs, or rebuilds them once the SAH cost has grown past
+     * `maxRefitCostRatio`, which serializes the whole scene again. A refit only writes the primitives that moved, and
+     * the bounds of the nodes if `shouldWriteNodes`--otherwise, those are left to `refit.comp`. Nodes keep the octant
+     * links of the last rebuild, since those only order the traversal.
+     *
+     * @return The primitives that changed, or `hasResized` after a rebuild, since the size of the node buffers may have
+     * changed. Node bounds are not recorded, since every one of them may have changed.
+     */
+    SceneEdit update_scene(const std::string &name, float timeSeconds, bool shouldWriteNodes);
+
+    /**
+     * Inserts an object into an editable scene, then updates its octant links and wide BVH.
+     *
+     * @return The entries of the scene buffers that changed, which are all that has to be uploaded unless a buffer had
+     * to grow.
+     */
+    SceneEdit insert_object(const std::string &name, const std::shared_ptr<Hittable> &object);
+
+    /** Removes an object from an editable scene, like `insert_object()`. */
+    SceneEdit remove_object(const std::string &name, const std::shared_ptr<Hittable> &object);
+
 public:
+    std::vector<std::string> sceneNames; // Every registered scene, in the order they were registered.
     std::unordered_map<std::string, std::unique_ptr<Scene>> scenes;
+    std::unordered_map<std::string, AnimatedScene> animatedScenes;
+    std::unordered_map<std::string, DynamicBVH> editableScenes;
+    std::unordered_set<std::string> editableSceneNames; // Scenes to build editable. Editable scenes are never cached.
+    std::unordered_set<std::string> gpuBuiltSceneNames; // Scenes whose BVH is built on the GPU, with a leaf per primitive.
+    BVHNode::BuildOptions buildOptions;
+    bool shouldBuildFlat {true}; // Builds straight into GPU nodes instead of building a tree of `BVHNode`s first.
+    int wideBVHWidth {4}; // Every BVH is also collapsed into a 4- or 8-wide BVH.
+    int numOptimizationPasses {3}; // Treelet restructuring passes over the flat BVHs of static scenes. 0 to disable.
+    BVHNode::NodeLayout nodeLayout {BVHNode::NodeLayout::depthFirst}; // Order of the nodes of flat BVHs in memory.
+    float maxRefitCostRatio {1.5f}; // Refit BVHs are rebuilt once their SAH cost grew by this factor.
+    std::string reportDirectory {"../reports/"}; // Every scene's BVH report is written here as JSON. Empty to disable.
+    std::string cacheDirectory {"../cache/"};    // Static scenes are cached here once built. Empty to disable.
+    std::string generatorVersion; // Generators are code, so whatever changes with them (e.g., a build timestamp).
+    int numBuildThreads {2}; // Every build is parallel already, so more threads only help when many are requested at once.
+
+private:
+    /** A registered scene, and what its build produced until the main thread publishes it. */
+    struct SceneBuild {
+        std::string name;
+        std::function<Scene()> makeScene; // Called by the building thread, so scene files are only loaded when needed.
+        WorldGenerator worldGenerator;
+        WorldAnimator animator;
+        std::vector<std::string> inputFiles;
+
+        std::atomic<SceneStatus> status {SceneStatus::registered};
+        std::atomic<float> progress {};
+        std::atomic<const char *> phase {""};
+
+        // Written by the building thread before `status` becomes `built` (or `failed`).
+        std::unique_ptr<Scene> scene;
+        std::optional<AnimatedScene> animatedScene;
+        std::optional<DynamicBVH> dynamicBvh;
+        std::string error;
+
+        void begin_phase(const char *name, float fraction) {
+            phase = name;
+            progress = fraction;
+        }
+    };
+
+private:
+    void register_scene(const std::string &name, std::function<Scene()> &&makeScene, WorldGenerator &&worldGenerator,
+                        WorldAnimator &&animator, std::vector<std::string> inputFiles);
+
+    /** Builds queued scenes until the manager is destroyed. */
+    void run_worker();
+
+    /** Makes the scene, then loads its buffers from the cache or builds them. */
+    void run_build(SceneBuild &build) const;
+
+    /** Generates the scene's world and serializes its BVHs into the scene's buffers. */
+    void build_scene(Scene &scene, SceneBuild &build) const;
+
+    /**
+     * @return The scene's binary BVH collapsed into a wide one, or an empty one if it is too deep for the shader's
+     * traversal stack, leaving the scene with only its binary BVH.
+     */
+    [[nodiscard]] WideBVH collapse_wide_bvh(const Scene &scene) const;
+
+    /**
+     * Writes the wide BVH padded to the size of the binary node buffer, which it never outgrows, so editing the scene
+     * only resizes it along with the binary one.
+     */
+    void write_padded_wide_bvh(Scene &scene, const WideBVH &wideBvh, SceneEdit &edit) const;
+
+    /** Threads and collapses the edited BVH again, recording the entries that changed. */
+    void update_editable_scene(Scene &scene, SceneEdit &edit) const;
+
+    /** @return A hash of everything a static scene's buffers are built from. */
+    [[nodiscard]] uint64_t cache_key(const Scene &scene, const std::vector<std::string> &inputFiles) const;
+
+    void write_report(const BVHReport &report) const;
+
+private:
+    std::unordered_map<std::string, std::unique_ptr<SceneBuild>> builds; // Never move, since the workers point to them.
+    std::vector<std::thread> workers; // Started by the first request.
+    std::deque<SceneBuild *> queue;
+    std::mutex queueMutex; // Guards the queue, and every change of a build's status made by a worker.
+    std::condition_variable queueCondition; // Signaled when a build is queued or the workers should stop.
+    std::condition_variable builtCondition; // Signaled when a build is done.
+    bool isStopping {false};
 };
\ No newline at end of file
@@ -10,6 +10,7 @@
 
 #include <deque>
 #include <functional>
+#include <mutex>
 #include <ranges>
 #include <string>
 #include <unordered_map>
@@ -39,6 +40,28 @@ struct MeshPushConstants {
 };
 
 
+/** Selects the nodes refit by a single dispatch of `refit.comp`. */
+struct RefitPushConstants {
+    uint32_t start; // First entry of the refit order (or of the wide BVH's binary indices) to refit.
+    uint32_t count;
+    uint32_t mode;  // 0 refits binary nodes, 1 refits wide nodes, 2 refits quantized wide nodes.
+};
+
+/** Passes of `build.comp`, in the order they are dispatched. Must match `build.comp`. */
+enum class BuildPass : uint32_t {
+    reset, bounds, morton, count, scan, scatter, emit, fit, thread,
+};
+
+/** Selects the pass run by a single dispatch of `build.comp`. */
+struct BuildPushConstants {
+    uint32_t pass;
+    uint32_t count;     // Invocations that have any work in this pass.
+    uint32_t shift;     // Lowest bit of the Morton code digit a radix sort pass sorts by.
+    uint32_t numBlocks; // Blocks of 256 Morton codes the radix sort works on.
+    uint32_t numSpheres, numQuads, numTris;
+};
+
+
 struct Material {
     vk::raii::DescriptorSet textureSet = nullptr;
     // Note: We store `vk::Pipeline` and layout by value, not pointer. They are 64-bit handles to internal driver
@@ -97,6 +120,7 @@ struct FrameData {
     // --- Memory ---
     AllocatedBuffer objectBuffer;
     vk::raii::DescriptorSet objectDescriptor = nullptr;
+    DeletionQueue deletionQueue; // Flushed once the frame's commands are done, e.g., to free the staging buffers they read.
 };
 
 
@@ -108,6 +132,14 @@ struct UploadContext {
 };
 
 
+/** Copy from a staging buffer that is recorded into the next frame, so no frame in flight has to be waited for. */
+struct StagedCopy {
+    AllocatedBuffer stagingBuffer;
+    vk::Buffer buffer;
+    std::vector<vk::BufferCopy> regions;
+};
+
+
 struct Texture {
     AllocatedImage image;
     vk::raii::Sampler sampler = nullptr;
@@ -172,6 +204,7 @@ public:
 
     // --- Memory ---
     DeletionQueue mainDeletionQueue;
+    DeletionQueue sceneDeletionQueue; // Everything `init_descriptors()` creates for the current scene.
     vma::UniqueAllocator allocator;
     UploadContext uploadContext;
     vkutil::DescriptorLayoutCache layoutCache;
@@ -181,6 +214,8 @@ public:
     std::vector<RenderObject> renderables;
     std::unordered_map<std::string, Material> materials;
     std::unordered_map<std::string, Mesh> meshes;
+    std::unordered_map<uint32_t, std::shared_ptr<BottomLevelBVH>> fumoBvhs; // By material handle.
+    std::mutex fumoBvhMutex; // Scenes using the Cirno mesh may be built at the same time.
     GPUSceneData sceneParameters;
     AllocatedBuffer sceneParameterBuffer;
 
@@ -204,9 +239,28 @@ public:
     AllocatedBuffer computeParameterBuffer;
     SceneManager sceneManager;
     Scene currentScene;
+    std::string requestedSceneName; // Picked while it was still being built, so it is swapped to once it is ready.
     std::unordered_map<std::string, std::unique_ptr<vkutil::Descriptor>> descriptors;
     std::unordered_map<std::string, std::unique_ptr<vk::raii::ShaderModule>> shaderModules;
     bool shouldRecreateSwapchain {false};
+    bool shouldTraverseWideBVH {true}; // Traverses the `WideBVH` instead of the binary BVH.
+    bool shouldTraverseQuantizedBVH {false}; // Traverses the quantized nodes of the `WideBVH` instead.
+    bool shouldFollowOctantLinks {true}; // Traverses the binary BVH near child first, by the links of the ray's octant.
+
+    // --- Animation ---
+    AllocatedBuffer computeBvhBuffer, computeWideBvhBuffer, computeQuantizedWideBvhBuffer, bvhLinksBuffer;
+    AllocatedBuffer sphereObjectBuffer, quadObjectBuffer, triObjectBuffer, instanceObjectBuffer;
+    AllocatedBuffer meshTriObjectBuffer, meshVertexBuffer;
+    std::vector<uint32_t> refitLevelOffsets; // Levels of the refit order uploaded for the current scene.
+    std::vector<StagedCopy> stagedCopies; // Recorded before the next frame traces (or refits) the scene.
+    bool shouldAnimate {false};
+    bool shouldRefitOnGPU {true}; // Refits the uploaded BVHs with `refit.comp` instead of uploading the CPU's refit.
+    bool shouldDispatchRefit {false};
+    bool shouldDispatchBuild {false}; // Builds the BVH of the current scene with `build.comp` before the next frame.
+    float animationTimeSeconds {};
+
+    // --- Editing ---
+    std::unordered_map<std::string, std::vector<std::shared_ptr<Hittable>>> insertedObjects; // By scene, removed last first.
 //    vk::Viewport viewport;
 //    vk::Rect2D scissor;
 
@@ -243,11 +297,50 @@ private:
 
     void upload_mesh(Mesh &mesh);
 
-    template<typename T, typename U=T>
-    void upload_buffer(AllocatedBuffer &buffer, std::vector<T> &objects);
+    template<typename T>
+    void upload_buffer(AllocatedBuffer &buffer, const std::vector<T> &objects);
+
+    /** Uploads only the given entries, copying every run of consecutive ones as a single region. */
+    template<typename U>
+    void upload_buffer_entries(AllocatedBuffer &buffer, const std::vector<U> &objects, std::vector<uint32_t> indices);
+
+    /** Like `upload_buffer_entries()`, but the entries are copied by the next frame, before it reads the buffer. */
+    template<typename U>
+    void stage_buffer_entries(AllocatedBuffer &buffer, const std::vector<U> &objects, std::vector<uint32_t> indices);
+
+    /** @return A copy of the given entries from a staging buffer they are packed into, one region per run of them. */
+    template<typename U>
+    StagedCopy pack_buffer_entries(AllocatedBuffer &buffer, const std::vector<U> &objects, std::vector<uint32_t> indices);
+
+    /**
+     * @return The bottom-level BVH of the Cirno mesh with the given material, built over its triangles in object space
+     * the first time a scene asks for it. Called by the threads building scenes.
+     */
+    std::shared_ptr<BottomLevelBVH> get_fumo_bvh(const RTMaterial &material);
 
     void swap_scene(const std::string &sceneName);
 
+    /**
+     * Moves the current scene's objects and stages the primitives that moved, whose nodes `draw()` refits on the GPU if
+     * enabled. Otherwise, the CPU's refit is uploaded once no frame reads the nodes anymore.
+     */
+    void animate_scene(float deltaSeconds);
+
+    /** Uploads what an edit of the current scene changed, or recreates every buffer if one of them had to grow. */
+    void apply_scene_edit(const SceneEdit &edit);
+
+    /** Records the staged copies, ordered after the reads of earlier frames and before the reads of this one. */
+    void record_staged_copies(const vk::raii::CommandBuffer &commandBuffer);
+
+    /** Frees the staging buffers of the copies not recorded yet, e.g., since their buffers are about to be recreated. */
+    void discard_staged_copies();
+
+    /** Records one dispatch per level of the refit order, then refits the wide BVH. */
+    void record_refit(const vk::raii::CommandBuffer &commandBuffer);
+
+    /** Records every pass of the BVH build, from the Morton codes of the primitives to the threaded nodes. */
+    void record_build(const vk::raii::CommandBuffer &commandBuffer);
+
     void draw_objects(const vk::raii::CommandBuffer &commandBuffer, RenderObject *first, uint32_t count);
 
     /** Creates a material and adds it to a map. */
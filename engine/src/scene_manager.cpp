@@ -1,18 +1,409 @@
 #include "../include/scene_manager.h"
 
-void SceneManager::init_scene(Scene scene, const std::function<std::shared_ptr<BVHNode>()> &&worldGenerator) {
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+
+SceneManager::~SceneManager() {
+    {
+        auto lock = std::lock_guard(queueMutex);
+        isStopping = true;
+        for (auto *build : queue) build->status = SceneStatus::registered;
+        queue.clear();
+    }
+    queueCondition.notify_all();
+    for (auto &worker : workers) worker.join();
+}
+
+void SceneManager::init_scene(Scene scene, WorldGenerator &&worldGenerator, WorldAnimator &&animator, std::vector<std::string> inputFiles) {
+    auto name = scene.name;
+    register_scene(name, [scene = std::move(scene)]() { return scene; }, std::move(worldGenerator), std::move(animator), std::move(inputFiles));
+}
+
+void SceneManager::init_scene_file(const std::string &path, SceneFile::MeshResolver resolveMesh, std::vector<std::string> inputFiles) {
+    // Shared by both steps of the build, which are the only ones to touch it.
+    auto file = std::make_shared<SceneFile>();
+    auto makeScene = [path, file]() {
+        auto loadStart = std::chrono::high_resolution_clock::now();
+        *file = SceneFile::load_and_compile(path);
+        auto loadTimeMs = (double) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - loadStart).count() / 1E3;
+        std::cout << "   --- Loaded \"" << path << "\" in " << loadTimeMs << "ms (" << file->primitives.size() << " primitives, "
+                  << file->meshes.size() << " meshes)...\n";
+        return file->make_scene();
+    };
+    auto makeWorld = [file, resolveMesh = std::move(resolveMesh)]() { return file->make_world(resolveMesh); };
+
+    inputFiles.push_back(path);
+    register_scene(std::filesystem::path(path).stem().string(), std::move(makeScene), std::move(makeWorld), {}, std::move(inputFiles));
+}
+
+void SceneManager::register_scene(const std::string &name, std::function<Scene()> &&makeScene, WorldGenerator &&worldGenerator,
+                                  WorldAnimator &&animator, std::vector<std::string> inputFiles) {
+    if (builds.contains(name))
+        throw std::runtime_error("ERROR: Scene \"" + name + "\" is registered twice!");
+
+    auto build = std::make_unique<SceneBuild>();
+    build->name = name;
+    build->makeScene = std::move(makeScene);
+    build->worldGenerator = std::move(worldGenerator);
+    build->animator = std::move(animator);
+    build->inputFiles = std::move(inputFiles);
+    builds[name] = std::move(build);
+    sceneNames.push_back(name);
+}
+
+void SceneManager::request_scene(const std::string &name) {
+    auto build = builds.find(name);
+    if (build == builds.end())
+        throw std::runtime_error("ERROR: Scene \"" + name + "\" was never registered!");
+
+    {
+        auto lock = std::lock_guard(queueMutex);
+        if (build->second->status != SceneStatus::registered) return;
+        build->second->status = SceneStatus::queued;
+        queue.push_back(build->second.get());
+
+        if (workers.empty()) {
+            for (int i = 0; i < std::max(numBuildThreads, 1); i++) workers.emplace_back(&SceneManager::run_worker, this);
+        }
+    }
+    queueCondition.notify_one();
+}
+
+Scene *SceneManager::wait_for_scene(const std::string &name) {
+    request_scene(name);
+    auto &build = *builds.at(name);
+    {
+        auto lock = std::unique_lock(queueMutex);
+        builtCondition.wait(lock, [&build]() {
+            auto status = build.status.load();
+            return status == SceneStatus::built || status == SceneStatus::ready || status == SceneStatus::failed;
+        });
+    }
+    if (build.status == SceneStatus::failed)
+        throw std::runtime_error(build.error);
+
+    publish_built_scenes();
+    return get_scene(name);
+}
+
+void SceneManager::publish_built_scenes() {
+    for (auto &[name, build] : builds) {
+        if (build->status != SceneStatus::built) continue;
+
+        scenes[name] = std::move(build->scene);
+        if (build->animatedScene) animatedScenes[name] = std::move(*build->animatedScene);
+        if (build->dynamicBvh) editableScenes[name] = std::move(*build->dynamicBvh);
+        build->animatedScene.reset();
+        build->dynamicBvh.reset();
+
+        // Nothing is built twice, so whatever the generators hold on to (e.g., a loaded scene file) can go.
+        build->makeScene = {};
+        build->worldGenerator = {};
+        build->status = SceneStatus::ready;
+    }
+}
+
+SceneProgress SceneManager::get_progress(const std::string &name) const {
+    const auto &build = *builds.at(name);
+    return {build.status, build.progress, build.phase};
+}
+
+void SceneManager::run_worker() {
+    while (true) {
+        SceneBuild *build;
+        {
+            auto lock = std::unique_lock(queueMutex);
+            queueCondition.wait(lock, [this]() { return isStopping || !queue.empty(); });
+            if (isStopping) return;
+            build = queue.front();
+            queue.pop_front();
+            build->status = SceneStatus::building;
+        }
+
+        auto status = SceneStatus::built;
+        try {
+            run_build(*build);
+        } catch (const std::exception &error) {
+            std::cerr << error.what() << " (while building scene \"" << build->name << "\")" << std::endl;
+            build->error = error.what();
+            status = SceneStatus::failed;
+        }
+
+        {
+            auto lock = std::lock_guard(queueMutex);
+            build->status = status;
+        }
+        builtCondition.notify_all();
+    }
+}
+
+void SceneManager::run_build(SceneBuild &build) const {
     std::cout << "\n +---------------------------------------------+\n";
-    std::cout << " | Generating scene \"" << scene.name << "\"...                 |\n";
+    std::cout << " | Generating scene \"" << build.name << "\"...                 |\n";
     std::cout << " +---------------------------------------------+" << std::endl;
-    worldGenerator()->gpu_serialize(scene);
 
-    scenes[scene.name] = std::make_unique<Scene>(scene);
+    build.begin_phase("loading", 0.0f);
+    auto scene = build.makeScene();
+    scene.name = build.name;
+
+    // Animated scenes need their objects to move them, so only static scenes can skip generating their world.
+    auto cache = SceneCache(cacheDirectory);
+    auto shouldCache = !build.animator && !editableSceneNames.contains(scene.name) && !cacheDirectory.empty();
+    auto cacheKey = shouldCache ? cache_key(scene, build.inputFiles) : 0;
+
+    auto loadStart = std::chrono::high_resolution_clock::now();
+    if (shouldCache && cache.load(scene, cacheKey)) {
+        auto loadTimeMs = (double) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - loadStart).count() / 1E3;
+        std::cout << "   --- Loaded scene from \"" << cache.path(scene) << "\" in " << loadTimeMs << "ms...\n";
+    } else {
+        build_scene(scene, build);
+        if (shouldCache) {
+            build.begin_phase("caching", 0.95f);
+            cache.save(scene, cacheKey);
+            std::cout << "   --- Cached scene to \"" << cache.path(scene) << "\"...\n";
+        }
+    }
 
     auto numMaterials = scene.materials.size(), numTextures = scene.textures.size();
     if (numMaterials > 0) std::cout << "   --- Registered " << scene.materials.size() << " materials...\n";
     if (numTextures > 0)  std::cout << "   --- Registered " << scene.textures.size()  << " textures...\n" << std::endl;
+    build.scene = std::make_unique<Scene>(std::move(scene));
+    build.progress = 1.0f;
+}
+
+void SceneManager::build_scene(Scene &scene, SceneBuild &build) const {
+    auto phaseStart = std::chrono::high_resolution_clock::now();
+    auto end_phase = [&phaseStart]() {
+        auto phaseEnd = std::chrono::high_resolution_clock::now();
+        auto phaseTimeMs = (double) std::chrono::duration_cast<std::chrono::microseconds>(phaseEnd - phaseStart).count() / 1E3;
+        phaseStart = phaseEnd;
+        return phaseTimeMs;
+    };
+
+    build.begin_phase("generating", 0.05f);
+    auto world = build.worldGenerator();
+    auto generateTimeMs = end_phase();
+
+    auto isAnimated = (bool) build.animator;
+    auto isEditable = editableSceneNames.contains(scene.name);
+    auto isFlat = shouldBuildFlat || isAnimated || isEditable;
+    if (isAnimated && isEditable)
+        throw std::runtime_error("ERROR: Scene \"" + scene.name + "\" cannot be both animated and editable!");
+
+    if (gpuBuiltSceneNames.contains(scene.name)) {
+        if (isAnimated || isEditable)
+            throw std::runtime_error("ERROR: Scene \"" + scene.name + "\" is built on the GPU, so it cannot be animated or edited!");
+        build.begin_phase("serializing", 0.75f);
+        for (const auto &object : world) {
+            if (dynamic_cast<const Instance *>(object.get()) != nullptr)
+                throw std::runtime_error("ERROR: Scenes built on the GPU cannot hold instances!");
+            if (dynamic_cast<const TriMesh *>(object.get()) != nullptr)
+                throw std::runtime_error("ERROR: Scenes built on the GPU cannot hold meshes!");
+            object->gpu_serialize(scene);
+        }
+        // Its BVH has a leaf per primitive, so its node count (2 * primitives - 1) would wrap around without any.
+        if (scene.buffer_size(Hittable::Type::sphere) + scene.buffer_size(Hittable::Type::quad) + scene.buffer_size(Hittable::Type::tri) == 0)
+            throw std::runtime_error("ERROR: Scene \"" + scene.name + "\" is built on the GPU, so it needs at least one primitive!");
+        std::cout << "   --- Serialized " << world.size() << " objects in " << end_phase() << "ms (BVH is built on the GPU)...\n";
+        return;
+    }
+
+    build.begin_phase("building", 0.2f);
+    float sahCost;
+    double buildTimeMs, optimizeTimeMs = 0.0;
+    auto flatBvh = FlatBVH();
+    if (isEditable) {
+        auto dynamicBvh = DynamicBVH(scene, world, buildOptions);
+        sahCost = dynamicBvh.sah_cost();
+        buildTimeMs = end_phase();
+        std::cout << "   --- Built dynamic BVH over " << world.size() << " objects in " << buildTimeMs << "ms (method: "
+                  << to_string(buildOptions.method) << ", SAH cost: " << sahCost << ")...\n";
+        build.dynamicBvh = std::move(dynamicBvh);
+    } else if (isFlat) {
+        flatBvh = FlatBVH(world, buildOptions);
+        sahCost = flatBvh.sah_cost();
+        buildTimeMs = end_phase();
+        std::cout << "   --- Built flat BVH over " << world.size() << " objects in " << buildTimeMs << "ms (method: "
+                  << to_string(buildOptions.method) << ", SAH cost: " << sahCost << ")...\n";
+
+        // Static scenes are traced far longer than they take to build, while animated ones may be rebuilt any frame.
+        if (!isAnimated && numOptimizationPasses > 0) {
+            build.begin_phase("optimizing", 0.5f);
+            flatBvh.optimize(numOptimizationPasses, buildOptions.shouldBuildParallel);
+            sahCost = flatBvh.sah_cost();
+            optimizeTimeMs = end_phase();
+            std::cout << "   --- Restructured BVH treelets in " << optimizeTimeMs << "ms (passes: " << numOptimizationPasses
+                      << ", SAH cost: " << sahCost << ")...\n";
+        }
+        build.begin_phase("serializing", 0.75f);
+        flatBvh.reorder(nodeLayout);
+        flatBvh.gpu_serialize(scene, world);
+    } else {
+        auto bvh = BVHNode(world, 0, (int) world.size(), buildOptions);
+        sahCost = bvh.sah_cost();
+        buildTimeMs = end_phase();
+        std::cout << "   --- Built BVH over " << world.size() << " objects in " << buildTimeMs << "ms (method: "
+                  << to_string(buildOptions.method) << ", SAH cost: " << sahCost << ")...\n";
+        build.begin_phase("serializing", 0.75f);
+        bvh.gpu_serialize(scene);
+    }
+    BVHNode::gpu_serialize_octant_links(scene);
+    auto serializeTimeMs = end_phase();
+
+    build.begin_phase("collapsing", 0.85f);
+    auto wideBvh = collapse_wide_bvh(scene);
+    if (isEditable) {
+        auto edit = SceneEdit();
+        write_padded_wide_bvh(scene, wideBvh, edit);
+    } else {
+        wideBvh.gpu_serialize(scene);
+    }
+    auto collapseTimeMs = end_phase();
+    if (!wideBvh.nodes.empty()) {
+        std::cout << "   --- Collapsed BVH into " << wideBvh.nodes.size() / (wideBVHWidth / 4) << ' ' << wideBVHWidth
+                  << "-wide nodes (traversal stack: " << wideBvh.maxStackSize << ")...\n";
+    }
+
+    auto report = BVHReport(scene);
+    report.buildMethod = std::string(isEditable ? "dynamic " : isFlat ? "flat " : "") + to_string(buildOptions.method);
+    report.layout = isEditable ? "insertion order" : isFlat ? to_string(nodeLayout) : "sibling pairs";
+    report.numObjects = (uint32_t) world.size();
+    report.wideBvhWidth = wideBVHWidth;
+    report.numWideNodes = (uint32_t) (wideBvh.nodes.size() / (wideBVHWidth / 4));
+    report.add_phase("generate", generateTimeMs);
+    report.add_phase("build", buildTimeMs);
+    if (optimizeTimeMs > 0.0) report.add_phase("optimize", optimizeTimeMs);
+    report.add_phase("serialize", serializeTimeMs);
+    report.add_phase("collapse", collapseTimeMs);
+    report.print();
+    write_report(report);
+
+    if (isAnimated) build.animatedScene = AnimatedScene {world, std::move(build.animator), std::move(flatBvh), wideBvh, sahCost};
+}
+
+WideBVH SceneManager::collapse_wide_bvh(const Scene &scene) const {
+    auto wideBvh = WideBVH(scene.get_buffer<BVHNode::GPU_t>(Hittable::Type::bvhNode), wideBVHWidth);
+    if (wideBvh.fits_stack()) return wideBvh;
+
+    std::cout << "   --- Wide BVH of scene \"" << scene.name << "\" needs a traversal stack of " << wideBvh.maxStackSize
+              << " (max: " << WIDE_BVH_STACK_SIZE << "), so only its binary BVH is traversed..." << std::endl;
+    return {};
+}
+
+void SceneManager::write_padded_wide_bvh(Scene &scene, const WideBVH &wideBvh, SceneEdit &edit) const {
+    auto numNodes = !wideBvh.nodes.empty() ? scene.buffer_size(Hittable::Type::bvhNode) : 0;
+    auto nodes = wideBvh.nodes;
+    nodes.resize(numNodes);
+    auto quantizedNodes = std::vector<WideBVH::QuantizedGPU_t>(numNodes);
+    for (size_t i = 0; i < numNodes; i++) quantizedNodes[i] = WideBVH::quantize(nodes[i]);
+
+    scene.update_buffer(Hittable::Type::wideBvhNode, nodes, edit);
+    scene.update_buffer(Hittable::Type::quantizedWideBvhNode, quantizedNodes, edit);
+}
+
+void SceneManager::update_editable_scene(Scene &scene, SceneEdit &edit) const {
+    // Both passes are linear in the number of nodes, but they only compute: it is the upload that has to stay small.
+    const auto &bvh = scene.get_buffer<BVHNode::GPU_t>(Hittable::Type::bvhNode);
+    scene.update_buffer(Hittable::Type::bvhLinks, BVHNode::get_octant_links(bvh), edit);
+    write_padded_wide_bvh(scene, collapse_wide_bvh(scene), edit);
+}
+
+SceneEdit SceneManager::insert_object(const std::string &name, const std::shared_ptr<Hittable> &object) {
+    auto &scene = *scenes.at(name);
+    auto edit = SceneEdit();
+    editableScenes.at(name).insert(scene, object, edit);
+    update_editable_scene(scene, edit);
+    return edit;
+}
+
+SceneEdit SceneManager::remove_object(const std::string &name, const std::shared_ptr<Hittable> &object) {
+    auto &scene = *scenes.at(name);
+    auto edit = SceneEdit();
+    editableScenes.at(name).remove(scene, object, edit);
+    update_editable_scene(scene, edit);
+    return edit;
+}
+
+uint64_t SceneManager::cache_key(const Scene &scene, const std::vector<std::string> &inputFiles) const {
+    auto key = SceneCache::hash(scene.name.data(), scene.name.size());
+    auto hash_value = [&key](const auto &value) { key = SceneCache::hash(&value, sizeof(value), key); };
+
+    // Every setting that changes the built buffers. Whether the build ran in parallel does not.
+    hash_value(buildOptions.method);
+    hash_value(buildOptions.numBins);
+    hash_value(buildOptions.shouldUseWideMortonCodes);
+    hash_value(buildOptions.numRefinedLevels);
+    hash_value(buildOptions.maxLeafSize);
+    hash_value(buildOptions.maxDuplication);
+    hash_value(shouldBuildFlat);
+    hash_value(wideBVHWidth);
+    hash_value(numOptimizationPasses);
+    hash_value(nodeLayout);
+    hash_value(gpuBuiltSceneNames.contains(scene.name));
+
+    key = SceneCache::hash(generatorVersion.data(), generatorVersion.size(), key);
+    for (const auto &path : inputFiles) {
+        key = SceneCache::hash(path.data(), path.size(), key);
+        key = SceneCache::hash_file(path, key);
+    }
+    return key;
+}
+
+void SceneManager::write_report(const BVHReport &report) const {
+    if (reportDirectory.empty()) return;
+
+    std::filesystem::create_directories(reportDirectory);
+    auto path = std::filesystem::path(reportDirectory) / (report.sceneName + ".json");
+    std::ofstream file(path);
+    if (!file.is_open())
+        throw std::runtime_error("ERROR: Could not write BVH report to \"" + path.string() + "\"!");
+    file << report.to_json();
+    std::cout << "   --- Wrote BVH report to \"" << path.string() << "\"...\n";
 }
 
 Scene *SceneManager::get_scene(const std::string &name) {
-    return scenes[name].get();
+    auto scene = scenes.find(name);
+    return scene != scenes.end() ? scene->second.get() : nullptr;
+}
+
+SceneEdit SceneManager::update_scene(const std::string &name, float timeSeconds, bool shouldWriteNodes) {
+    auto &animatedScene = animatedScenes.at(name);
+    auto &scene = *scenes.at(name);
+    animatedScene.animator(animatedScene.world, timeSeconds);
+
+    // Refitting keeps the topology of the tree, so its quality only ever gets worse as objects keep moving. The tree is
+    // refit on the CPU even if the GPU refits the uploaded nodes, since its cost is what tells when to rebuild.
+    animatedScene.bvh.refit(animatedScene.world, buildOptions.shouldBuildParallel);
+    auto sahCost = animatedScene.bvh.sah_cost();
+    auto edit = SceneEdit();
+    if (sahCost > maxRefitCostRatio * animatedScene.builtCost) {
+        animatedScene.bvh = FlatBVH(animatedScene.world, buildOptions);
+        animatedScene.bvh.reorder(nodeLayout);
+        animatedScene.builtCost = animatedScene.bvh.sah_cost();
+        std::cout << "   --- Rebuilt BVH of scene \"" << name << "\" (SAH cost: " << sahCost << " -> " << animatedScene.builtCost << ")..." << std::endl;
+
+        scene.clear_buffers();
+        animatedScene.bvh.gpu_serialize(scene, animatedScene.world);
+        BVHNode::gpu_serialize_octant_links(scene);
+        animatedScene.wideBvh = collapse_wide_bvh(scene);
+        animatedScene.wideBvh.gpu_serialize(scene);
+        edit.hasResized = true;
+        return edit;
+    }
+
+    animatedScene.bvh.gpu_serialize_primitives(scene, animatedScene.world, edit);
+    if (shouldWriteNodes) {
+        // The tree was serialized first, so its nodes keep their indices.
+        auto &bvh = scene.get_buffer<BVHNode::GPU_t>(Hittable::Type::bvhNode);
+        const auto &nodes = animatedScene.bvh.nodes;
+        for (size_t i = 0; i < nodes.size(); i++) bvh[i].aabb = nodes[i].aabb;
+
+        animatedScene.wideBvh.refit(bvh);
+        scene.get_buffer<WideBVH::GPU_t>(Hittable::Type::wideBvhNode).clear();
+        scene.get_buffer<WideBVH::QuantizedGPU_t>(Hittable::Type::quantizedWideBvhNode).clear();
+        animatedScene.wideBvh.gpu_serialize(scene);
+    }
+    return edit;
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include "vk_initializers.h"
 #include "vk_material.h"
 #include "vk_textures.h"
+#include "material_registry.h"
 #include "primitives.h"
 
 #include <imgui.h>
@@ -20,6 +21,8 @@
 #include <vk_mem_alloc.h>
 #include <vulkan-memory-allocator-hpp/vk_mem_alloc.hpp>
 
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 
 // We want to immediately abort when there is an error. In normal engines, this would give an error message to the
@@ -427,6 +430,8 @@ void VulkanEngine::init_shaders() {
     std::string shaderBaseDirectory = "../shaders/";
     std::string shaderNames[] = {
         "compute.comp",
+        "refit.comp",
+        "build.comp",
         "compute.vert",
         "compute.frag",
     };
@@ -567,6 +572,77 @@ void VulkanEngine::init_pipelines() {
     auto computePipeline = pipelineBuilder.build_compute_pipeline(device);
     create_material(std::move(computePipeline), std::move(computePipelineLayout), "compute");
 
+    // --- Specialized Compute Pipelines ---
+    // Same shader, specialized to follow the octant links of the binary BVH, or to traverse the wide BVH (or its
+    // quantized encoding) instead.
+    struct {
+        uint32_t bvhWidth;
+        vk::Bool32 isQuantized;
+        vk::Bool32 hasOctantLinks;
+    } specialization {2, false, true};
+    auto specializationEntries = std::array {
+        vk::SpecializationMapEntry(0, offsetof(decltype(specialization), bvhWidth), sizeof(uint32_t)),
+        vk::SpecializationMapEntry(1, offsetof(decltype(specialization), isQuantized), sizeof(vk::Bool32)),
+        vk::SpecializationMapEntry(2, offsetof(decltype(specialization), hasOctantLinks), sizeof(vk::Bool32)),
+    };
+    auto specializationInfo = vk::SpecializationInfo((uint32_t) specializationEntries.size(), specializationEntries.data(), sizeof(specialization), &specialization);
+    pipelineBuilder.shaderStages.front().pSpecializationInfo = &specializationInfo;
+
+    auto octantComputePipelineLayout = vk::raii::PipelineLayout(device, computePipelineLayoutInfo);
+    pipelineBuilder.pipelineLayout = *octantComputePipelineLayout;
+    auto octantComputePipeline = pipelineBuilder.build_compute_pipeline(device);
+    create_material(std::move(octantComputePipeline), std::move(octantComputePipelineLayout), "compute_octant");
+
+    specialization = {(uint32_t) sceneManager.wideBVHWidth, false, false};
+    for (auto isQuantized : {false, true}) {
+        specialization.isQuantized = isQuantized;
+        auto wideComputePipelineLayout = vk::raii::PipelineLayout(device, computePipelineLayoutInfo);
+        pipelineBuilder.pipelineLayout = *wideComputePipelineLayout;
+
+        auto wideComputePipeline = pipelineBuilder.build_compute_pipeline(device);
+        create_material(std::move(wideComputePipeline), std::move(wideComputePipelineLayout), isQuantized ? "compute_wide_quantized" : "compute_wide");
+    }
+
+    // --- Refit Compute Pipeline ---
+    if (sceneManager.animatedScenes.contains(currentScene.name)) {
+        std::cout << "   --- Creating refit pipeline..." << std::endl;
+        auto refitPushConstant = vk::PushConstantRange(vk::ShaderStageFlagBits::eCompute, 0, sizeof(RefitPushConstants));
+        auto refitPipelineLayoutInfo = vkinit::pipeline_layout_create_info();
+        refitPipelineLayoutInfo.setLayoutCount = 1;
+        refitPipelineLayoutInfo.pSetLayouts = &descriptors["refit"]->layout;
+        refitPipelineLayoutInfo.pushConstantRangeCount = 1;
+        refitPipelineLayoutInfo.pPushConstantRanges = &refitPushConstant;
+
+        auto refitPipelineLayout = vk::raii::PipelineLayout(device, refitPipelineLayoutInfo);
+
+        pipelineBuilder.shaderStages.clear(); // Clear the shader stages for the builder
+        pipelineBuilder.shaderStages.push_back(vkinit::pipeline_shader_stage_create_info(vk::ShaderStageFlagBits::eCompute, **shaderModules["refit.comp"]));
+        pipelineBuilder.pipelineLayout = *refitPipelineLayout;
+
+        auto refitPipeline = pipelineBuilder.build_compute_pipeline(device);
+        create_material(std::move(refitPipeline), std::move(refitPipelineLayout), "refit");
+    }
+
+    // --- Build Compute Pipeline ---
+    if (sceneManager.gpuBuiltSceneNames.contains(currentScene.name)) {
+        std::cout << "   --- Creating build pipeline..." << std::endl;
+        auto buildPushConstant = vk::PushConstantRange(vk::ShaderStageFlagBits::eCompute, 0, sizeof(BuildPushConstants));
+        auto buildPipelineLayoutInfo = vkinit::pipeline_layout_create_info();
+        buildPipelineLayoutInfo.setLayoutCount = 1;
+        buildPipelineLayoutInfo.pSetLayouts = &descriptors["build"]->layout;
+        buildPipelineLayoutInfo.pushConstantRangeCount = 1;
+        buildPipelineLayoutInfo.pPushConstantRanges = &buildPushConstant;
+
+        auto buildPipelineLayout = vk::raii::PipelineLayout(device, buildPipelineLayoutInfo);
+
+        pipelineBuilder.shaderStages.clear(); // Clear the shader stages for the builder
+        pipelineBuilder.shaderStages.push_back(vkinit::pipeline_shader_stage_create_info(vk::ShaderStageFlagBits::eCompute, **shaderModules["build.comp"]));
+        pipelineBuilder.pipelineLayout = *buildPipelineLayout;
+
+        auto buildPipeline = pipelineBuilder.build_compute_pipeline(device);
+        create_material(std::move(buildPipeline), std::move(buildPipelineLayout), "build");
+    }
+
     // --- Graphics Pipeline Layout ---
     std::cout << "   --- Creating graphics pipeline..." << std::endl;
     auto graphicsPipelineLayoutInfo = computePipelineLayoutInfo;
@@ -653,9 +729,9 @@ void VulkanEngine::upload_mesh(Mesh &mesh) {
 }
 
 
-template<typename T, typename U>
-void VulkanEngine::upload_buffer(AllocatedBuffer &buffer, std::vector<T> &objects) {
-    const auto bufferSize = sizeof(U) * objects.size();
+template<typename T>
+void VulkanEngine::upload_buffer(AllocatedBuffer &buffer, const std::vector<T> &objects) {
+    const auto bufferSize = sizeof(T) * objects.size();
 
     if (bufferSize == 0) return;
 
@@ -665,19 +741,11 @@ void VulkanEngine::upload_buffer(AllocatedBuffer &buffer, std::vector<T> &object
     auto stagingBuffer = create_buffer(bufferSize, vk::BufferUsageFlagBits::eTransferSrc, vma::MemoryUsage::eCpuOnly);
 
     // To push data into a vk::Buffer, we need to map it first. Mapping a buffer will give us a pointer and, once we are
-    // done with writing the data, we can unmap.
-    U *objectSSBO;
-    vk_check(allocator->mapMemory(stagingBuffer.allocation, (void **) &objectSSBO));
-    // Instead of using `memcpy` here, we cast `void*` to another type (Shader Storage Buffer Object) and write to it
-    // normally.
-    for (uint32_t i = 0; i < objects.size(); i++) {
-        if constexpr (std::is_same<T, std::any>::value)
-            objectSSBO[i] = static_cast<std::any>(objects[i]).has_value() ? std::any_cast<U>(objects[i]) : U();
-        else if constexpr (!std::is_same<T, U>::value)
-            objectSSBO[i] = dynamic_cast<U>(objects[i]);
-        else
-            objectSSBO[i] = objects[i];
-    }
+    // done with writing the data, we can unmap. The objects are laid out exactly like the GPU expects them, so they are
+    // copied in one go.
+    void *objectSSBO;
+    vk_check(allocator->mapMemory(stagingBuffer.allocation, &objectSSBO));
+    std::memcpy(objectSSBO, objects.data(), bufferSize);
     allocator->unmapMemory(stagingBuffer.allocation);
 
     // --- Copy Staging Buffer to GPU ---
@@ -690,6 +758,71 @@ void VulkanEngine::upload_buffer(AllocatedBuffer &buffer, std::vector<T> &object
 }
 
 
+template<typename U>
+void VulkanEngine::upload_buffer_entries(AllocatedBuffer &buffer, const std::vector<U> &objects, std::vector<uint32_t> indices) {
+    if (indices.empty()) return;
+    auto copy = pack_buffer_entries(buffer, objects, std::move(indices));
+
+    immediate_submit([&](vk::CommandBuffer commandBuffer) {
+        commandBuffer.copyBuffer(copy.stagingBuffer.buffer, copy.buffer, copy.regions);
+    });
+
+    allocator->destroyBuffer(copy.stagingBuffer.buffer, copy.stagingBuffer.allocation); // Delete immediately.
+}
+
+
+template<typename U>
+void VulkanEngine::stage_buffer_entries(AllocatedBuffer &buffer, const std::vector<U> &objects, std::vector<uint32_t> indices) {
+    if (indices.empty()) return;
+    stagedCopies.push_back(pack_buffer_entries(buffer, objects, std::move(indices)));
+}
+
+
+template<typename U>
+StagedCopy VulkanEngine::pack_buffer_entries(AllocatedBuffer &buffer, const std::vector<U> &objects, std::vector<uint32_t> indices) {
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+
+    // Entries are packed into the staging buffer, and each run of consecutive ones is copied to where it belongs.
+    auto copy = StagedCopy();
+    copy.stagingBuffer = create_buffer(sizeof(U) * indices.size(), vk::BufferUsageFlagBits::eTransferSrc, vma::MemoryUsage::eCpuOnly);
+    copy.buffer = buffer.buffer;
+
+    U *objectSSBO;
+    vk_check(allocator->mapMemory(copy.stagingBuffer.allocation, (void **) &objectSSBO));
+    for (uint32_t i = 0; i < indices.size(); i++) {
+        auto index = indices[i];
+        objectSSBO[i] = objects[index];
+        if (i > 0 && indices[i - 1] + 1 == index) {
+            copy.regions.back().size += sizeof(U);
+        } else {
+            copy.regions.emplace_back(sizeof(U) * i, sizeof(U) * index, sizeof(U));
+        }
+    }
+    allocator->unmapMemory(copy.stagingBuffer.allocation);
+    return copy;
+}
+
+
+std::shared_ptr<BottomLevelBVH> VulkanEngine::get_fumo_bvh(const RTMaterial &material) {
+    // Held while building, so scenes asking for the same BVH at the same time wait for it instead of building it twice.
+    auto lock = std::lock_guard(fumoBvhMutex);
+    auto &fumoBvh = fumoBvhs[MaterialRegistry::intern(material)];
+    if (fumoBvh) return fumoBvh;
+    // Read straight from the loaded mesh. It is indexed, so the triangles share their vertices on the GPU instead of
+    // holding a copy of each.
+    const auto &fumoMesh = meshes.at("fumo");
+    auto fumoTris = std::make_shared<TriMesh>(TriMesh::VertexSource::from_vertices(fumoMesh.vertices), fumoMesh.indices, glm::mat4(1.0f),
+                                              material, sceneManager.buildOptions.shouldBuildParallel);
+    auto modelCenter = 0.5f * (fumoTris->bounding_box().min + fumoTris->bounding_box().max);
+    std::cout << "   --- Cirno center: (" << modelCenter.x << ", " << modelCenter.y << ", " << modelCenter.z << ')' << std::endl;
+    std::cout << "   --- Cirno mesh: " << fumoTris->size() << " triangles sharing " << fumoTris->vertices.size() << " vertices..." << std::endl;
+
+    fumoBvh = std::make_shared<BottomLevelBVH>(std::vector<std::shared_ptr<Hittable>> {fumoTris}, sceneManager.buildOptions);
+    return fumoBvh;
+}
+
+
 void VulkanEngine::swap_scene(const std::string &sceneName) {
     std::cout << "\n +---------------------------------------------+\n";
     std::cout << " | Swapping scene to \"" << sceneName << "\"...                |\n";
@@ -745,6 +878,165 @@ void VulkanEngine::swap_scene(const std::string &sceneName) {
 }
 
 
+void VulkanEngine::animate_scene(float deltaSeconds) {
+    animationTimeSeconds += deltaSeconds;
+
+    auto edit = sceneManager.update_scene(currentScene.name, animationTimeSeconds, !shouldRefitOnGPU);
+    const auto &scene = *sceneManager.get_scene(currentScene.name);
+    if (edit.hasResized) {
+        // The BVH was rebuilt, so the node buffers may have changed size and every buffer (and what is built on top of
+        // them) is recreated.
+        currentScene.copy_buffers(scene);
+        recreate_swapchain();
+        return;
+    }
+
+    // Only the primitives that moved are uploaded, by the next frame, so the frames in flight are not waited for.
+    currentScene.copy_entries(scene, edit);
+    stage_buffer_entries(sphereObjectBuffer, currentScene.get_buffer<Sphere::GPU_t>(Hittable::Type::sphere), edit.dirty_indices(Hittable::Type::sphere));
+    stage_buffer_entries(quadObjectBuffer, currentScene.get_buffer<Quad::GPU_t>(Hittable::Type::quad), edit.dirty_indices(Hittable::Type::quad));
+    stage_buffer_entries(triObjectBuffer, currentScene.get_buffer<Tri::GPU_t>(Hittable::Type::tri), edit.dirty_indices(Hittable::Type::tri));
+    stage_buffer_entries(meshTriObjectBuffer, currentScene.get_buffer<TriMesh::GPU_t>(Hittable::Type::meshTri), edit.dirty_indices(Hittable::Type::meshTri));
+    stage_buffer_entries(meshVertexBuffer, currentScene.get_buffer<TriMesh::Vertex_t>(Hittable::Type::meshVertex), edit.dirty_indices(Hittable::Type::meshVertex));
+    stage_buffer_entries(instanceObjectBuffer, currentScene.get_buffer<Instance::GPU_t>(Hittable::Type::instance), edit.dirty_indices(Hittable::Type::instance));
+
+    if (shouldRefitOnGPU) {
+        shouldDispatchRefit = true;
+        return;
+    }
+
+    // Every node may have moved, so the CPU's refit is uploaded whole.
+    device.waitIdle();
+    auto &bvh = currentScene.get_buffer<BVHNode::GPU_t>(Hittable::Type::bvhNode);
+    auto &wideBvh = currentScene.get_buffer<WideBVH::GPU_t>(Hittable::Type::wideBvhNode);
+    auto &quantizedWideBvh = currentScene.get_buffer<WideBVH::QuantizedGPU_t>(Hittable::Type::quantizedWideBvhNode);
+    bvh = scene.get_buffer<BVHNode::GPU_t>(Hittable::Type::bvhNode);
+    wideBvh = scene.get_buffer<WideBVH::GPU_t>(Hittable::Type::wideBvhNode);
+    quantizedWideBvh = scene.get_buffer<WideBVH::QuantizedGPU_t>(Hittable::Type::quantizedWideBvhNode);
+    upload_buffer(computeBvhBuffer, bvh);
+    upload_buffer(computeWideBvhBuffer, wideBvh);
+    upload_buffer(computeQuantizedWideBvhBuffer, quantizedWideBvh);
+}
+
+
+void VulkanEngine::apply_scene_edit(const SceneEdit &edit) {
+    // Frames in flight may still read the buffers that are about to be overwritten.
+    device.waitIdle();
+    auto &scene = *sceneManager.get_scene(currentScene.name);
+    currentScene.camera.props.iteration = 1; // The accumulated image shows the scene as it was.
+
+    if (edit.hasResized) {
+        // A buffer grew (or a material was registered), so every buffer (and its descriptor) is recreated.
+        currentScene.copy_buffers(scene);
+        currentScene.copy_materials(scene);
+        recreate_swapchain();
+        return;
+    }
+
+    currentScene.copy_entries(scene, edit);
+    upload_buffer_entries(sphereObjectBuffer, currentScene.get_buffer<Sphere::GPU_t>(Hittable::Type::sphere), edit.dirty_indices(Hittable::Type::sphere));
+    upload_buffer_entries(quadObjectBuffer, currentScene.get_buffer<Quad::GPU_t>(Hittable::Type::quad), edit.dirty_indices(Hittable::Type::quad));
+    upload_buffer_entries(triObjectBuffer, currentScene.get_buffer<Tri::GPU_t>(Hittable::Type::tri), edit.dirty_indices(Hittable::Type::tri));
+    upload_buffer_entries(computeBvhBuffer, currentScene.get_buffer<BVHNode::GPU_t>(Hittable::Type::bvhNode), edit.dirty_indices(Hittable::Type::bvhNode));
+    upload_buffer_entries(bvhLinksBuffer, currentScene.get_buffer<BVHNode::Links_t>(Hittable::Type::bvhLinks), edit.dirty_indices(Hittable::Type::bvhLinks));
+    upload_buffer_entries(computeWideBvhBuffer, currentScene.get_buffer<WideBVH::GPU_t>(Hittable::Type::wideBvhNode), edit.dirty_indices(Hittable::Type::wideBvhNode));
+    upload_buffer_entries(computeQuantizedWideBvhBuffer, currentScene.get_buffer<WideBVH::QuantizedGPU_t>(Hittable::Type::quantizedWideBvhNode), edit.dirty_indices(Hittable::Type::quantizedWideBvhNode));
+}
+
+
+void VulkanEngine::record_staged_copies(const vk::raii::CommandBuffer &commandBuffer) {
+    if (stagedCopies.empty()) return;
+
+    // Frames in flight may still read the buffers, and this one reads them right after.
+    auto readBarrier = vk::MemoryBarrier(vk::AccessFlagBits::eShaderRead, vk::AccessFlagBits::eTransferWrite);
+    auto uploadBarrier = vk::MemoryBarrier(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eShaderRead);
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eTransfer, {}, {readBarrier}, {}, {});
+    for (const auto &copy : stagedCopies) commandBuffer.copyBuffer(copy.stagingBuffer.buffer, copy.buffer, copy.regions);
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eComputeShader, {}, {uploadBarrier}, {}, {});
+
+    // Staging buffers are freed once the frame is done with them.
+    for (const auto &copy : stagedCopies) {
+        get_current_frame().deletionQueue.push([this, stagingBuffer = copy.stagingBuffer]() {
+            allocator->destroyBuffer(stagingBuffer.buffer, stagingBuffer.allocation);
+        });
+    }
+    stagedCopies.clear();
+}
+
+
+void VulkanEngine::discard_staged_copies() {
+    for (const auto &copy : stagedCopies) allocator->destroyBuffer(copy.stagingBuffer.buffer, copy.stagingBuffer.allocation);
+    stagedCopies.clear();
+}
+
+
+void VulkanEngine::record_refit(const vk::raii::CommandBuffer &commandBuffer) {
+    auto refitMaterial = get_material("refit");
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, *refitMaterial->pipeline);
+    commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *refitMaterial->pipelineLayout, 0, {*descriptors["refit"]->set}, {});
+
+    // Leaves read the primitives that were just uploaded, and every level reads the bounds written by the ones before.
+    // Frames in flight may still traverse the nodes, so the refit waits for them too.
+    auto uploadBarrier = vk::MemoryBarrier(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite);
+    auto levelBarrier = vk::MemoryBarrier(vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite);
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer | vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eComputeShader, {}, {uploadBarrier}, {}, {});
+
+    auto dispatch = [&](uint32_t start, uint32_t count, uint32_t mode) {
+        auto constants = RefitPushConstants {start, count, mode};
+        commandBuffer.pushConstants<RefitPushConstants>(*refitMaterial->pipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, constants);
+        commandBuffer.dispatch((count + 63) / 64, 1, 1);
+        commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eComputeShader, {}, {levelBarrier}, {}, {});
+    };
+
+    for (int level = 0; level + 1 < (int) refitLevelOffsets.size(); level++) {
+        dispatch(refitLevelOffsets[level], refitLevelOffsets[level + 1] - refitLevelOffsets[level], 0);
+    }
+    auto &wideBvh = sceneManager.animatedScenes.at(currentScene.name).wideBvh;
+    if (!wideBvh.nodes.empty()) {
+        dispatch(0, (uint32_t) wideBvh.binaryIndices.size(), 1);
+        dispatch(0, (uint32_t) wideBvh.nodes.size(), 2);
+    }
+}
+
+
+void VulkanEngine::record_build(const vk::raii::CommandBuffer &commandBuffer) {
+    auto buildMaterial = get_material("build");
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, *buildMaterial->pipeline);
+    commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *buildMaterial->pipelineLayout, 0, {*descriptors["build"]->set}, {});
+
+    auto numSpheres = (uint32_t) currentScene.buffer_size(Hittable::Type::sphere);
+    auto numQuads = (uint32_t) currentScene.buffer_size(Hittable::Type::quad);
+    auto numTris = (uint32_t) currentScene.buffer_size(Hittable::Type::tri);
+    auto numPrimitives = numSpheres + numQuads + numTris;
+    if (numPrimitives == 0) return; // The scene manager rejects such scenes, but every count below would wrap around.
+
+    auto numNodes = 2 * numPrimitives - 1;
+    auto numBlocks = (numPrimitives + 255) / 256;
+
+    // Every pass reads what the passes before it wrote.
+    auto passBarrier = vk::MemoryBarrier(vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite);
+    auto dispatch = [&](BuildPass pass, uint32_t numGroups, uint32_t count, uint32_t shift = 0) {
+        auto constants = BuildPushConstants {(uint32_t) pass, count, shift, numBlocks, numSpheres, numQuads, numTris};
+        commandBuffer.pushConstants<BuildPushConstants>(*buildMaterial->pipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, constants);
+        commandBuffer.dispatch(numGroups, 1, 1);
+        commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eComputeShader, {}, {passBarrier}, {}, {});
+    };
+    auto num_groups = [](uint32_t count) { return (count + 255) / 256; };
+
+    dispatch(BuildPass::reset, num_groups(numNodes), numNodes);
+    dispatch(BuildPass::bounds, num_groups(numPrimitives), numPrimitives);
+    dispatch(BuildPass::morton, num_groups(numPrimitives), numPrimitives);
+    for (uint32_t shift = 0; shift < 32; shift += 4) {
+        dispatch(BuildPass::count, numBlocks, numPrimitives, shift);
+        dispatch(BuildPass::scan, 1, numPrimitives, shift);
+        dispatch(BuildPass::scatter, numBlocks, numPrimitives, shift);
+    }
+    dispatch(BuildPass::emit, num_groups(numPrimitives - 1), numPrimitives - 1);
+    dispatch(BuildPass::fit, num_groups(numPrimitives), numPrimitives);
+    dispatch(BuildPass::thread, num_groups(numNodes), numNodes);
+}
+
+
 void VulkanEngine::init_scene() {
     std::cout << "INFO: init_scene()" << std::endl;
 //    // We create 1 monkey, add it as the first thing to the renderables array, and then we create a lot of triangles in
@@ -822,7 +1114,12 @@ void VulkanEngine::init_scene() {
 //    auto textureWrite2 = vkinit::write_descriptor_image(vk::DescriptorType::eCombinedImageSampler, *computeDescriptor, &earthImageInfo, 5);
 //    device.updateDescriptorSets({textureWrite2}, {});
 
-    sceneManager.init_scene({"book1", {{10, 1.5, 2}, {0, 0, -0.25}, 30.0f, 16.0f / 10.0f}}, []() -> std::shared_ptr<BVHNode> {
+    // Generators are code, so recompiling them invalidates every cached scene.
+    sceneManager.generatorVersion = __DATE__ " " __TIME__;
+    sceneManager.editableSceneNames = {"corne"};
+    sceneManager.gpuBuiltSceneNames = {"field"};
+
+    sceneManager.init_scene({"book1", {{10, 1.5, 2}, {0, 0, -0.25}, 30.0f, 16.0f / 10.0f}}, []() -> std::vector<std::shared_ptr<Hittable>> {
         std::vector<std::shared_ptr<Hittable>> world;
         for (int a = -7; a < 7; a++) {
             for (int b = -7; b < 7; b++) {
@@ -854,24 +1151,20 @@ void VulkanEngine::init_scene() {
         spheres.add(std::make_shared<Sphere>(Sphere({4, 1, 0}, 1.0f, Metal({0.7, 0.6, 0.5}, 0.0f))));
         world.push_back(std::make_shared<HittableList<Sphere>>(spheres));
 
-        return std::make_shared<BVHNode>(world, 0, (int) world.size());
-    });
-
-    sceneManager.init_scene({"quads", {{0, 0, 9}, {0, 0, 0}, 80.0f, 1.0f, 0.0f}}, []() -> std::shared_ptr<BVHNode> {
-        std::vector<std::shared_ptr<Hittable>> world;
-        HittableList<Quad> quads;
-
-        quads.add(std::make_shared<Quad>(Quad({-3, -2, 5}, {0, 0, -4}, {0, 4, 0}, Lambertian({1.0, 0.2, 0.2}))));
-        quads.add(std::make_shared<Quad>(Quad({-2, -2, 0}, {4, 0, 0}, {0, 4, 0}, Lambertian({0.2, 1.0, 0.2}))));
-        quads.add(std::make_shared<Quad>(Quad({3, -2, 1}, {0, 0, 4}, {0, 4, 0}, Lambertian({0.2, 0.2, 1.0}))));
-        quads.add(std::make_shared<Quad>(Quad({-2, 3, 1}, {4, 0, 0}, {0, 0, 4}, Lambertian({1.0, 0.5, 0.0}))));
-        quads.add(std::make_shared<Quad>(Quad({-2, -3, 5}, {4, 0, 0}, {0, 0, -4}, Lambertian({0.2, 0.8, 0.8}))));
-        world.push_back(std::make_shared<HittableList<Quad>>(quads));
+        return world;
+    }, [](const std::vector<std::shared_ptr<Hittable>> &world, float timeSeconds) {
+        // Bounce the small spheres, each with its own phase. The large ones are all part of a single `HittableList`.
+        for (const auto &object : world) {
+            auto sphere = std::dynamic_pointer_cast<Sphere>(object);
+            if (!sphere) continue;
 
-        return std::make_shared<BVHNode>(world, 0, (int) world.size());
+            auto center = sphere->sphere.center;
+            auto height = 0.2f + 0.5f * glm::abs(glm::sin(3.0f * timeSeconds + center.x + 2.0f * center.z));
+            sphere->transform(glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, height - center.y, 0.0f)));
+        }
     });
 
-    sceneManager.init_scene({"corne", {{1, 1, -2.878}, {1, 1, 0}, 40.0f, 1.0f, 0.0f}, glm::vec3(0.0)}, []() -> std::shared_ptr<BVHNode> {
+    sceneManager.init_scene({"corne", {{1, 1, -2.878}, {1, 1, 0}, 40.0f, 1.0f, 0.0f}, glm::vec3(0.0)}, []() -> std::vector<std::shared_ptr<Hittable>> {
         std::vector<std::shared_ptr<Hittable>> world;
 
         world.push_back(std::make_shared<Quad>(Quad({2, 0, 0}, {0, 2, 0}, {0, 0, 2}, Lambertian({0.12, 0.45, 0.15}))));
@@ -884,48 +1177,60 @@ void VulkanEngine::init_scene() {
         world.push_back(std::make_shared<Box>(Box({0.468, 0, 0.234}, {1.063, 0.595, 0.829}, Lambertian({0.73, 0.73, 0.73}))));
         world.push_back(std::make_shared<Box>(Box({0.955, 0, 1.063}, {1.550, 1.189, 1.658}, Lambertian({0.73, 0.73, 0.73}))));
 
-        return std::make_shared<BVHNode>(world, 0, (int) world.size());
+        return world;
     });
 
-    sceneManager.init_scene({"cirno", {{0, 2, 5}, {0, 1, 0}, 80.0f, 16.0f / 10.0f, 0.0f}}, [&]() -> std::shared_ptr<BVHNode> {
+    // A field of small spheres, which is large enough that its BVH is worth building on the GPU.
+    sceneManager.init_scene({"field", {{0, 6, 24}, {0, 0, 0}, 50.0f, 16.0f / 10.0f, 0.0f}}, []() -> std::vector<std::shared_ptr<Hittable>> {
         std::vector<std::shared_ptr<Hittable>> world;
-
-        auto *fumoMesh = &meshes["fumo"];
-        glm::vec3 modelCenter;
-        for (const auto &vertex : fumoMesh->vertices) {
-            modelCenter += vertex.position;
+        world.push_back(std::make_shared<Quad>(Quad({-30, 0, -30}, {60, 0, 0}, {0, 0, 60}, Lambertian({0.5, 0.5, 0.5}))));
+
+        // The spheres are stored as arrays, rather than as 40k objects with a copy of their material each.
+        auto spheres = std::make_shared<PrimitiveArrays>();
+        auto materialIds = std::array {spheres->add_material(Lambertian({0.8, 0.3, 0.3})), spheres->add_material(Lambertian({0.3, 0.8, 0.3})),
+                                       spheres->add_material(Lambertian({0.3, 0.3, 0.8})), spheres->add_material(Lambertian({0.8, 0.8, 0.3}))};
+        for (int a = -100; a < 100; a++) {
+            for (int b = -100; b < 100; b++) {
+                auto center = glm::vec3(0.25 * (a + 0.2 + 0.6 * random_double()), 0.1, 0.25 * (b + 0.2 + 0.6 * random_double()));
+                spheres->add_sphere(center, 0.1f, materialIds[(a + b) & 3]);
+            }
         }
-        modelCenter /= fumoMesh->vertices.size();
-        std::cout << "   --- Cirno center: (" << modelCenter.x << ", " << modelCenter.y << ", " << modelCenter.z << ')' << std::endl;
-
-        auto &vertices = fumoMesh->vertices;
-        auto &indices = fumoMesh->indices;
-
-        for (int i = 0; i < fumoMesh->indices.size() - 2; i += 3) {
-            auto v0 = vertices[indices[i]];
-            auto v1 = vertices[indices[i + 1]];
-            auto v2 = vertices[indices[i + 2]];
-            auto u = glm::vec3(v0.uv[0], v1.uv[0], v2.uv[0]);
-            auto v = glm::vec3(v0.uv[1], v1.uv[1], v2.uv[1]);
-
-            world.push_back(std::make_shared<Tri>(
-                v0.position - glm::vec3(0, 0.08, 0),
-                v1.position - glm::vec3(0, 0.08, 0),
-                v2.position - glm::vec3(0, 0.08, 0),
-                u, v, Lambertian("fumo_diffuse")));
+        world.push_back(spheres);
+
+        return world;
+    });
+
+    // The Cirno mesh is read by every scene that instances it (see `get_fumo_bvh()`), so it is part of their cache keys.
+    auto fumoInputs = std::vector<std::string> {"../assets/cirno_low.mesh"};
+
+    // Meshes are referenced by name in scene files.
+    auto resolve_mesh = [this](const std::string &name, const RTMaterial &material) -> std::shared_ptr<BottomLevelBVH> {
+        return name == "fumo" ? get_fumo_bvh(material) : nullptr;
+    };
+    sceneManager.init_scene_file("../assets/scenes/quads.json", resolve_mesh);
+    sceneManager.init_scene_file("../assets/scenes/cirno.json", resolve_mesh, fumoInputs);
+
+    sceneManager.init_scene({"cirnos", {{0, 10, 40}, {0, 0, 0}, 50.0f, 16.0f / 10.0f, 0.0f}}, [this]() -> std::vector<std::shared_ptr<Hittable>> {
+        std::vector<std::shared_ptr<Hittable>> world;
+
+        // A 32x32 grid of randomly turned Cirnos, which costs little more memory than a single one.
+        for (int x = -16; x < 16; x++) {
+            for (int z = -16; z < 16; z++) {
+                auto translation = glm::translate(glm::mat4(1.0f), glm::vec3(2.5f * (float) x, -0.08f, 2.5f * (float) z));
+                auto rotation = glm::rotate(glm::mat4(1.0f), glm::radians(360.0f * (float) random_double()), glm::vec3(0, 1, 0));
+                world.push_back(std::make_shared<Instance>(get_fumo_bvh(Lambertian("fumo_diffuse")), translation * rotation));
+            }
         }
 
         HittableList<Sphere> spheres;
         spheres.add(std::make_shared<Sphere>(Sphere({0, -2000, 0}, 2000.0f, Lambertian({0.5, 0.5, 0.5}))));
-        spheres.add(std::make_shared<Sphere>(Sphere({-4, 2, 0}, 2.0f, Metal({0.7, 0.6, 0.5}, 0.05f))));
-        spheres.add(std::make_shared<Sphere>(Sphere({4, 2, 0}, 2.0f, Metal({0.7, 0.6, 0.5}, 0.05f))));
-
         world.push_back(std::make_shared<HittableList<Sphere>>(spheres));
 
-        return std::make_shared<BVHNode>(world, 0, (int) world.size());
-    });
+        return world;
+    }, {}, fumoInputs);
 
-    currentScene = *sceneManager.get_scene("book1");
+    // Scenes are only built once they are asked for, so the first frame only waits for the one it shows.
+    currentScene = *sceneManager.wait_for_scene("book1");
     sceneParameters.backgroundColor = currentScene.backgroundColor;
 
     int width  = static_cast<int>((float) windowExtent.height * currentScene.camera.aspectRatio);
@@ -1117,6 +1422,18 @@ void VulkanEngine::init_descriptors() {
     std::cout << "INFO: init_descriptors()" << std::endl;
     const auto SCENE_BUFFER_SIZE = FRAME_OVERLAP * pad_uniform_buffer_size(sizeof(GPUSceneData));
 
+    // Everything created here belongs to the current scene, so whatever was created for the last one is destroyed first.
+    // Copies staged for the old buffers are dropped too, since the new ones are uploaded whole.
+    discard_staged_copies();
+    sceneDeletionQueue.flush();
+    auto create_scene_buffer = [this](size_t size, vk::BufferUsageFlags bufferUsage, vma::MemoryUsage memoryUsage) {
+        auto buffer = create_buffer(size, bufferUsage, memoryUsage);
+        sceneDeletionQueue.push([this, buffer]() {
+            allocator->destroyBuffer(buffer.buffer, buffer.allocation);
+        });
+        return buffer;
+    };
+
 //    // --- Descriptor Pool Setup ---
 //    // When creating a descriptor pool, you need to specify how many descriptors of each type you will need, and what’s
 //    // the maximum number of sets to allocate from it.
@@ -1166,33 +1483,74 @@ void VulkanEngine::init_descriptors() {
         auto samplerInfo = vkinit::sampler_create_info(vk::Filter::eLinear);
         auto computeViewInfo = vkinit::imageview_create_info(imageFormat, computeImage.image, vk::ImageAspectFlagBits::eColor);
         computeTexture = Texture(computeImage, {device, samplerInfo}, {device, computeViewInfo});
+        sceneDeletionQueue.push([this]() {
+            // The view refers to the image, so it is destroyed first.
+            computeTexture.imageView.clear();
+            computeTexture.sampler.clear();
+            allocator->destroyImage(computeTexture.image.image, computeTexture.image.allocation);
+        });
         auto computeTextureBufferInfo = vk::DescriptorImageInfo(*computeTexture.sampler, *computeTexture.imageView, vk::ImageLayout::eGeneral);
 
         std::cout << "   --- Allocating GPU SSBOs..." << std::endl;
         // Compute camera
-        computeParameterBuffer = create_buffer(SCENE_BUFFER_SIZE, vk::BufferUsageFlagBits::eUniformBuffer, vma::MemoryUsage::eCpuToGpu);
+        computeParameterBuffer = create_scene_buffer(SCENE_BUFFER_SIZE, vk::BufferUsageFlagBits::eUniformBuffer, vma::MemoryUsage::eCpuToGpu);
         auto computeCameraBufferInfo = vk::DescriptorBufferInfo(computeParameterBuffer.buffer, 0, sizeof(GPUSceneData));
 
-        // Object buffers
-        auto bvh = currentScene.get_buffer(Hittable::Type::bvhNode);
-        auto computeBvhBuffer = create_buffer(sizeof(BVHNode::GPU_t) * bvh.size(), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vma::MemoryUsage::eGpuOnly);
-        auto bvhBufferInfo = vk::DescriptorBufferInfo(computeBvhBuffer.buffer, 0, sizeof(BVHNode::GPU_t) * bvh.size());
-        upload_buffer<std::any, BVHNode::GPU_t>(computeBvhBuffer, bvh);
-
-        auto spheres = currentScene.get_buffer(Hittable::Type::sphere);
-        auto sphereObjectBuffer = create_buffer(sizeof(Sphere::GPU_t) * spheres.size(), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vma::MemoryUsage::eGpuOnly);
+        // Object buffers. Scenes built on the GPU only have primitives on the CPU, so their nodes are never uploaded: the
+        // node buffers are only sized, for one leaf per primitive.
+        auto isGpuBuilt = sceneManager.gpuBuiltSceneNames.contains(currentScene.name);
+        auto numPrimitives = (uint32_t) (currentScene.buffer_size(Hittable::Type::sphere) + currentScene.buffer_size(Hittable::Type::quad) + currentScene.buffer_size(Hittable::Type::tri));
+        const auto &bvh = currentScene.get_buffer<BVHNode::GPU_t>(Hittable::Type::bvhNode);
+        auto numNodes = isGpuBuilt ? std::max(2 * numPrimitives, 1u) - 1 : bvh.size();
+        computeBvhBuffer = create_scene_buffer(sizeof(BVHNode::GPU_t) * numNodes, vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vma::MemoryUsage::eGpuOnly);
+        auto bvhBufferInfo = vk::DescriptorBufferInfo(computeBvhBuffer.buffer, 0, sizeof(BVHNode::GPU_t) * numNodes);
+        upload_buffer(computeBvhBuffer, bvh);
+
+        const auto &wideBvh = currentScene.get_buffer<WideBVH::GPU_t>(Hittable::Type::wideBvhNode);
+        computeWideBvhBuffer = create_scene_buffer(sizeof(WideBVH::GPU_t) * wideBvh.size(), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vma::MemoryUsage::eGpuOnly);
+        auto wideBvhBufferInfo = vk::DescriptorBufferInfo(computeWideBvhBuffer.buffer, 0, sizeof(WideBVH::GPU_t) * wideBvh.size());
+        upload_buffer(computeWideBvhBuffer, wideBvh);
+
+        const auto &quantizedWideBvh = currentScene.get_buffer<WideBVH::QuantizedGPU_t>(Hittable::Type::quantizedWideBvhNode);
+        computeQuantizedWideBvhBuffer = create_scene_buffer(sizeof(WideBVH::QuantizedGPU_t) * quantizedWideBvh.size(), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vma::MemoryUsage::eGpuOnly);
+        auto quantizedBvhBufferInfo = vk::DescriptorBufferInfo(computeQuantizedWideBvhBuffer.buffer, 0, sizeof(WideBVH::QuantizedGPU_t) * quantizedWideBvh.size());
+        upload_buffer(computeQuantizedWideBvhBuffer, quantizedWideBvh);
+
+        const auto &bvhLinks = currentScene.get_buffer<BVHNode::Links_t>(Hittable::Type::bvhLinks);
+        auto numLinks = isGpuBuilt ? NUM_OCTANTS * numNodes : bvhLinks.size();
+        bvhLinksBuffer = create_scene_buffer(sizeof(BVHNode::Links_t) * numLinks, vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vma::MemoryUsage::eGpuOnly);
+        auto bvhLinksBufferInfo = vk::DescriptorBufferInfo(bvhLinksBuffer.buffer, 0, sizeof(BVHNode::Links_t) * numLinks);
+        upload_buffer(bvhLinksBuffer, bvhLinks);
+
+        const auto &spheres = currentScene.get_buffer<Sphere::GPU_t>(Hittable::Type::sphere);
+        sphereObjectBuffer = create_scene_buffer(sizeof(Sphere::GPU_t) * spheres.size(), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vma::MemoryUsage::eGpuOnly);
         auto sphereBufferInfo = vk::DescriptorBufferInfo(sphereObjectBuffer.buffer, 0, sizeof(Sphere::GPU_t) * spheres.size());
-        upload_buffer<std::any, Sphere::GPU_t>(sphereObjectBuffer, spheres);
+        upload_buffer(sphereObjectBuffer, spheres);
 
-        auto quads = currentScene.get_buffer(Hittable::Type::quad);
-        auto quadObjectBuffer = create_buffer(sizeof(Quad::GPU_t) * quads.size(), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vma::MemoryUsage::eGpuOnly);
+        const auto &quads = currentScene.get_buffer<Quad::GPU_t>(Hittable::Type::quad);
+        quadObjectBuffer = create_scene_buffer(sizeof(Quad::GPU_t) * quads.size(), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vma::MemoryUsage::eGpuOnly);
         auto quadBufferInfo = vk::DescriptorBufferInfo(quadObjectBuffer.buffer, 0, sizeof(Quad::GPU_t) * quads.size());
-        upload_buffer<std::any, Quad::GPU_t>(quadObjectBuffer, quads);
+        upload_buffer(quadObjectBuffer, quads);
 
-        auto tris = currentScene.get_buffer(Hittable::Type::tri);
-        auto triObjectBuffer = create_buffer(sizeof(Tri::GPU_t) * tris.size(), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vma::MemoryUsage::eGpuOnly);
+        const auto &tris = currentScene.get_buffer<Tri::GPU_t>(Hittable::Type::tri);
+        triObjectBuffer = create_scene_buffer(sizeof(Tri::GPU_t) * tris.size(), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vma::MemoryUsage::eGpuOnly);
         auto triBufferInfo = vk::DescriptorBufferInfo(triObjectBuffer.buffer, 0, sizeof(Tri::GPU_t) * tris.size());
-        upload_buffer<std::any, Tri::GPU_t>(triObjectBuffer, tris);
+        upload_buffer(triObjectBuffer, tris);
+
+        const auto &meshTris = currentScene.get_buffer<TriMesh::GPU_t>(Hittable::Type::meshTri);
+        meshTriObjectBuffer = create_scene_buffer(sizeof(TriMesh::GPU_t) * meshTris.size(), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vma::MemoryUsage::eGpuOnly);
+        auto meshTriBufferInfo = vk::DescriptorBufferInfo(meshTriObjectBuffer.buffer, 0, sizeof(TriMesh::GPU_t) * meshTris.size());
+        upload_buffer(meshTriObjectBuffer, meshTris);
+
+        const auto &meshVertices = currentScene.get_buffer<TriMesh::Vertex_t>(Hittable::Type::meshVertex);
+        meshVertexBuffer = create_scene_buffer(sizeof(TriMesh::Vertex_t) * meshVertices.size(), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vma::MemoryUsage::eGpuOnly);
+        auto meshVertexBufferInfo = vk::DescriptorBufferInfo(meshVertexBuffer.buffer, 0, sizeof(TriMesh::Vertex_t) * meshVertices.size());
+        upload_buffer(meshVertexBuffer, meshVertices);
+
+        const auto &instances = currentScene.get_buffer<Instance::GPU_t>(Hittable::Type::instance);
+        instanceObjectBuffer = create_scene_buffer(sizeof(Instance::GPU_t) * instances.size(), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vma::MemoryUsage::eGpuOnly);
+        auto instanceBufferInfo = vk::DescriptorBufferInfo(instanceObjectBuffer.buffer, 0, sizeof(Instance::GPU_t) * instances.size());
+        upload_buffer(instanceObjectBuffer, instances);
 
         std::cout << "   --- Creating compute descriptor..." << std::endl;
         // clang-format off
@@ -1203,22 +1561,89 @@ void VulkanEngine::init_descriptors() {
             .bind(3, &sphereBufferInfo,         vk::DescriptorType::eStorageBuffer,        vk::ShaderStageFlagBits::eCompute)
             .bind(4, &quadBufferInfo,           vk::DescriptorType::eStorageBuffer,        vk::ShaderStageFlagBits::eCompute)
             .bind(5, &triBufferInfo,            vk::DescriptorType::eStorageBuffer,        vk::ShaderStageFlagBits::eCompute)
+            .bind(6, &wideBvhBufferInfo,        vk::DescriptorType::eStorageBuffer,        vk::ShaderStageFlagBits::eCompute)
+            .bind(7, &instanceBufferInfo,       vk::DescriptorType::eStorageBuffer,        vk::ShaderStageFlagBits::eCompute)
+            .bind(8, &quantizedBvhBufferInfo,   vk::DescriptorType::eStorageBuffer,        vk::ShaderStageFlagBits::eCompute)
+            .bind(9, &bvhLinksBufferInfo,       vk::DescriptorType::eStorageBuffer,        vk::ShaderStageFlagBits::eCompute)
+            .bind(10, &meshTriBufferInfo,       vk::DescriptorType::eStorageBuffer,        vk::ShaderStageFlagBits::eCompute)
+            .bind(11, &meshVertexBufferInfo,    vk::DescriptorType::eStorageBuffer,        vk::ShaderStageFlagBits::eCompute)
             .build();
         // clang-format on
 
+        // The GPU may have refit the nodes of an animated scene last, so the uploaded ones may be older than its primitives
+        // and are refit before it is traced.
+        shouldDispatchRefit = sceneManager.animatedScenes.contains(currentScene.name);
+        if (shouldDispatchRefit) {
+            std::cout << "   --- Creating refit descriptor..." << std::endl;
+            auto &animatedScene = sceneManager.animatedScenes.at(currentScene.name);
+            auto refitOrder = animatedScene.bvh.get_refit_order(refitLevelOffsets);
+            auto refitOrderBuffer = create_scene_buffer(sizeof(uint32_t) * refitOrder.size(), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vma::MemoryUsage::eGpuOnly);
+            auto refitOrderBufferInfo = vk::DescriptorBufferInfo(refitOrderBuffer.buffer, 0, sizeof(uint32_t) * refitOrder.size());
+            upload_buffer(refitOrderBuffer, refitOrder);
+
+            auto &wideBinaryIndices = animatedScene.wideBvh.binaryIndices;
+            auto wideBinaryIndexBuffer = create_scene_buffer(sizeof(uint32_t) * wideBinaryIndices.size(), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vma::MemoryUsage::eGpuOnly);
+            auto wideBinaryIndexBufferInfo = vk::DescriptorBufferInfo(wideBinaryIndexBuffer.buffer, 0, sizeof(uint32_t) * wideBinaryIndices.size());
+            upload_buffer(wideBinaryIndexBuffer, wideBinaryIndices);
+
+            // clang-format off
+            descriptors["refit"] = vkutil::DescriptorBuilder::begin(&layoutCache, &descriptorAllocator)
+                .bind(0, &bvhBufferInfo,             vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .bind(1, &sphereBufferInfo,          vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .bind(2, &quadBufferInfo,            vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .bind(3, &triBufferInfo,             vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .bind(4, &refitOrderBufferInfo,      vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .bind(5, &wideBvhBufferInfo,         vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .bind(6, &wideBinaryIndexBufferInfo, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .bind(7, &instanceBufferInfo,        vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .bind(8, &quantizedBvhBufferInfo,    vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .bind(9, &meshTriBufferInfo,         vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .bind(10, &meshVertexBufferInfo,     vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .build();
+            // clang-format on
+        }
+
+        if (isGpuBuilt && numPrimitives > 0) {
+            std::cout << "   --- Creating build descriptor..." << std::endl;
+            // Scratch buffers of the build. The sort ping-pongs between two halves of the keys and values.
+            auto numBlocks = (numPrimitives + 255) / 256;
+            auto sortKeyBuffer = create_scene_buffer(2 * sizeof(uint32_t) * numPrimitives, vk::BufferUsageFlagBits::eStorageBuffer, vma::MemoryUsage::eGpuOnly);
+            auto sortKeyBufferInfo = vk::DescriptorBufferInfo(sortKeyBuffer.buffer, 0, 2 * sizeof(uint32_t) * numPrimitives);
+            auto sortValueBuffer = create_scene_buffer(2 * sizeof(uint32_t) * numPrimitives, vk::BufferUsageFlagBits::eStorageBuffer, vma::MemoryUsage::eGpuOnly);
+            auto sortValueBufferInfo = vk::DescriptorBufferInfo(sortValueBuffer.buffer, 0, 2 * sizeof(uint32_t) * numPrimitives);
+            auto blockCountBuffer = create_scene_buffer(16 * sizeof(uint32_t) * numBlocks, vk::BufferUsageFlagBits::eStorageBuffer, vma::MemoryUsage::eGpuOnly);
+            auto blockCountBufferInfo = vk::DescriptorBufferInfo(blockCountBuffer.buffer, 0, 16 * sizeof(uint32_t) * numBlocks);
+            auto buildNodeBuffer = create_scene_buffer(4 * sizeof(uint32_t) * numNodes, vk::BufferUsageFlagBits::eStorageBuffer, vma::MemoryUsage::eGpuOnly);
+            auto buildNodeBufferInfo = vk::DescriptorBufferInfo(buildNodeBuffer.buffer, 0, 4 * sizeof(uint32_t) * numNodes);
+            auto buildStateBuffer = create_scene_buffer(6 * sizeof(uint32_t), vk::BufferUsageFlagBits::eStorageBuffer, vma::MemoryUsage::eGpuOnly);
+            auto buildStateBufferInfo = vk::DescriptorBufferInfo(buildStateBuffer.buffer, 0, 6 * sizeof(uint32_t));
+
+            // clang-format off
+            descriptors["build"] = vkutil::DescriptorBuilder::begin(&layoutCache, &descriptorAllocator)
+                .bind(0, &bvhBufferInfo,        vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .bind(1, &sphereBufferInfo,     vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .bind(2, &quadBufferInfo,       vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .bind(3, &triBufferInfo,        vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .bind(4, &bvhLinksBufferInfo,   vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .bind(5, &sortKeyBufferInfo,    vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .bind(6, &sortValueBufferInfo,  vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .bind(7, &blockCountBufferInfo, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .bind(8, &buildNodeBufferInfo,  vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .bind(9, &buildStateBufferInfo, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute)
+                .build();
+            // clang-format on
+            shouldDispatchBuild = true;
+        }
+
         std::cout << "   --- Creating resources descriptor..." << std::endl;
-        auto materialBuffer = create_buffer(sizeof(RTMaterial::GPU_t) * currentScene.materials.size(), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vma::MemoryUsage::eGpuOnly);
+        auto materialBuffer = create_scene_buffer(sizeof(RTMaterial::GPU_t) * currentScene.materials.size(), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vma::MemoryUsage::eGpuOnly);
         auto materialBufferInfo = vk::DescriptorBufferInfo(materialBuffer.buffer, 0, sizeof(RTMaterial::GPU_t) * currentScene.materials.size());
-        auto materialUploadBuffer = std::vector<RTMaterial::GPU_t>(currentScene.materials.size());
-        for (auto &[material, id] : currentScene.materials) {
-            materialUploadBuffer[id] = material;
-        }
-        upload_buffer(materialBuffer, materialUploadBuffer);
+        upload_buffer(materialBuffer, currentScene.materials);
 
-        auto textureInfos = std::vector<vk::DescriptorImageInfo>(currentScene.textures.size());
-        for (auto &[textureName, id] : currentScene.textures) {
+        auto textureInfos = std::vector<vk::DescriptorImageInfo>();
+        for (const auto &textureName : currentScene.textures) {
             auto &texture = loadedTextures[textureName];
-            textureInfos[id] = vk::DescriptorImageInfo(*texture.sampler, *texture.imageView, vk::ImageLayout::eShaderReadOnlyOptimal);
+            textureInfos.emplace_back(*texture.sampler, *texture.imageView, vk::ImageLayout::eShaderReadOnlyOptimal);
         }
         // Add 'dummy' image if there are no textures to upload.
         if (textureInfos.empty()) textureInfos.push_back(computeTextureBufferInfo);
@@ -1359,6 +1784,9 @@ void VulkanEngine::cleanup() {
         // know what we are doing)!
         device.waitIdle();
 
+        discard_staged_copies();
+        for (auto &frame : frames) frame.deletionQueue.flush();
+        sceneDeletionQueue.flush();
         mainDeletionQueue.flush();
 
 //        allocator->destroy();
@@ -1375,6 +1803,7 @@ void VulkanEngine::draw() {
     // --- Setup ---
     // Wait until the GPU has finished rendering the last frame (timeout = 1s)
     vk_check(device.waitForFences({*currentFrame.renderFence}, true, (uint64_t) 1E9));
+    currentFrame.deletionQueue.flush();
 
     // Request image from the swapchain (timeout = 1s). We use `presentSemaphore` to make sure that we can sync other
     // operations with the swapchain having an image ready to render.
@@ -1424,8 +1853,26 @@ void VulkanEngine::draw() {
 
         allocator->unmapMemory(computeParameterBuffer.allocation);
 
+        // --- Staged Uploads ---
+        record_staged_copies(commandBuffer);
+
+        // --- BVH Build ---
+        if (shouldDispatchBuild) {
+            record_build(commandBuffer);
+            shouldDispatchBuild = false;
+        }
+
+        // --- BVH Refit ---
+        if (shouldDispatchRefit) {
+            record_refit(commandBuffer);
+            shouldDispatchRefit = false;
+        }
+
         // --- Compute Memory Barrier ---
-        auto computeMaterial = get_material("compute");
+        // Only the binary BVH is built on the GPU.
+        auto isWide = shouldTraverseWideBVH && currentScene.buffer_size(Hittable::Type::wideBvhNode) > 0;
+        auto computeMaterial = isWide ? get_material(shouldTraverseQuantizedBVH ? "compute_wide_quantized" : "compute_wide")
+                                                     : get_material(shouldFollowOctantLinks ? "compute_octant" : "compute");
         auto imageMemoryBarrier = vkinit::image_memory_barrier(computeTexture.image.image, {}, vk::AccessFlagBits::eShaderWrite, vk::ImageLayout::eUndefined, vk::ImageLayout::eGeneral, vk::ImageAspectFlagBits::eColor);
 
         commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe, vk::PipelineStageFlagBits::eComputeShader, {}, {}, {}, {imageMemoryBarrier});
@@ -1540,6 +1987,14 @@ void VulkanEngine::run() {
 
         if (shouldRecreateSwapchain) recreate_swapchain();
 
+        // Scenes are built in the background, so the one that was picked is swapped to once it is built.
+        sceneManager.publish_built_scenes();
+        if (!requestedSceneName.empty()) {
+            auto status = sceneManager.get_progress(requestedSceneName).status;
+            if (status == SceneStatus::ready) swap_scene(requestedSceneName);
+            if (status == SceneStatus::ready || status == SceneStatus::failed) requestedSceneName.clear();
+        }
+
         // ImGui new frame
         ImGui_ImplVulkan_NewFrame();
         ImGui_ImplSDL2_NewFrame(window);
@@ -1577,25 +2032,96 @@ void VulkanEngine::run() {
             ImGui::TableSetColumnIndex(0); ImGui::Text("Render AABB");
             ImGui::TableSetColumnIndex(1); ImGui::Checkbox("##aabb", &currentScene.camera.props.shouldRenderAABB);
 
+            // Scenes built on the GPU, or whose wide BVH is too deep for the traversal stack, only have a binary BVH.
+            auto hasWideBvh = currentScene.buffer_size(Hittable::Type::wideBvhNode) > 0;
+            if (hasWideBvh) {
+                ImGui::TableNextRow();
+                ImGui::TableSetColumnIndex(0); ImGui::Text("Wide BVH");
+                ImGui::TableSetColumnIndex(1); ImGui::Checkbox("##widebvh", &shouldTraverseWideBVH);
+            }
+
+            if (shouldTraverseWideBVH && hasWideBvh) {
+                ImGui::TableNextRow();
+                ImGui::TableSetColumnIndex(0); ImGui::Text("Quantized BVH");
+                ImGui::TableSetColumnIndex(1); ImGui::Checkbox("##quantizedbvh", &shouldTraverseQuantizedBVH);
+            } else {
+                ImGui::TableNextRow();
+                ImGui::TableSetColumnIndex(0); ImGui::Text("Octant Links");
+                ImGui::TableSetColumnIndex(1); ImGui::Checkbox("##octantlinks", &shouldFollowOctantLinks);
+            }
+
+            if (sceneManager.animatedScenes.contains(currentScene.name)) {
+                ImGui::TableNextRow();
+                ImGui::TableSetColumnIndex(0); ImGui::Text("Animate");
+                ImGui::TableSetColumnIndex(1); ImGui::Checkbox("##animate", &shouldAnimate);
+
+                ImGui::TableNextRow();
+                ImGui::TableSetColumnIndex(0); ImGui::Text("GPU Refit");
+                ImGui::TableSetColumnIndex(1); ImGui::Checkbox("##gpurefit", &shouldRefitOnGPU);
+            }
+
+            if (sceneManager.editableScenes.contains(currentScene.name)) {
+                auto &inserted = insertedObjects[currentScene.name];
+                ImGui::TableNextRow();
+                ImGui::TableSetColumnIndex(0); ImGui::Text("Edit");
+                ImGui::TableSetColumnIndex(1);
+                if (ImGui::Button("Add Sphere")) {
+                    // A small sphere somewhere inside the box.
+                    auto sphere = std::make_shared<Sphere>(rand(0.3f, 1.7f), 0.1f + 0.1f * (float) random_double(), Lambertian({0.73, 0.73, 0.73}));
+                    inserted.push_back(sphere);
+                    apply_scene_edit(sceneManager.insert_object(currentScene.name, sphere));
+                }
+                if (!inserted.empty()) {
+                    ImGui::SameLine();
+                    if (ImGui::Button("Remove")) {
+                        apply_scene_edit(sceneManager.remove_object(currentScene.name, inserted.back()));
+                        inserted.pop_back();
+                    }
+                }
+            }
+
             ImGui::TableNextRow();
             ImGui::TableSetColumnIndex(0); ImGui::Text("Scene");
             ImGui::TableSetColumnIndex(1);
             if (ImGui::BeginCombo("##scene", currentScene.name.c_str())) {
                 auto oldName = currentScene.name;
                 std::string newName = oldName;
-                for (const auto &[name, scene] : sceneManager.scenes) {
-                    if (ImGui::Selectable(name.c_str(), oldName == name)) {
+                for (const auto &name : sceneManager.sceneNames) {
+                    // Scenes are built once they are picked, and shown once they are built. `###` keeps the ID stable.
+                    auto progress = sceneManager.get_progress(name);
+                    auto label = name;
+                    if (progress.status == SceneStatus::queued) label += " (queued)";
+                    if (progress.status == SceneStatus::building)
+                        label += " (" + std::string(progress.phase) + ", " + std::to_string((int) (100.0f * progress.fraction)) + "%)";
+                    if (progress.status == SceneStatus::failed) label += " (failed)";
+                    label += "###" + name;
+
+                    auto isFailed = progress.status == SceneStatus::failed;
+                    if (ImGui::Selectable(label.c_str(), oldName == name, isFailed ? ImGuiSelectableFlags_Disabled : 0)) {
                         ImGui::SetItemDefaultFocus();
                         newName = name;
                     }
                 }
 
                 if (oldName != newName) {
-                    swap_scene(newName);
+                    if (sceneManager.get_scene(newName) != nullptr) {
+                        swap_scene(newName);
+                        requestedSceneName.clear();
+                    } else {
+                        sceneManager.request_scene(newName);
+                        requestedSceneName = newName;
+                    }
                 }
                 ImGui::EndCombo();
             }
 
+            if (!requestedSceneName.empty()) {
+                auto progress = sceneManager.get_progress(requestedSceneName);
+                auto overlay = requestedSceneName + ": " + (progress.status == SceneStatus::queued ? "queued" : progress.phase);
+                ImGui::TableNextRow();
+                ImGui::TableSetColumnIndex(1); ImGui::ProgressBar(progress.fraction, ImVec2(-1.0f, 0.0f), overlay.c_str());
+            }
+
             ImGui::EndTable();
         }
 
@@ -1621,5 +2147,11 @@ void VulkanEngine::run() {
         if (!ImGui::IsWindowFocused(ImGuiHoveredFlags_AnyWindow))
             currentScene.camera.calculateMovement(static_cast<float>(ticksMs - startTicksMs));
         currentScene.camera.calculateProperties();
+
+        // --- Animation ---
+        if (shouldAnimate && sceneManager.animatedScenes.contains(currentScene.name)) {
+            animate_scene(static_cast<float>(ticksMs - startTicksMs) / 1E3f);
+            currentScene.camera.props.iteration = 1; // Moving objects invalidate the accumulated image.
+        }
     }
 }
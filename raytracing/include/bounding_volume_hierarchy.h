@@ -9,6 +9,7 @@
 #include <random>
 
 #define BAD_INDEX 0xFFFFFFFF
+#define NUM_OCTANTS 8
 
 class BVHNode : public Hittable {
 public:
@@ -23,16 +24,89 @@ public:
         glm::vec2 pad2 {};
     };
 
+    /** Hit/miss links of a node, threaded for the rays of one octant. */
+    struct Links_t {
+        uint32_t hitIndex {};
+        uint32_t missIndex {};
+    };
+
+    enum BuildMethod : uint32_t {
+        sweep   = 1, // Exact SAH--sorts the objects along every axis and evaluates every split between them.
+        binned  = 2, // Approximate SAH--buckets object centroids into a fixed number of bins per axis.
+        morton  = 4, // Linear BVH--splits objects sorted by the Morton code of their centroid. Only built by `FlatBVH`.
+        spatial = 8, // SBVH--binned SAH that may also split objects between children. Only built by `FlatBVH`.
+    };
+
+    /** Order of the nodes in memory. Traversal follows the hit/miss links, so every order traces the same. */
+    enum NodeLayout : uint32_t {
+        depthFirst   = 1, // Every left child directly follows its parent.
+        breadthFirst = 2, // The top levels, which every ray visits, are packed together. Their subtrees are depth-first.
+        vanEmdeBoas  = 4, // Recursively clusters treelets of half the height, so nearby nodes share cache lines at every scale.
+    };
+
+    struct BuildOptions {
+        BuildMethod method {BuildMethod::binned};
+        int numBins {16}; // Only used by `BuildMethod::binned` and `BuildMethod::spatial`.
+        bool shouldBuildParallel {true}; // Builds subtrees as OpenMP tasks. Gives the same tree as a serial build.
+        bool shouldUseWideMortonCodes {false}; // 63-bit instead of 30-bit codes. Only used by `BuildMethod::morton`.
+        int numRefinedLevels {0}; // Top levels of a `BuildMethod::morton` tree to split with binned SAH instead.
+        int maxLeafSize {4}; // Ranges of up to this many objects of one type become a leaf if that is cheaper by SAH.
+        float maxDuplication {0.3f}; // References `BuildMethod::spatial` may add, relative to the number of objects.
+    };
+
+private:
+    /** Only `build()` can make subtrees, since they must not open a parallel region of their own. */
+    struct SubtreeKey {
+        explicit SubtreeKey() = default;
+    };
+
 public:
-    BVHNode(std::vector<std::shared_ptr<Hittable>> &objects, int start, int end);
+    BVHNode(std::vector<std::shared_ptr<Hittable>> &objects, int start, int end) : BVHNode(objects, start, end, BuildOptions()) {}
+
+    BVHNode(std::vector<std::shared_ptr<Hittable>> &objects, int start, int end, const BuildOptions &options);
+
+    /** Builds a subtree within the build of its parent, which already opened the parallel region if any. */
+    BVHNode(SubtreeKey, std::vector<std::shared_ptr<Hittable>> &objects, int start, int end, const BuildOptions &options);
 
     [[nodiscard]] AABB bounding_box() const override;
 
     [[nodiscard]] Type type() const override;
 
+    /**
+     * Writes the tree to the scene's `Hittable::Type::bvhNode` buffer, threaded by its hit/miss links, and its objects
+     * to the buffers of their types. Iterative, so trees of any depth can be serialized. The root is written to the
+     * first node, so the node buffer must still be empty.
+     */
     void gpu_serialize(Scene &scene) override;
 
+    /**
+     * @return The SAH cost of the tree rooted at this node, where every non-BVH child counts as one intersection.
+     */
+    [[nodiscard]] float sah_cost() const;
+
+    /**
+     * Threads every BVH in the scene's `Hittable::Type::bvhNode` buffer once per ray octant, so rays visit the child
+     * nearer to their origin first, rather than always the left one. The near child is the one whose center comes first
+     * along the axis that separates the two centers most, for the sign of the ray's direction along that axis.
+     *
+     * Links are written to the `Hittable::Type::bvhLinks` buffer, grouped by octant: the links of node `i` for octant
+     * `x < 0 | (y < 0) << 1 | (z < 0) << 2` are at `octant * numNodes + i`. Nodes keep their own (left-first) links.
+     */
+    static void gpu_serialize_octant_links(Scene &scene);
+
+    /** @return The octant links of the nodes, laid out like `gpu_serialize_octant_links()` writes them. */
+    static std::vector<Links_t> get_octant_links(const std::vector<GPU_t> &nodes);
+
 public:
     GPU_t node;
     std::shared_ptr<Hittable> left {nullptr}, right {nullptr};
-};
\ No newline at end of file
+    std::vector<std::shared_ptr<Hittable>> leafObjects; // Only set for leaves holding more than one object.
+    uint32_t numNodes {1}; // Nodes the subtree rooted here is serialized into, counted while it is built.
+
+private:
+    void build(std::vector<std::shared_ptr<Hittable>> &objects, int start, int end, const BuildOptions &options);
+};
+
+const char *to_string(BVHNode::BuildMethod method);
+
+const char *to_string(BVHNode::NodeLayout layout);
\ No newline at end of file
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "axis_aligned_bounding_box.h"
+#include "bounding_volume_hierarchy.h"
+#include "scene.h"
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Quality metrics of a scene's serialized BVH, plus how long each phase of building it took. Metrics are measured on
+ * the scene buffers rather than on the builder, so BVHs of every builder (and every layout) are measured the same way.
+ */
+class BVHReport {
+public:
+    /** Measures the BVH the scene's `Hittable::Type::bvhNode` buffer holds, starting at its root. */
+    explicit BVHReport(const Scene &scene);
+
+    /** Appends a build phase in the order it ran. */
+    void add_phase(const std::string &name, double milliseconds);
+
+    /** Prints a summary of the report in the style of the rest of the scene generation output. */
+    void print() const;
+
+    [[nodiscard]] std::string to_json() const;
+
+public:
+    std::string sceneName;
+    std::string buildMethod;
+    std::string layout;
+    uint32_t numObjects {};
+    uint32_t numNodes {}, numLeaves {}, numReferences {};
+    std::map<uint32_t, uint32_t> leafSizeHistogram; // Number of leaves per number of referenced primitives.
+    uint32_t maxDepth {};
+    float averageLeafDepth {};
+    float sahCost {};
+    float epo {};     // Effective primitive overlap, approximated with the bounding boxes of the primitives.
+    float overlap {}; // Summed surface area of the overlap between siblings, relative to the area of the root.
+    float averageChildDistance {}; // Average distance between a node and its children in the buffer, in nodes.
+    float sameLineChildRatio {};   // Share of children that lie in the same cache line as their parent.
+    uint32_t numWideNodes {}, wideBvhWidth {};
+    std::map<std::string, size_t> bufferBytes; // Size of every scene buffer on the GPU, by the name of its type.
+    std::vector<std::pair<std::string, double>> phaseMilliseconds;
+};
\ No newline at end of file
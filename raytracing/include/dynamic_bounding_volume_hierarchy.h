@@ -0,0 +1,101 @@
+#pragma once
+
+#include "axis_aligned_bounding_box.h"
+#include "bounding_volume_hierarchy.h"
+#include "hittable.h"
+#include "scene.h"
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * BVH that objects can be inserted into and removed from without a rebuild, for scenes edited while they are shown.
+ * Every leaf holds a single object, which cannot be an instance, `PrimitiveArrays` or a `TriMesh`. Nodes and primitives
+ * keep their slot in the scene buffers for as long as they live, and every buffer is padded to a capacity, so an edit
+ * only overwrites the few entries it changed.
+ *
+ * Unlike the other builders, nodes are not laid out in any particular order: only the root is pinned to the first slot.
+ * Free slots are written as interior nodes without children (a `hitIndex` of `BAD_INDEX`), which no link leads to.
+ */
+class DynamicBVH {
+public:
+    struct Node {
+        AABB aabb;
+        uint32_t parent {BAD_INDEX};
+        uint32_t left {BAD_INDEX}, right {BAD_INDEX}; // Both `BAD_INDEX` for leaves.
+        uint32_t objectIndex {BAD_INDEX};             // Leaves only. `BAD_INDEX` for free slots.
+
+        [[nodiscard]] bool is_leaf() const {
+            return left == BAD_INDEX;
+        }
+    };
+
+    /** An object and where it lives in the tree and in its type's scene buffer. */
+    struct Object {
+        std::shared_ptr<Hittable> hittable;
+        uint32_t leafIndex {};
+        Hittable::Type type {};
+        uint32_t primitiveStart {}, numPrimitives {};
+    };
+
+public:
+    DynamicBVH() = default;
+
+    /**
+     * Builds the initial tree with `FlatBVH` (binned, if a spatial build was asked for, since every object has to sit in
+     * exactly one leaf), then serializes it into the scene with room to grow.
+     */
+    DynamicBVH(Scene &scene, const std::vector<std::shared_ptr<Hittable>> &objects, BVHNode::BuildOptions options);
+
+    /**
+     * Inserts the object next to the node that adds the least SAH cost, found by branch and bound, then refits the
+     * ancestors of the new leaf, rotating every one of them if that lowers the cost of its subtree.
+     */
+    void insert(Scene &scene, const std::shared_ptr<Hittable> &object, SceneEdit &edit);
+
+    /** Replaces the object's parent by its sibling, then refits (and rotates) the ancestors like `insert()`. */
+    void remove(Scene &scene, const std::shared_ptr<Hittable> &object, SceneEdit &edit);
+
+    /** @return The SAH cost of the tree, where every leaf counts as one intersection. */
+    [[nodiscard]] float sah_cost() const;
+
+public:
+    std::vector<Node> nodes; // Slot `i` is serialized to entry `i` of the scene's `Hittable::Type::bvhNode` buffer.
+    std::vector<Object> objects;
+
+private:
+    /** A type's scene buffer, which is padded to its capacity. Removed objects leave a range free for later objects. */
+    struct PrimitiveBuffer {
+        uint32_t end {}; // Every entry past the end is free.
+        std::vector<std::pair<uint32_t, uint32_t>> freeRanges; // Start and size.
+    };
+
+private:
+    uint32_t allocate_node(SceneEdit &edit);
+
+    void free_node(uint32_t nodeIndex);
+
+    /** Moves a node to another slot, updating every index that refers to it. */
+    void move_node(uint32_t from, uint32_t to);
+
+    void replace_child(uint32_t parentIndex, uint32_t oldChild, uint32_t newChild);
+
+    [[nodiscard]] uint32_t find_best_sibling(const AABB &aabb) const;
+
+    /** Refits every node from this one up to the root, rotating each of them if that makes its subtree cheaper. */
+    void refit_ancestors(uint32_t nodeIndex);
+
+    void rotate(uint32_t nodeIndex);
+
+    /** Serializes the object's primitives into a free range of its type's scene buffer. */
+    void write_primitives(Scene &scene, Object &object, SceneEdit &edit);
+
+    /** Threads every node by its hit/miss links and writes the ones that changed. */
+    void write_nodes(Scene &scene, SceneEdit &edit) const;
+
+private:
+    std::vector<uint32_t> freeNodes;
+    std::unordered_map<const Hittable *, uint32_t> objectIndices;
+    std::unordered_map<int, PrimitiveBuffer> primitiveBuffers;
+};
\ No newline at end of file
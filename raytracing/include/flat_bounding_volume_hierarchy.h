@@ -0,0 +1,112 @@
+#pragma once
+
+#include "axis_aligned_bounding_box.h"
+#include "bounding_volume_hierarchy.h"
+#include "hittable.h"
+#include "scene.h"
+
+#include <memory>
+#include <vector>
+
+/**
+ * BVH built over a contiguous array of primitive references rather than a graph of `BVHNode`s. Nodes are written
+ * straight into a pre-sized arena of `BVHNode::GPU_t`s in depth-first order, so the arena already holds the threaded
+ * hit/miss links traversed by the compute shader. The arena is sized for one reference per leaf and compacted once the
+ * build is done.
+ */
+class FlatBVH {
+public:
+    /** Everything the builder needs to know about an object, so it never has to touch the object itself. */
+    struct PrimitiveRef {
+        AABB aabb;
+        glm::vec3 centroid {};
+        uint32_t objectIndex {}; // Index into the objects the BVH was built over.
+        Hittable::Type type {};
+        uint32_t primitiveIndex {BAD_INDEX}; // Into the object's primitives of its type, for `PrimitiveArrays` and `TriMesh`es.
+    };
+
+public:
+    FlatBVH() = default;
+
+    /**
+     * Every primitive of a `PrimitiveArrays` or `TriMesh` among the objects is referenced on its own, like a separate
+     * object.
+     */
+    FlatBVH(const std::vector<std::shared_ptr<Hittable>> &objects, const BVHNode::BuildOptions &options);
+
+    /**
+     * Writes the nodes and the objects they reference to the scene buffers. Objects are serialized in leaf order, so
+     * every leaf references a contiguous range of its type's buffer.
+     */
+    void gpu_serialize(Scene &scene, const std::vector<std::shared_ptr<Hittable>> &objects) const;
+
+    /**
+     * Serializes the objects again over the primitives `gpu_serialize()` wrote for them (and the vertices of their
+     * meshes), e.g., after they moved, and records the entries that changed. Nodes are left as they are. The tree must
+     * be the first serialized into the scene, and every object must serialize into as many primitives as it did then.
+     */
+    void gpu_serialize_primitives(Scene &scene, const std::vector<std::shared_ptr<Hittable>> &objects, SceneEdit &edit) const;
+
+    /**
+     * @return The SAH cost of the tree, where every reference counts as one intersection.
+     */
+    [[nodiscard]] float sah_cost() const;
+
+    /**
+     * Lowers the SAH cost of the tree by restructuring treelets of up to 7 leaves bottom-up, in the style of TRBVH.
+     * Every pass restructures every node's treelet. Leaves are kept as they are. Worth it for static scenes, which are
+     * traced far longer than they take to build.
+     */
+    void optimize(int numPasses, bool isParallel);
+
+    /**
+     * Reorders the nodes in memory, keeping the tree itself. Every layout keeps children after their parent. Builds
+     * (and `optimize()`) lay the nodes out depth-first.
+     */
+    void reorder(BVHNode::NodeLayout layout);
+
+    /**
+     * Refits the bounds of every node to the current bounds of the objects, bottom-up, keeping the topology of the tree.
+     * Much cheaper than a rebuild, but the tree degrades as objects move away from where it was built--use `sah_cost()`
+     * to tell when it needs a rebuild. Spatially split references are refit to the bounds of their whole object.
+     */
+    void refit(const std::vector<std::shared_ptr<Hittable>> &objects, bool isParallel);
+
+    /**
+     * Groups the nodes by their height, so every group only depends on the groups before it and all nodes of a group
+     * can be refit at once. Leaves come first.
+     *
+     * @param levelOffsets Receives the start of every group in the returned order, followed by the end of the last one.
+     */
+    [[nodiscard]] std::vector<uint32_t> get_refit_order(std::vector<uint32_t> &levelOffsets) const;
+
+public:
+    /**
+     * While building (and until serialized), leaves use `objectIndex` as the index of their first reference and
+     * `numChildren` as their number of references. Interior nodes have no children.
+     */
+    std::vector<BVHNode::GPU_t> nodes;
+    std::vector<PrimitiveRef> refs; // Sorted in leaf order.
+
+private:
+    void build(uint32_t nodeIndex, int start, int end, int depth, const BVHNode::BuildOptions &options);
+
+    /** Removes the slots left unused by subtrees with multi-reference leaves, remapping every link. */
+    void compact();
+
+    /**
+     * Builds the tree of a `BuildMethod::spatial` build, where references may be split between children. Since the
+     * final number of references is unknown, nodes are built into a temporary tree first and laid out afterward.
+     */
+    void build_spatial(const std::vector<std::shared_ptr<Hittable>> &objects, const BVHNode::BuildOptions &options);
+
+    /** Sorts `refs` by the Morton code of their centroid. */
+    void sort_morton(const BVHNode::BuildOptions &options);
+
+    [[nodiscard]] uint64_t morton_code(const PrimitiveRef &ref) const;
+
+private:
+    // Morton codes are quantized relative to the bounds of every reference centroid.
+    glm::vec3 centroidMin {}, centroidScale {};
+    bool isMortonCodeWide {false};
+};
\ No newline at end of file
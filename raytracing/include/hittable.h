@@ -2,19 +2,25 @@
 
 #include "axis_aligned_bounding_box.h"
 #include "scene.h"
+#include "glm/mat4x4.hpp"
 
 #include <algorithm>
-#include <any>
 #include <iostream>
 #include <memory>
 
 class Hittable {
 public:
     enum Type : uint32_t {
-        sphere  = 1,
-        quad    = 2,
-        tri     = 4,
-        bvhNode = 8,
+        sphere               = 1,
+        quad                 = 2,
+        tri                  = 4,
+        bvhNode              = 8,
+        wideBvhNode          = 16, // Only used to key the scene buffer of `WideBVH` nodes.
+        instance             = 32,
+        quantizedWideBvhNode = 64, // Only used to key the scene buffer of quantized `WideBVH` nodes.
+        bvhLinks             = 128, // Only used to key the scene buffer of octant-specific BVH links.
+        meshTri              = 256, // Triangle of a `TriMesh`, which indexes into the `meshVertex` buffer.
+        meshVertex           = 512, // Only used to key the scene buffer of `TriMesh` vertices.
     };
 
     [[nodiscard]] virtual AABB bounding_box() const = 0;
@@ -22,6 +28,13 @@ public:
     [[nodiscard]] virtual Type type() const = 0;
 
     virtual void gpu_serialize(Scene &scene) = 0;
+
+    /**
+     * Moves the object by an affine transform. The BVH containing the object has to be refit (or rebuilt) afterward.
+     */
+    virtual void transform(const glm::mat4 &) {
+        throw std::runtime_error("ERROR: Cannot transform this Hittable!");
+    }
 };
 
 template<typename T> requires std::is_base_of_v<Hittable, T>
@@ -47,6 +60,14 @@ public:
             object->gpu_serialize(scene);
     }
 
+    void transform(const glm::mat4 &transform) override {
+        aabb = AABB();
+        for (const auto &object : objects) {
+            object->transform(transform);
+            aabb = object == objects.front() ? object->bounding_box() : AABB(aabb, object->bounding_box());
+        }
+    }
+
     [[nodiscard]] Type type() const override {
         return objects.empty() ? throw std::runtime_error("ERROR: Cannot serialize an empty HittableList!") : objects.front()->type();
     }
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "axis_aligned_bounding_box.h"
+#include "bounding_volume_hierarchy.h"
+#include "flat_bounding_volume_hierarchy.h"
+#include "hittable.h"
+#include "scene.h"
+#include "glm/mat4x4.hpp"
+
+#include <memory>
+#include <vector>
+
+/**
+ * BVH over the objects of a mesh in object space, shared by every `Instance` of the mesh. It is serialized only once
+ * per scene, however many instances reference it.
+ */
+class BottomLevelBVH {
+public:
+    /**
+     * Spheres and nested instances are not supported, since rays are not renormalized when they are transformed into
+     * object space and the shader only traverses a single level of instances.
+     */
+    BottomLevelBVH(std::vector<std::shared_ptr<Hittable>> objects, const BVHNode::BuildOptions &options);
+
+    /**
+     * Serializes the BVH and its objects, unless this scene already holds them.
+     *
+     * @return The index of the root node in the scene's `Hittable::Type::bvhNode` buffer.
+     */
+    uint32_t gpu_serialize(Scene &scene);
+
+    [[nodiscard]] AABB bounding_box() const;
+
+public:
+    std::vector<std::shared_ptr<Hittable>> objects;
+    FlatBVH bvh;
+};
+
+
+/**
+ * Places a `BottomLevelBVH` in the world. Instances are leaves of the scene's (top-level) BVH, at which the shader
+ * transforms rays into object space and traverses the bottom-level BVH instead.
+ */
+class Instance : public Hittable {
+public:
+    struct GPU_t {
+        glm::mat4 objectToWorld;
+        glm::mat4 worldToObject;
+        uint32_t rootIndex; // Root node of the bottom-level BVH.
+        glm::vec3 pad0;
+    };
+
+public:
+    Instance(std::shared_ptr<BottomLevelBVH> bottomLevelBvh, const glm::mat4 &objectToWorld);
+
+    [[nodiscard]] AABB bounding_box() const override {
+        return aabb;
+    }
+
+    [[nodiscard]] Type type() const override {
+        return Hittable::Type::instance;
+    }
+
+    void gpu_serialize(Scene &scene) override;
+
+    void transform(const glm::mat4 &transform) override;
+
+public:
+    std::shared_ptr<BottomLevelBVH> bottomLevelBvh;
+    GPU_t instance {};
+
+private:
+    /** Bounds the world-space corners of the bottom-level BVH's bounds. */
+    void calculate_bounds();
+
+private:
+    AABB aabb;
+};
\ No newline at end of file
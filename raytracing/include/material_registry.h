@@ -0,0 +1,30 @@
+#pragma once
+
+#include "rt_material.h"
+
+#include <cstdint>
+#include <string>
+
+/**
+ * Table of every material (and texture) the program has created, each stored once and referred to by a handle. Objects
+ * intern their material when they are created and keep only its handle, so serializing a primitive costs a lookup in
+ * the scene's handle table rather than hashing its material (and texture name) again.
+ *
+ * Handles are indices, stable for the lifetime of the program, and shared by every scene. Interning is thread-safe.
+ */
+class MaterialRegistry {
+public:
+    /** @return The handle of the material, which is the same for every material equal to it. */
+    static uint32_t intern(const RTMaterial &material);
+
+    /** @return The handle of the texture, which is the same for every texture with that name. */
+    static uint32_t intern_texture(const std::string &name);
+
+    /** @return The interned material, whose `textureIndex` is always `BAD_INDEX`. */
+    static const RTMaterial &material(uint32_t handle);
+
+    /** @return The handle of the material's texture, or `BAD_INDEX` if it has none. */
+    static uint32_t texture_handle(uint32_t materialHandle);
+
+    static const std::string &texture(uint32_t textureHandle);
+};
\ No newline at end of file
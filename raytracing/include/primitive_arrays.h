@@ -0,0 +1,92 @@
+#pragma once
+
+#include "axis_aligned_bounding_box.h"
+#include "glm/mat4x4.hpp"
+#include "glm/vec3.hpp"
+#include "hittable.h"
+#include "rt_material.h"
+#include "scene.h"
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * Spheres, quads and triangles stored by field rather than as an object each: one array per field of every primitive
+ * type, plus the bounds of every primitive. Materials are referenced by their `MaterialRegistry` handle. Worth it for
+ * anything with many primitives (e.g., meshes), which would otherwise cost an allocation and a vtable each.
+ *
+ * Primitive arrays are a `Hittable` themselves, so they fit into any world. `FlatBVH` builds over every primitive in
+ * them as if each were an object of its own. Every other builder sees a single object, which then has to hold a single
+ * type of primitive.
+ */
+class PrimitiveArrays : public Hittable {
+public:
+    struct Spheres {
+        std::vector<glm::vec3> centers;
+        std::vector<float> radii;
+        std::vector<uint32_t> materialIds;
+        std::vector<AABB> bounds;
+    };
+
+    struct Quads {
+        std::vector<glm::vec3> corners, us, vs;
+        std::vector<uint32_t> materialIds;
+        std::vector<AABB> bounds;
+    };
+
+    struct Tris {
+        std::vector<glm::vec3> v0s, v1s, v2s;
+        std::vector<glm::vec3> us, vs; // Texture coordinates of the three vertices, like `Tri::GPU_t`.
+        std::vector<uint32_t> materialIds;
+        std::vector<AABB> bounds;
+    };
+
+public:
+    PrimitiveArrays() = default;
+
+    /** @return The ID of the material to add primitives with, which is its `MaterialRegistry` handle. */
+    static uint32_t add_material(const RTMaterial &material);
+
+    void add_sphere(glm::vec3 center, float radius, uint32_t materialId);
+
+    void add_quad(glm::vec3 corner, glm::vec3 u, glm::vec3 v, uint32_t materialId);
+
+    void add_tri(glm::vec3 v0, glm::vec3 v1, glm::vec3 v2, glm::vec3 u, glm::vec3 v, uint32_t materialId);
+
+    /**
+     * Adds the primitives of a `Sphere`, `Quad` or `Tri`, or of a `HittableList` of them, so worlds built out of objects
+     * can be moved over piece by piece. Throws for any other object.
+     */
+    void add(const Hittable &object);
+
+    /** Computes the bounds of every primitive, in parallel, for arrays that were filled in directly instead of added to. */
+    void update_bounds();
+
+    /** @return The number of primitives of the given type. */
+    [[nodiscard]] uint32_t size(Hittable::Type type) const;
+
+    /** @return The number of primitives of every type. */
+    [[nodiscard]] uint32_t size() const;
+
+    [[nodiscard]] AABB bounding_box(Hittable::Type type, uint32_t index) const;
+
+    /** Writes a single primitive to the scene buffer of its type. */
+    void gpu_serialize(Scene &scene, Hittable::Type type, uint32_t index);
+
+    // --- Hittable ---
+    [[nodiscard]] AABB bounding_box() const override;
+
+    /** @return The type of every primitive. Throws if the arrays are empty or hold more than one type. */
+    [[nodiscard]] Type type() const override;
+
+    /** Writes every primitive to the scene buffer of its type, spheres first, then quads, then triangles. */
+    void gpu_serialize(Scene &scene) override;
+
+    /** Spheres stay spheres, so their radius is scaled by the transform's x-axis scale only, like `Sphere` does. */
+    void transform(const glm::mat4 &transform) override;
+
+public:
+    Spheres spheres;
+    Quads quads;
+    Tris tris;
+};
\ No newline at end of file
@@ -2,26 +2,33 @@
 
 #include "axis_aligned_bounding_box.h"
 #include "glm/geometric.hpp"
+#include "glm/mat4x4.hpp"
 #include "glm/vec3.hpp"
 #include "hittable.h"
+#include "material_registry.h"
 #include "rt_material.h"
 #include "scene.h"
 
 #include <cstdint>
-#include <utility>
 
 #define PAD 0
 
 class Primitive : public Hittable {
-protected:
-    explicit Primitive(RTMaterial material) : material(std::move(material)) {}
+public:
+    [[nodiscard]] const RTMaterial &get_material() const {
+        return MaterialRegistry::material(materialHandle);
+    }
 
-    void gpu_serialize(Scene &scene) override {
-        scene.register_material(material);
+    /** @return The handle the primitive's material was interned under, see `MaterialRegistry`. */
+    [[nodiscard]] uint32_t get_material_handle() const {
+        return materialHandle;
     }
 
 protected:
-    RTMaterial material;
+    explicit Primitive(const RTMaterial &material) : materialHandle(MaterialRegistry::intern(material)) {}
+
+protected:
+    uint32_t materialHandle;
 };
 
 class Sphere : public Primitive {
@@ -34,7 +41,7 @@ public:
     };
 
 public:
-    Sphere(glm::vec3 center, float radius, RTMaterial material) : Primitive(std::move(material)) {
+    Sphere(glm::vec3 center, float radius, const RTMaterial &material) : Primitive(material) {
         sphere = GPU_t(center, radius, glm::vec3(PAD));
     }
 
@@ -43,9 +50,14 @@ public:
     }
 
     void gpu_serialize(Scene &scene) override {
-        Primitive::gpu_serialize(scene);
-        sphere.materialIndex = material.index;
-        scene.get_buffer(Hittable::Type::sphere).emplace_back(sphere);
+        sphere.materialIndex = scene.register_material(materialHandle);
+        scene.get_buffer<Sphere::GPU_t>(Hittable::Type::sphere).push_back(sphere);
+    }
+
+    /** Spheres stay spheres, so the radius is scaled by the transform's x-axis scale only. */
+    void transform(const glm::mat4 &transform) override {
+        sphere.center = glm::vec3(transform * glm::vec4(sphere.center, 1.0f));
+        sphere.radius *= glm::length(glm::vec3(transform[0]));
     }
 
     [[nodiscard]] Type type() const override {
@@ -70,29 +82,40 @@ public:
     };
 
 public:
-    Quad(glm::vec3 corner, glm::vec3 u, glm::vec3 v, RTMaterial material) : Primitive(std::move(material)) {
+    Quad(glm::vec3 corner, glm::vec3 u, glm::vec3 v, const RTMaterial &material) : Primitive(material) {
         quad = GPU_t(corner, PAD, u, PAD, v);
-
-        auto n = glm::cross(u, v);
-        quad.normal = glm::normalize(n);
-        quad.d = dot(quad.normal, corner);
-        quad.w = n / dot(n, n);
+        calculate_plane(quad);
     }
 
     [[nodiscard]] AABB bounding_box() const override {
-        return AABB(quad.corner, quad.corner + quad.u + quad.v).pad();
+        // All four corners are needed once the quad is not axis-aligned anymore.
+        return AABB(AABB(quad.corner, quad.corner + quad.u + quad.v), AABB(quad.corner + quad.u, quad.corner + quad.v)).pad();
     }
 
     void gpu_serialize(Scene &scene) override {
-        Primitive::gpu_serialize(scene);
-        quad.materialIndex = material.index;
-        scene.get_buffer(Hittable::Type::quad).emplace_back(quad);
+        quad.materialIndex = scene.register_material(materialHandle);
+        scene.get_buffer<Quad::GPU_t>(Hittable::Type::quad).push_back(quad);
+    }
+
+    void transform(const glm::mat4 &transform) override {
+        quad.corner = glm::vec3(transform * glm::vec4(quad.corner, 1.0f));
+        quad.u = glm::vec3(transform * glm::vec4(quad.u, 0.0f));
+        quad.v = glm::vec3(transform * glm::vec4(quad.v, 0.0f));
+        calculate_plane(quad);
     }
 
     [[nodiscard]] Type type() const override {
         return Hittable::Type::quad;
     }
 
+    /** Fills in the plane of the quad (and the vector to project hits onto its edges) from its corner and edges. */
+    static void calculate_plane(GPU_t &quad) {
+        auto n = glm::cross(quad.u, quad.v);
+        quad.normal = glm::normalize(n);
+        quad.d = dot(quad.normal, quad.corner);
+        quad.w = n / dot(n, n);
+    }
+
 public:
     GPU_t quad{};
 };
@@ -131,8 +154,8 @@ public:
     };
 
 public:
-    Tri(glm::vec3 v0, glm::vec3 v1, glm::vec3 v2, glm::vec3 u, glm::vec3 v, RTMaterial material) : Primitive(std::move(material)) {
-        tri = GPU_t(v0, PAD, v1, PAD, v2, PAD, u, PAD, v, PAD, glm::vec3(PAD), this->material.index);
+    Tri(glm::vec3 v0, glm::vec3 v1, glm::vec3 v2, glm::vec3 u, glm::vec3 v, const RTMaterial &material) : Primitive(material) {
+        tri = GPU_t(v0, PAD, v1, PAD, v2, PAD, u, PAD, v, PAD, glm::vec3(PAD));
     }
 
     [[nodiscard]] AABB bounding_box() const override {
@@ -140,9 +163,14 @@ public:
     }
 
     void gpu_serialize(Scene &scene) override {
-        Primitive::gpu_serialize(scene);
-        tri.materialIndex = material.index;
-        scene.get_buffer(Hittable::Type::tri).emplace_back(tri);
+        tri.materialIndex = scene.register_material(materialHandle);
+        scene.get_buffer<Tri::GPU_t>(Hittable::Type::tri).push_back(tri);
+    }
+
+    void transform(const glm::mat4 &transform) override {
+        tri.v0 = glm::vec3(transform * glm::vec4(tri.v0, 1.0f));
+        tri.v1 = glm::vec3(transform * glm::vec4(tri.v1, 1.0f));
+        tri.v2 = glm::vec3(transform * glm::vec4(tri.v2, 1.0f));
     }
 
     [[nodiscard]] Type type() const override {
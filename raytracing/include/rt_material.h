@@ -43,7 +43,6 @@ public:
 
 public:
     std::string texture;
-    uint32_t index {};
     GPU_t material {};
 
 protected:
@@ -52,13 +51,17 @@ protected:
     }
 };
 
+/** Hashes every field `operator==` compares, each through `std::hash`, so materials that compare equal hash equally. */
 template<>
 struct std::hash<RTMaterial> {
-    uint64_t operator()(const RTMaterial &material) const noexcept {
-        auto textureHash = std::hash<std::string>()(material.texture);
-        auto albedoHash = std::hash<glm::vec3>()(material.material.albedo);
-        auto hash = static_cast<uint32_t>(material.material.fuzziness) | material.material.type << 8;
-        return textureHash ^ (albedoHash << 16) ^ (hash << 24);
+    size_t operator()(const RTMaterial &material) const noexcept {
+        auto hash = std::hash<std::string>()(material.texture);
+        auto combine = [&hash](size_t value) { hash ^= value + 0x9E3779B97F4A7C15 + (hash << 6) + (hash >> 2); };
+        combine(std::hash<glm::vec3>()(material.material.albedo));
+        combine(std::hash<float>()(material.material.fuzziness));
+        combine(std::hash<uint32_t>()(material.material.type));
+        combine(std::hash<uint32_t>()(material.material.textureIndex));
+        return hash;
     }
 };
 
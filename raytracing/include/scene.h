@@ -3,8 +3,11 @@
 #include "camera.h"
 #include "rt_material.h"
 
-#include <any>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
@@ -16,7 +19,90 @@ struct GPUSceneData {
     GPUCameraData camera;
 };
 
+/** Entries of the scene buffers an edit wrote, so only those have to be uploaded again. */
+struct SceneEdit {
+    std::unordered_map<int, std::vector<uint32_t>> dirtyIndices; // By buffer type.
+    bool hasResized {false}; // A buffer changed size (or a material was registered), so every buffer has to be recreated.
+
+    /** @return The entries of the buffer of the given type that the edit wrote. */
+    [[nodiscard]] std::vector<uint32_t> dirty_indices(int type) const {
+        auto indices = dirtyIndices.find(type);
+        return indices != dirtyIndices.end() ? indices->second : std::vector<uint32_t>();
+    }
+};
+
+/**
+ * Contiguous buffer of a single GPU type, laid out exactly as it is uploaded. The element type is only erased so the
+ * scene can key every buffer by `Hittable::Type` in one registry, and it is checked whenever the buffer is accessed.
+ */
+class SceneBuffer {
+public:
+    SceneBuffer() = default;
+
+    SceneBuffer(const SceneBuffer &other) : storage(other.storage != nullptr ? other.storage->clone() : nullptr) {}
+
+    SceneBuffer(SceneBuffer &&other) noexcept = default;
+
+    SceneBuffer &operator=(const SceneBuffer &other) {
+        if (this != &other) storage = other.storage != nullptr ? other.storage->clone() : nullptr;
+        return *this;
+    }
+
+    SceneBuffer &operator=(SceneBuffer &&other) noexcept = default;
+
+    /** @return The values of the buffer, which take the given type on first access. */
+    template<typename T> requires std::is_trivially_copyable_v<T>
+    std::vector<T> &values() {
+        if (storage == nullptr) storage = std::make_unique<TypedStorage<T>>();
+        auto *typedStorage = dynamic_cast<TypedStorage<T> *>(storage.get());
+        if (typedStorage == nullptr)
+            throw std::runtime_error("ERROR: Scene buffer accessed as a different type than it holds!");
+        return typedStorage->values;
+    }
+
+    /** @return The values of the buffer, or `nullptr` if nothing was ever written to it. */
+    template<typename T> requires std::is_trivially_copyable_v<T>
+    [[nodiscard]] const std::vector<T> *values() const {
+        if (storage == nullptr) return nullptr;
+        auto *typedStorage = dynamic_cast<const TypedStorage<T> *>(storage.get());
+        if (typedStorage == nullptr)
+            throw std::runtime_error("ERROR: Scene buffer accessed as a different type than it holds!");
+        return &typedStorage->values;
+    }
+
+    [[nodiscard]] size_t size() const {
+        return storage != nullptr ? storage->size() : 0;
+    }
+
+private:
+    struct Storage {
+        virtual ~Storage() = default;
+
+        [[nodiscard]] virtual std::unique_ptr<Storage> clone() const = 0;
+
+        [[nodiscard]] virtual size_t size() const = 0;
+    };
+
+    template<typename T>
+    struct TypedStorage final : Storage {
+        std::vector<T> values;
+
+        [[nodiscard]] std::unique_ptr<Storage> clone() const override {
+            return std::make_unique<TypedStorage<T>>(*this);
+        }
+
+        [[nodiscard]] size_t size() const override {
+            return values.size();
+        }
+    };
+
+private:
+    std::unique_ptr<Storage> storage;
+};
+
+class BottomLevelBVH;
 class Camera;
+class TriMesh;
 class Scene {
 public:
     Scene() = default;
@@ -24,17 +110,76 @@ public:
     Scene(std::string name, Camera camera, glm::vec3 backgroundColor=DEFAULT_BACKGROUND)
         : name(std::move(name)), camera(camera), backgroundColor(backgroundColor) {}
 
-    std::vector<std::any> &get_buffer(int type);
+    /**
+     * @return The buffer of the given `Hittable::Type`, holding values of its GPU type (e.g., `Sphere::GPU_t` for
+     * spheres). Throws if the buffer holds another type.
+     */
+    template<typename T>
+    std::vector<T> &get_buffer(int type) {
+        return buffers[type].values<T>();
+    }
+
+    template<typename T>
+    [[nodiscard]] const std::vector<T> &get_buffer(int type) const {
+        static const auto empty = std::vector<T>();
+        auto buffer = buffers.find(type);
+        const auto *values = buffer != buffers.end() ? buffer->second.values<T>() : nullptr;
+        return values != nullptr ? *values : empty;
+    }
+
+    /** @return The number of entries in the buffer of the given `Hittable::Type`, whatever their type. */
+    [[nodiscard]] size_t buffer_size(int type) const;
+
+    /**
+     * Makes room for `numEntries` more entries in the buffer of a primitive or BVH node type, giving it its GPU type if
+     * it has none yet, so serializing that many entries into it allocates at most once. Other types are left as is.
+     */
+    void reserve_buffer(int type, size_t numEntries);
+
+    /** Replaces every buffer by a copy of the other scene's. */
+    void copy_buffers(const Scene &other);
+
+    /** Copies the entries an edit wrote to the other scene's buffers over the same entries of this scene's. */
+    void copy_entries(const Scene &other, const SceneEdit &edit);
+
+    /** Replaces the material and texture tables by a copy of the other scene's. */
+    void copy_materials(const Scene &other);
+
+    /** Clears every buffer (e.g., before re-serializing the scene), keeping the registered materials and textures. */
+    void clear_buffers();
+
+    /**
+     * @return The index of an interned material (see `MaterialRegistry`) in the scene's material table, which registers
+     * it, and its texture, the first time. Looking up a registered material is a single array access.
+     */
+    uint32_t register_material(uint32_t materialHandle);
 
-    void register_material(RTMaterial &material);
+    /** Overwrites a buffer with the values, recording every entry that changed. Changing its size changes them all. */
+    template<typename T>
+    void update_buffer(int type, const std::vector<T> &values, SceneEdit &edit) {
+        auto &buffer = get_buffer<T>(type);
+        if (buffer.size() != values.size()) {
+            buffer = values;
+            edit.hasResized = true;
+            return;
+        }
+        for (uint32_t i = 0; i < (uint32_t) values.size(); i++) {
+            if (std::memcmp(&buffer[i], &values[i], sizeof(T)) == 0) continue;
+            buffer[i] = values[i];
+            edit.dirtyIndices[type].push_back(i);
+        }
+    }
 
 public:
     std::string name;
     Camera camera;
     glm::vec3 backgroundColor {};
-    std::unordered_map<std::string, uint32_t> textures;
-    std::unordered_map<RTMaterial, uint32_t> materials;
+    std::vector<RTMaterial::GPU_t> materials; // By index, with the index of their texture in `textures`.
+    std::vector<std::string> textures;        // Names by index.
+    std::unordered_map<const BottomLevelBVH *, uint32_t> bottomLevelRoots; // Root node of every serialized bottom-level BVH.
+    std::unordered_map<const TriMesh *, uint32_t> meshVertexOffsets; // First vertex of every serialized mesh.
 
 private:
-    std::unordered_map<int, std::vector<std::any>> primitives;
+    std::unordered_map<int, SceneBuffer> buffers; // By `Hittable::Type`.
+    std::vector<uint32_t> materialIndices, textureIndices; // By handle, `BAD_INDEX` for those not registered yet.
 };
\ No newline at end of file
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "bounding_volume_hierarchy.h"
+#include "hittable.h"
+#include "instance.h"
+#include "primitives.h"
+#include "tri_mesh.h"
+#include "wide_bounding_volume_hierarchy.h"
+
+#include <stdexcept>
+#include <string>
+
+/** Calls the visitor with every scene buffer type and a default value of the GPU type its buffer holds. */
+template<typename Visitor>
+void for_each_buffer_type(Visitor &&visitor) {
+    visitor(Hittable::Type::sphere, Sphere::GPU_t());
+    visitor(Hittable::Type::quad, Quad::GPU_t());
+    visitor(Hittable::Type::tri, Tri::GPU_t());
+    visitor(Hittable::Type::instance, Instance::GPU_t());
+    visitor(Hittable::Type::bvhNode, BVHNode::GPU_t());
+    visitor(Hittable::Type::wideBvhNode, WideBVH::GPU_t());
+    visitor(Hittable::Type::quantizedWideBvhNode, WideBVH::QuantizedGPU_t());
+    visitor(Hittable::Type::bvhLinks, BVHNode::Links_t());
+    visitor(Hittable::Type::meshTri, TriMesh::GPU_t());
+    visitor(Hittable::Type::meshVertex, TriMesh::Vertex_t());
+}
+
+/** Calls the visitor with a default value of the GPU type held by the buffer of a type only known at runtime. */
+template<typename Visitor>
+void visit_buffer_type(int type, Visitor &&visitor) {
+    auto isKnown = false;
+    for_each_buffer_type([&](Hittable::Type bufferType, auto prototype) {
+        if ((int) bufferType != type) return;
+        isKnown = true;
+        visitor(prototype);
+    });
+    if (!isKnown) throw std::runtime_error("ERROR: Scene buffer type " + std::to_string(type) + " is unknown!");
+}
\ No newline at end of file
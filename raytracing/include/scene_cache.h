@@ -0,0 +1,43 @@
+#pragma once
+
+#include "scene.h"
+
+#include <cstdint>
+#include <string>
+#include <utility>
+
+/**
+ * Binary cache of built scenes, one file per scene. A file holds every GPU buffer of the scene, plus its material and
+ * texture tables, and is only loaded back under the key it was saved with. The key should hash everything the buffers
+ * are built from, since nothing else about the scene is checked.
+ */
+class SceneCache {
+public:
+    explicit SceneCache(std::string directory) : directory(std::move(directory)) {}
+
+    /**
+     * Loads the scene's buffers and tables with a single read of its file, if the file was saved under the same key (by
+     * the same version of the cache). The scene's name, camera and background are kept.
+     *
+     * @return Whether the scene was loaded. If not, the scene is left untouched.
+     */
+    bool load(Scene &scene, uint64_t key) const;
+
+    /**
+     * Overwrites the scene's file. Bottom-level roots and mesh vertex offsets are not saved, since they only matter
+     * while serializing.
+     */
+    void save(Scene &scene, uint64_t key) const;
+
+    [[nodiscard]] std::string path(const Scene &scene) const;
+
+    /** 64-bit FNV-1a, which (unlike `std::hash`) hashes the same on every platform and in every run. */
+    static uint64_t hash(const void *data, size_t size, uint64_t seed = FNV_OFFSET_BASIS);
+
+    /** Hashes the contents of a file, so the key changes with the assets a scene is generated from. */
+    static uint64_t hash_file(const std::string &path, uint64_t seed = FNV_OFFSET_BASIS);
+
+public:
+    static constexpr uint64_t FNV_OFFSET_BASIS = 0xCBF29CE484222325;
+    std::string directory;
+};
\ No newline at end of file
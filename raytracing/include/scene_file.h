@@ -0,0 +1,105 @@
+#pragma once
+
+#include "camera.h"
+#include "glm/mat4x4.hpp"
+#include "glm/vec3.hpp"
+#include "hittable.h"
+#include "instance.h"
+#include "primitive_arrays.h"
+#include "rt_material.h"
+#include "scene.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Scene described by a file rather than generated by code: a camera, materials, arrays of spheres, quads and triangles,
+ * and instances of meshes, which are referenced by name and provided by whoever loads the scene. Scenes are written in
+ * JSON (see `load_json()`) and compiled into a binary file that is memory-mapped and copied straight into the arrays.
+ */
+class SceneFile {
+public:
+    /** Laid out as in compiled files. */
+    struct CameraDescription {
+        glm::vec3 position {};
+        float fovDegrees {70.0f};
+        glm::vec3 at {};
+        float aspectRatio {1.0f};
+        float aperture {1.0f / 45.0f};
+        float focusDistance {10.0f};
+        float pad[2] {};
+    };
+
+    struct MeshReference {
+        std::string name;
+        uint32_t materialId {}; // Into `materials`.
+        glm::mat4 transform {1.0f};
+    };
+
+    /**
+     * @return The bottom-level BVH of the named mesh with the given material, or `nullptr` if there is no such mesh.
+     * Called once per reference, so it should build the BVH once and share it between every instance.
+     */
+    using MeshResolver = std::function<std::shared_ptr<BottomLevelBVH>(const std::string &name, const RTMaterial &material)>;
+
+public:
+    SceneFile() = default;
+
+    /** Loads a JSON scene, or a compiled one if the file starts like one. Throws if the file is missing or invalid. */
+    static SceneFile load(const std::string &path);
+
+    /**
+     * Parses a scene like the following, where every field but `name` and `camera` is optional. Materials are referred
+     * to by name or index, either per primitive (`materials`) or for every primitive of a type (`material`). Vectors in
+     * primitive arrays are flattened, three floats each, and converted in parallel. Mesh transforms are applied as
+     * translate * rotate * scale, where `rotate` is an angle in degrees followed by an axis.
+     *
+     * {
+     *     "name": "quads",
+     *     "camera": {"position": [0, 0, 9], "at": [0, 0, 0], "fov": 80, "aspectRatio": 1, "aperture": 0, "focusDistance": 10},
+     *     "background": [0, 0, 0],
+     *     "materials": [{"name": "red", "type": "lambertian", "albedo": [1, 0.2, 0.2]},
+     *                   {"name": "fumo", "type": "lambertian", "texture": "fumo_diffuse"},
+     *                   {"name": "mirror", "type": "metal", "albedo": [0.7, 0.6, 0.5], "fuzziness": 0.05},
+     *                   {"name": "glass", "type": "dielectric", "refractiveIndex": 1.5},
+     *                   {"name": "light", "type": "diffuseLight", "albedo": [15, 15, 15]}],
+     *     "spheres": {"centers": [0, 1, 0, 4, 1, 0], "radii": [1, 1], "materials": ["glass", "mirror"]},
+     *     "quads": {"corners": [...], "us": [...], "vs": [...], "material": "red"},
+     *     "tris": {"v0s": [...], "v1s": [...], "v2s": [...], "us": [...], "vs": [...], "materials": [...]},
+     *     "meshes": [{"mesh": "fumo", "material": "fumo", "translate": [0, -0.08, 0], "rotate": [90, 0, 1, 0], "scale": 1}]
+     * }
+     */
+    static SceneFile load_json(const std::string &path);
+
+    /** Maps a compiled scene into memory and copies every array of primitives into place in parallel. */
+    static SceneFile load_compiled(const std::string &path);
+
+    /**
+     * Loads the compiled form of a JSON scene (the same path with a `.rtscene` extension), unless it is missing or
+     * older than the JSON, in which case the JSON is loaded and compiled again.
+     */
+    static SceneFile load_and_compile(const std::string &path);
+
+    /** Writes the scene's compiled form, swapping in the whole file at once like `SceneCache`. */
+    void compile(const std::string &path) const;
+
+    /** @return An empty scene with the file's name, camera and background. */
+    [[nodiscard]] Scene make_scene() const;
+
+    /**
+     * Moves the primitives into the world, one `PrimitiveArrays` per type, so the file's arrays are left empty. Every
+     * mesh reference becomes an `Instance` of what `resolveMesh` returns for it, and throws if it returns nothing.
+     */
+    [[nodiscard]] std::vector<std::shared_ptr<Hittable>> make_world(const MeshResolver &resolveMesh);
+
+public:
+    std::string name;
+    CameraDescription camera;
+    glm::vec3 backgroundColor {DEFAULT_BACKGROUND};
+    std::vector<RTMaterial> materials;
+    PrimitiveArrays primitives; // Material IDs are `MaterialRegistry` handles, like in any other `PrimitiveArrays`.
+    std::vector<MeshReference> meshes;
+};
\ No newline at end of file
@@ -0,0 +1,337 @@
+#pragma once
+
+#include "axis_aligned_bounding_box.h"
+#include "glm/common.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+constexpr float COST_TRAVERSAL = 1.0f;
+constexpr float COST_INTERSECTION = 2.15f;
+constexpr int PARALLEL_TASK_SPAN = 4096;   // Spans smaller than this are built serially.
+constexpr int PARALLEL_CHUNK_SPAN = 16384; // Spans are binned and partitioned in chunks of this size.
+
+struct SplitInfo {
+    int axis {-1}, mid {-1};
+    float cost {std::numeric_limits<float>::max()}; // SAH cost of the split, if evaluated.
+};
+
+inline glm::vec3 centroid(const AABB &aabb) {
+    return 0.5f * (aabb.min + aabb.max);
+}
+
+/**
+ * @return The SAH cost of splitting a node into two children. Hit probabilities are relative to the area of the node
+ * itself, so the cost is directly comparable to the cost of making the node a leaf instead.
+ */
+inline float sah_cost(float areaParent, float areaLeft, float areaRight, int numLeft, int numRight) {
+    auto probabilityHitLeft = areaParent > 0.0f ? areaLeft / areaParent : 1.0f;
+    auto probabilityHitRight = areaParent > 0.0f ? areaRight / areaParent : 1.0f;
+
+    return COST_TRAVERSAL
+           + (probabilityHitLeft  * (float) numLeft  * COST_INTERSECTION)
+           + (probabilityHitRight * (float) numRight * COST_INTERSECTION);
+}
+
+/**
+ * @return The SAH cost of making a node a leaf that intersects each of its items.
+ */
+inline float sah_leaf_cost(int numItems) {
+    return COST_INTERSECTION * (float) numItems;
+}
+
+/**
+ * @return The SAH cost of splitting [start, end) into [start, mid) and [mid, end) as currently ordered.
+ */
+template<typename T, typename F>
+float get_split_cost(const std::vector<T> &items, int start, int mid, int end, F &&get_bounds) {
+    auto leftBounds = get_bounds(items[start]);
+    auto rightBounds = get_bounds(items[mid]);
+    for (int i = start + 1; i < mid; i++) leftBounds = AABB(leftBounds, get_bounds(items[i]));
+    for (int i = mid + 1; i < end; i++) rightBounds = AABB(rightBounds, get_bounds(items[i]));
+
+    return sah_cost(AABB(leftBounds, rightBounds).area(), leftBounds.area(), rightBounds.area(), mid - start, end - mid);
+}
+
+/**
+ * @return The number of fixed-size chunks [start, end) is split into by `for_each_chunk()`.
+ */
+inline int num_chunks(int start, int end) {
+    return (end - start + PARALLEL_CHUNK_SPAN - 1) / PARALLEL_CHUNK_SPAN;
+}
+
+/**
+ * Calls `function(chunk, chunkStart, chunkEnd)` for each chunk of [start, end), spreading the chunks across OpenMP tasks
+ * if `isParallel`. Chunk boundaries only depend on the range, so per-chunk results merged in chunk order do not depend
+ * on the number of threads.
+ */
+template<typename F>
+void for_each_chunk(int start, int end, bool isParallel, F &&function) {
+    auto numChunks = num_chunks(start, end);
+
+#pragma omp taskloop grainsize(1) shared(function) if(isParallel && numChunks > 1)
+    for (int chunk = 0; chunk < numChunks; chunk++) {
+        auto chunkStart = start + chunk * PARALLEL_CHUNK_SPAN;
+        function(chunk, chunkStart, std::min(end, chunkStart + PARALLEL_CHUNK_SPAN));
+    }
+}
+
+/**
+ * Stable LSD radix sort of `values` by the lowest `numKeyBits` of `keys`, 8 bits at a time. Every pass is histogrammed
+ * and scattered in chunks, so the result does not depend on the number of threads. Like `for_each_chunk()`, it only
+ * runs in parallel inside a parallel region.
+ */
+inline void radix_sort(std::vector<uint64_t> &keys, std::vector<uint32_t> &values, int numKeyBits, bool isParallel) {
+    constexpr int RADIX_BITS = 8;
+    constexpr int RADIX = 1 << RADIX_BITS;
+
+    auto size = (int) keys.size();
+    auto numChunks = num_chunks(0, size);
+    auto sortedKeys = std::vector<uint64_t>(size);
+    auto sortedValues = std::vector<uint32_t>(size);
+    auto chunkOffsets = std::vector<int>(numChunks * RADIX);
+
+    for (int shift = 0; shift < numKeyBits; shift += RADIX_BITS) {
+        std::fill(chunkOffsets.begin(), chunkOffsets.end(), 0);
+        for_each_chunk(0, size, isParallel, [&](int chunk, int chunkStart, int chunkEnd) {
+            for (int i = chunkStart; i < chunkEnd; i++) chunkOffsets[chunk * RADIX + ((keys[i] >> shift) & (RADIX - 1))]++;
+        });
+
+        // Digits are placed in ascending order and, within a digit, in chunk order to keep the sort stable.
+        int offset = 0;
+        for (int digit = 0; digit < RADIX; digit++) {
+            for (int chunk = 0; chunk < numChunks; chunk++) {
+                auto count = chunkOffsets[chunk * RADIX + digit];
+                chunkOffsets[chunk * RADIX + digit] = offset;
+                offset += count;
+            }
+        }
+
+        for_each_chunk(0, size, isParallel, [&](int chunk, int chunkStart, int chunkEnd) {
+            auto *offsets = &chunkOffsets[chunk * RADIX];
+            for (int i = chunkStart; i < chunkEnd; i++) {
+                auto destination = offsets[(keys[i] >> shift) & (RADIX - 1)]++;
+                sortedKeys[destination] = keys[i];
+                sortedValues[destination] = values[i];
+            }
+        });
+
+        std::swap(keys, sortedKeys);
+        std::swap(values, sortedValues);
+    }
+}
+
+/**
+ * Finds the best split by sweeping over every item boundary along each axis. `items` is left partitioned (sorted)
+ * along the axis of the returned split.
+ *
+ * @param get_bounds Returns the `AABB` of an item.
+ */
+template<typename T, typename F>
+SplitInfo get_best_split(std::vector<T> &items, int start, int end, F &&get_bounds) {
+    assert(end - start > 1);
+
+    SplitInfo bestSplit;
+    float bestCost = std::numeric_limits<float>::max();
+
+    auto box_compare = [&](const T &a, const T &b, int axis) {
+        return get_bounds(a).min[axis] < get_bounds(b).min[axis];
+    };
+
+    for (int axis = 0; axis < 3; axis++) {
+        std::sort(items.begin() + start, items.begin() + end, [&](const auto &a, const auto &b) {
+            return box_compare(a, b, axis);
+        });
+
+        // FIXME: WHY DOES COMPARING AN INCREASING LEFT BOUND WITH A FIXED RIGHT BOUND IMPROVE PERFORMANCE?!
+        auto leftBounds = AABB();
+        auto rightBounds = AABB();
+        for (int i = start + 1; i < end; i++) rightBounds = AABB(rightBounds, get_bounds(items[i]));
+
+        for (int mid = start + 1; mid < end; mid++) {
+//            auto leftBounds = AABB();
+//            auto rightBounds = AABB();
+//            for (int i = start; i < mid; i++) leftBounds = AABB(leftBounds, get_bounds(items[i]));
+//            for (int j = mid; j < end; j++) rightBounds = AABB(rightBounds, get_bounds(items[j]));
+
+            leftBounds = AABB(leftBounds, get_bounds(items[mid - 1]));
+
+            // Normalized by the summed area of both sides rather than the parent's, which only ranks splits and is
+            // not a true cost (see FIXME above), so `bestSplit.cost` is left unevaluated.
+            float cost = sah_cost(leftBounds.area() + rightBounds.area(), leftBounds.area(), rightBounds.area(), mid - start, end - mid);
+
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestSplit.axis = axis;
+                bestSplit.mid = mid;
+            }
+        }
+    }
+
+    // Items are still sorted along the last axis swept, so only re-sort if the best split lies on another axis.
+    if (bestSplit.axis != 2) {
+        std::sort(items.begin() + start, items.begin() + end, [&](const auto &a, const auto &b) {
+            return box_compare(a, b, bestSplit.axis);
+        });
+    }
+//    std::cout << "bestSplit: (" << start << ',' << end << ") -> (axis: " << bestSplit.axis << ", mid: " << bestSplit.mid << ", cost: " << bestCost << ")" << std::endl;
+    return bestSplit;
+}
+
+/**
+ * Finds an approximate best split by bucketing item centroids into `numBins` equally-sized bins along each axis and
+ * only evaluating the planes between bins. `items` is left stably partitioned around the returned split.
+ *
+ * @param get_bounds Returns the `AABB` of an item.
+ */
+template<typename T, typename F>
+SplitInfo get_binned_split(std::vector<T> &items, int start, int end, int numBins, bool isParallel, F &&get_bounds) {
+    assert(end - start > 1 && numBins > 1);
+
+    struct Bin {
+        AABB aabb;
+        int count {};
+
+        void add(const AABB &other, int otherCount) {
+            if (otherCount == 0) return;
+            aabb = count == 0 ? other : AABB(aabb, other);
+            count += otherCount;
+        }
+    };
+
+    auto span = end - start;
+    auto numChunks = num_chunks(start, end);
+    auto boxes = std::vector<AABB>(span);
+
+    // --- Centroid Bounds ---
+    // Bins span the bounds of the centroids rather than the items, so large items (e.g., the ground sphere) cannot
+    // squash every other item into a single bin.
+    auto chunkCentroidBounds = std::vector<std::pair<glm::vec3, glm::vec3>>(
+        numChunks, {glm::vec3(std::numeric_limits<float>::max()), glm::vec3(std::numeric_limits<float>::lowest())});
+    for_each_chunk(start, end, isParallel, [&](int chunk, int chunkStart, int chunkEnd) {
+        auto &[centroidMin, centroidMax] = chunkCentroidBounds[chunk];
+        for (int i = chunkStart; i < chunkEnd; i++) {
+            boxes[i - start] = get_bounds(items[i]);
+            centroidMin = glm::min(centroidMin, centroid(boxes[i - start]));
+            centroidMax = glm::max(centroidMax, centroid(boxes[i - start]));
+        }
+    });
+
+    auto [centroidMin, centroidMax] = chunkCentroidBounds.front();
+    for (const auto &[chunkMin, chunkMax] : chunkCentroidBounds) {
+        centroidMin = glm::min(centroidMin, chunkMin);
+        centroidMax = glm::max(centroidMax, chunkMax);
+    }
+
+    auto bin_index = [&](const AABB &aabb, int axis) {
+        auto scale = (float) numBins / (centroidMax[axis] - centroidMin[axis]);
+        auto index = (int) ((centroid(aabb)[axis] - centroidMin[axis]) * scale);
+        return std::clamp(index, 0, numBins - 1);
+    };
+
+    // --- Binning ---
+    // Every chunk fills its own set of bins for all three axes, which are then merged in chunk order.
+    auto chunkBins = std::vector<Bin>(numChunks * 3 * numBins);
+    for_each_chunk(start, end, isParallel, [&](int chunk, int chunkStart, int chunkEnd) {
+        auto *bins = &chunkBins[chunk * 3 * numBins];
+        for (int axis = 0; axis < 3; axis++) {
+            if (centroidMax[axis] <= centroidMin[axis]) continue; // Every centroid lies on the same plane.
+
+            for (int i = chunkStart; i < chunkEnd; i++) {
+                const auto &aabb = boxes[i - start];
+                bins[axis * numBins + bin_index(aabb, axis)].add(aabb, 1);
+            }
+        }
+    });
+
+    auto axisBins = std::vector<Bin>(3 * numBins);
+    for (int chunk = 0; chunk < numChunks; chunk++) {
+        for (int i = 0; i < 3 * numBins; i++) axisBins[i].add(chunkBins[chunk * 3 * numBins + i].aabb, chunkBins[chunk * 3 * numBins + i].count);
+    }
+
+    // --- Split Evaluation ---
+    SplitInfo bestSplit;
+    int bestBin = -1;
+    auto rightAreas = std::vector<float>(numBins);
+
+    // Every axis' bins hold every item, so any axis gives the bounds of the whole range.
+    auto parentBounds = Bin();
+    for (int i = 0; i < 3 * numBins && parentBounds.count < span; i++) parentBounds.add(axisBins[i].aabb, axisBins[i].count);
+    auto parentArea = parentBounds.aabb.area();
+
+    for (int axis = 0; axis < 3; axis++) {
+        if (centroidMax[axis] <= centroidMin[axis]) continue;
+        const auto *bins = &axisBins[axis * numBins];
+
+        // Sweep from the right to accumulate the area to the right of each plane, then from the left to evaluate them.
+        auto rightBounds = Bin();
+        for (int i = numBins - 1; i > 0; i--) {
+            rightBounds.add(bins[i].aabb, bins[i].count);
+            rightAreas[i] = rightBounds.aabb.area();
+        }
+
+        auto leftBounds = Bin();
+        for (int i = 0; i < numBins - 1; i++) {
+            leftBounds.add(bins[i].aabb, bins[i].count);
+
+            auto leftCount = leftBounds.count;
+            auto rightCount = span - leftCount;
+            if (leftCount == 0 || rightCount == 0) continue;
+
+            float cost = sah_cost(parentArea, leftBounds.aabb.area(), rightAreas[i + 1], leftCount, rightCount);
+
+            if (cost < bestSplit.cost) {
+                bestSplit.cost = cost;
+                bestSplit.axis = axis;
+                bestBin = i + 1;
+            }
+        }
+    }
+
+    if (bestSplit.axis == -1) {
+        // Centroids are coincident along every axis, so there is nothing to bin--fall back to an item median split.
+        bestSplit.axis = 0;
+        bestSplit.mid = start + span / 2;
+        return bestSplit;
+    }
+
+    // --- Partitioning ---
+    // The partition is stable so the resulting order (and thus the tree) does not depend on how the work was split.
+    auto isLeft = std::vector<uint8_t>(span);
+    auto chunkOffsets = std::vector<std::pair<int, int>>(numChunks); // Number of items to the left and right
+    for_each_chunk(start, end, isParallel, [&](int chunk, int chunkStart, int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; i++) {
+            isLeft[i - start] = bin_index(boxes[i - start], bestSplit.axis) < bestBin;
+            chunkOffsets[chunk].first += isLeft[i - start];
+        }
+        chunkOffsets[chunk].second = (chunkEnd - chunkStart) - chunkOffsets[chunk].first;
+    });
+
+    // Convert the per-chunk counts into the offsets each chunk scatters its items to.
+    int numLeft = 0;
+    for (const auto &[leftCount, rightCount] : chunkOffsets) numLeft += leftCount;
+    for (int chunk = 0, leftOffset = 0, rightOffset = numLeft; chunk < numChunks; chunk++) {
+        auto [leftCount, rightCount] = chunkOffsets[chunk];
+        chunkOffsets[chunk] = {leftOffset, rightOffset};
+        leftOffset += leftCount;
+        rightOffset += rightCount;
+    }
+
+    auto partitioned = std::vector<T>(span);
+    for_each_chunk(start, end, isParallel, [&](int chunk, int chunkStart, int chunkEnd) {
+        auto [leftOffset, rightOffset] = chunkOffsets[chunk];
+        for (int i = chunkStart; i < chunkEnd; i++) {
+            partitioned[isLeft[i - start] ? leftOffset++ : rightOffset++] = std::move(items[i]);
+        }
+    });
+    for_each_chunk(start, end, isParallel, [&](int, int chunkStart, int chunkEnd) {
+        std::move(partitioned.begin() + (chunkStart - start), partitioned.begin() + (chunkEnd - start), items.begin() + chunkStart);
+    });
+
+    bestSplit.mid = start + numLeft;
+    return bestSplit;
+}
\ No newline at end of file
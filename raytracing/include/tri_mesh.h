@@ -0,0 +1,121 @@
+#pragma once
+
+#include "axis_aligned_bounding_box.h"
+#include "glm/mat4x4.hpp"
+#include "glm/vec2.hpp"
+#include "glm/vec3.hpp"
+#include "hittable.h"
+#include "rt_material.h"
+#include "scene.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Indexed triangle mesh with a single material. Every vertex is stored (and uploaded) once, however many triangles
+ * share it: a triangle on the GPU is only the index of its three vertices in the scene's `Hittable::Type::meshVertex`
+ * buffer, plus its material. A mesh appends its vertices to that buffer once per scene, before its first triangle.
+ *
+ * Like `PrimitiveArrays`, `FlatBVH` builds over every triangle of a mesh as if it were an object of its own, so leaves
+ * reference ranges of triangles. Every other builder sees a single object.
+ */
+class TriMesh : public Hittable {
+public:
+    struct Vertex_t {
+        glm::vec3 position;
+        uint32_t uv; // Texture coordinates as two half floats, like `packHalf2x16()`.
+
+        bool operator==(const Vertex_t &other) const {
+            return position == other.position && uv == other.uv;
+        }
+    };
+
+    struct GPU_t {
+        glm::uvec3 indices; // Into the scene's `Hittable::Type::meshVertex` buffer.
+        uint32_t materialIndex;
+    };
+
+    /**
+     * Positions (three floats) and texture coordinates (two floats) of vertices stored in any layout, either as arrays
+     * of their own or as fields of an array of structs, like the vertices of a loaded mesh (see `from_vertices()`).
+     */
+    struct VertexSource {
+        const std::byte *positions;
+        size_t positionStride;
+        const std::byte *uvs;
+        size_t uvStride;
+        size_t count;
+
+        /** @return The positions and texture coordinates of vertices with `position` and `uv` fields. */
+        template<typename Vertex>
+        static VertexSource from_vertices(const std::vector<Vertex> &vertices) {
+            const auto *data = reinterpret_cast<const std::byte *>(vertices.data());
+            return {data + offsetof(Vertex, position), sizeof(Vertex), data + offsetof(Vertex, uv), sizeof(Vertex), vertices.size()};
+        }
+    };
+
+public:
+    TriMesh() = default;
+
+    /**
+     * Builds the mesh from a triangle list, merging vertices that are equal in both position and texture coordinates.
+     * Meshes that give every triangle its own vertices (like the baked `.mesh` assets) end up sharing them anyway.
+     */
+    TriMesh(const std::vector<glm::vec3> &positions, const std::vector<glm::vec2> &uvs, const std::vector<uint32_t> &indices, const RTMaterial &material);
+
+    /**
+     * Builds the mesh straight from the vertex and index buffers of a loaded mesh, transforming every vertex on the way
+     * in. Like the constructor above, but without copying the vertices into arrays first.
+     */
+    TriMesh(const VertexSource &source, const std::vector<uint32_t> &indices, const glm::mat4 &transform, const RTMaterial &material,
+            bool isParallel = true);
+
+    /** @return The number of triangles. */
+    [[nodiscard]] uint32_t size() const {
+        return (uint32_t) triangles.size();
+    }
+
+    [[nodiscard]] AABB bounding_box(uint32_t index) const;
+
+    /** Writes the positions of a triangle's vertices to `positions`. */
+    void tri_positions(uint32_t index, glm::vec3 (&positions)[3]) const;
+
+    /** Writes a single triangle to the scene's `Hittable::Type::meshTri` buffer, and the mesh's vertices if needed. */
+    void gpu_serialize(Scene &scene, uint32_t index);
+
+    // --- Hittable ---
+    [[nodiscard]] AABB bounding_box() const override {
+        return aabb;
+    }
+
+    [[nodiscard]] Type type() const override {
+        return Hittable::Type::meshTri;
+    }
+
+    void gpu_serialize(Scene &scene) override;
+
+    void transform(const glm::mat4 &transform) override;
+
+public:
+    std::vector<Vertex_t> vertices;
+    std::vector<glm::uvec3> triangles; // Indices into `vertices`.
+    uint32_t materialHandle {BAD_INDEX}; // See `MaterialRegistry`.
+
+private:
+    /**
+     * Transforms and packs the vertices, then merges the equal ones and remaps the indices. Every pass is parallel and
+     * only allocates whole arrays: rather than through a hash map, vertices are merged by sorting them by a hash of
+     * their contents, so equal vertices end up next to each other. Merged vertices keep the order in which they first
+     * appear, as if they had been merged one after the other.
+     */
+    void build(const VertexSource &source, const std::vector<uint32_t> &indices, const glm::mat4 &transform, bool isParallel);
+
+    /** @return The first entry of the mesh's vertices in the scene's vertex buffer, which they are appended to once. */
+    uint32_t gpu_serialize_vertices(Scene &scene) const;
+
+    void calculate_bounds();
+
+private:
+    AABB aabb;
+};
\ No newline at end of file
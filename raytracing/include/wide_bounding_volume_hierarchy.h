@@ -0,0 +1,84 @@
+#pragma once
+
+#include "axis_aligned_bounding_box.h"
+#include "bounding_volume_hierarchy.h"
+#include "scene.h"
+#include "glm/vec4.hpp"
+
+#include <vector>
+
+constexpr int WIDE_BVH_STACK_SIZE = 64; // Must match `compute.comp`.
+
+/**
+ * BVH with up to 4 or 8 children per node, collapsed from a serialized binary BVH. Every node fetched tests the bounds
+ * of all of its children at once, so rays need far fewer dependent node fetches than with the binary BVH. Unlike the
+ * binary BVH, it is traversed with a (small) stack rather than hit/miss links.
+ */
+class WideBVH {
+public:
+    /**
+     * Four children with their bounds stored per axis, so the shader can slab test all of them at once. 8-wide nodes
+     * span two consecutive `GPU_t`s.
+     */
+    struct GPU_t {
+        glm::vec4 minX {}, minY {}, minZ {};
+        glm::vec4 maxX {}, maxY {}, maxZ {};
+        glm::uvec4 childIndices {BAD_INDEX}; // First `GPU_t` of an interior child, or first primitive of a leaf.
+        glm::uvec4 childTypes {};            // `Hittable::Type` (0 if empty) | number of primitives << 16 for leaves.
+    };
+
+    /**
+     * `GPU_t` with the bounds of its children quantized to 8 bits per plane, relative to a frame spanning all of them.
+     * Frames are scaled by a power of two, so the shader decodes every plane with a single exact multiply and a rounded
+     * add. Lower planes are rounded down and upper planes up, so the decoded bounds always enclose the exact ones.
+     * Takes 80 instead of 128 bytes.
+     */
+    struct QuantizedGPU_t {
+        glm::vec3 origin {};        // Minimum corner of the frame.
+        uint32_t exponents {};      // Biased exponent of the frame's scale per axis, in bits [8 * axis, 8 * axis + 8).
+        glm::uvec3 quantizedMin {}; // Lower plane of lane i per axis, in bits [8 * i, 8 * i + 8).
+        uint32_t pad0 {};
+        glm::uvec3 quantizedMax {}; // Upper plane of lane i per axis, in bits [8 * i, 8 * i + 8).
+        uint32_t pad1 {};
+        glm::uvec4 childIndices {BAD_INDEX};
+        glm::uvec4 childTypes {};
+    };
+
+public:
+    WideBVH() = default;
+
+    /**
+     * Collapses the binary BVH by repeatedly replacing the interior child with the largest surface area by its own two
+     * children, until a node has `width` children or only leaves.
+     *
+     * @param binaryNodes The scene's `Hittable::Type::bvhNode` buffer, as written by `BVHNode` or `FlatBVH`.
+     * @param width 4 or 8.
+     */
+    WideBVH(const std::vector<BVHNode::GPU_t> &binaryNodes, int width);
+
+    /** Writes both the exact nodes and their quantized encoding, so either can be traversed. */
+    void gpu_serialize(Scene &scene) const;
+
+    /**
+     * Copies the bounds of the binary nodes the children were collapsed from, e.g., after the binary BVH was refit.
+     * The binary BVH must have kept its topology.
+     */
+    void refit(const std::vector<BVHNode::GPU_t> &binaryNodes);
+
+    static QuantizedGPU_t quantize(const GPU_t &node);
+
+    /** @return Whether the shader's traversal stack is deep enough for the BVH, which it cannot traverse otherwise. */
+    [[nodiscard]] bool fits_stack() const {
+        return maxStackSize <= WIDE_BVH_STACK_SIZE;
+    }
+
+public:
+    int width {4};
+    int maxStackSize {}; // Largest number of nodes the shader ever has to keep on its stack.
+    std::vector<GPU_t> nodes;
+    std::vector<uint32_t> binaryIndices; // Binary node of every child (`BAD_INDEX` if empty), 4 per `GPU_t`.
+
+private:
+    /** @return The index of the node's first `GPU_t`. */
+    uint32_t collapse(const std::vector<BVHNode::GPU_t> &binaryNodes, uint32_t binaryIndex, int stackSize);
+};
\ No newline at end of file
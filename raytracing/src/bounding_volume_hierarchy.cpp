@@ -1,78 +1,83 @@
 #include "../include/bounding_volume_hierarchy.h"
 #include "../include/axis_aligned_bounding_box.h"
 #include "../include/scene.h"
+#include "../include/surface_area_heuristic.h"
 
-static bool box_compare(const std::shared_ptr<Hittable> &a, const std::shared_ptr<Hittable> &b, int axis) {
-    return a->bounding_box().min[axis] < b->bounding_box().min[axis];
-}
-
-static float sah_cost(float areaLeft, float areaRight, int numLeft, int numRight) {
-    const auto costTraversal = 1.0f;
-    const auto costIntersection = 2.15f;
-
-    auto totalArea = areaLeft + areaRight;
-    auto probabilityHitLeft = areaLeft / totalArea;
-    auto probabilityHitRight = areaRight / totalArea;
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-    return costTraversal
-           + (probabilityHitLeft  * (float) numLeft  * costIntersection)
-           + (probabilityHitRight * (float) numRight * costIntersection);
+static AABB object_bounds(const std::shared_ptr<Hittable> &object) {
+    return object->bounding_box();
 }
 
-struct SplitInfo {
-    int axis {-1}, mid {-1};
-};
-
-SplitInfo get_best_split(std::vector<std::shared_ptr<Hittable>> objects, int start, int end) {
-    assert(end - start > 1);
-
-    SplitInfo bestSplit;
-    float bestCost = std::numeric_limits<float>::max();
-
-    for (int axis = 0; axis < 3; axis++) {
-        std::sort(objects.begin() + start, objects.begin() + end, [axis](const auto &a, const auto &b) {
-            return box_compare(a, b, axis);
-        });
-
-        // FIXME: WHY DOES COMPARING AN INCREASING LEFT BOUND WITH A FIXED RIGHT BOUND IMPROVE PERFORMANCE?!
-        auto leftBounds = AABB();
-        auto rightBounds = AABB();
-        for (int i = start + 1; i < end; i++) rightBounds = AABB(rightBounds, objects[i]->bounding_box());
-
-        for (int mid = start + 1; mid < end; mid++) {
-//            auto leftBounds = AABB();
-//            auto rightBounds = AABB();
-//            for (int i = start; i < mid; i++) leftBounds = AABB(leftBounds, objects[i]->bounding_box());
-//            for (int j = mid; j < end; j++) rightBounds = AABB(rightBounds, objects[j]->bounding_box());
-
-            leftBounds = AABB(leftBounds, objects[mid - 1]->bounding_box());
-
-            float cost = sah_cost(leftBounds.area(), rightBounds.area(), mid - start, end - mid);
+/**
+ * @return Whether every object in [start, end) has the same type, so they can share a leaf.
+ */
+static bool has_single_type(const std::vector<std::shared_ptr<Hittable>> &objects, int start, int end) {
+    return std::all_of(objects.begin() + start + 1, objects.begin() + end, [&](const auto &object) {
+        return object->type() == objects[start]->type();
+    });
+}
 
-            if (cost < bestCost) {
-                bestCost = cost;
-                bestSplit.axis = axis;
-                bestSplit.mid = mid;
-            }
-        }
+BVHNode::BVHNode(std::vector<std::shared_ptr<Hittable>> &objects, int start, int end, const BuildOptions &options) {
+    if (options.method == BuildMethod::morton)
+        throw std::runtime_error("ERROR: Morton builds are only supported by FlatBVH!");
+    if (options.method == BuildMethod::spatial)
+        throw std::runtime_error("ERROR: Spatial split builds are only supported by FlatBVH!");
+
+#ifdef _OPENMP
+    if (options.shouldBuildParallel && !omp_in_parallel()) {
+        // Open a single parallel region for the whole build. Subtrees are then picked up by idle threads as tasks.
+#pragma omp parallel
+#pragma omp single
+        build(objects, start, end, options);
+        return;
     }
-//    std::cout << "bestSplit: (" << start << ',' << end << ") -> (axis: " << bestSplit.axis << ", mid: " << bestSplit.mid << ", cost: " << bestCost << ")" << std::endl;
-    return bestSplit;
+#endif
+    build(objects, start, end, options);
+}
+
+BVHNode::BVHNode(SubtreeKey, std::vector<std::shared_ptr<Hittable>> &objects, int start, int end, const BuildOptions &options) {
+    build(objects, start, end, options);
 }
 
-BVHNode::BVHNode(std::vector<std::shared_ptr<Hittable>> &objects, int start, int end) {
+void BVHNode::build(std::vector<std::shared_ptr<Hittable>> &objects, int start, int end, const BuildOptions &options) {
     auto span = end - start;
     if (span == 1) {
         left = right = objects[start];
+        numNodes = 3;
     } else {
-        auto split = get_best_split(objects, start, end);
-        // Partition objects based on the calculated best split.
-        std::sort(objects.begin() + start, objects.begin() + end, [&](const auto &a, const auto &b) {
-            return box_compare(a, b, split.axis);
-        });
-
-        left = (split.mid - start == 1) ? objects[start] : std::make_shared<BVHNode>(objects, start, split.mid);
-        right = (end - split.mid == 1) ? objects[split.mid] : std::make_shared<BVHNode>(objects, split.mid, end);
+        // Small ranges are not worth the overhead of a task, so their whole subtree is built serially.
+        auto isParallel = options.shouldBuildParallel && span >= PARALLEL_TASK_SPAN;
+
+        // Objects are partitioned based on the calculated best split.
+        auto split = options.method == BuildMethod::binned
+                         ? get_binned_split(objects, start, end, options.numBins, isParallel, object_bounds)
+                         : get_best_split(objects, start, end, object_bounds);
+
+        // Small ranges of one type become a leaf, unless splitting them is expected to be cheaper.
+        if (span <= options.maxLeafSize && has_single_type(objects, start, end)) {
+            if (split.cost == std::numeric_limits<float>::max()) split.cost = get_split_cost(objects, start, split.mid, end, object_bounds);
+            if (sah_leaf_cost(span) <= split.cost) {
+                leafObjects.assign(objects.begin() + start, objects.begin() + end);
+                node.aabb = object_bounds(objects[start]);
+                for (int i = start + 1; i < end; i++) node.aabb = AABB(node.aabb, object_bounds(objects[i]));
+                numNodes = 1;
+                return;
+            }
+        }
+
+        // Children cover disjoint ranges of `objects`, so they can be built concurrently.
+#pragma omp task default(shared) if(isParallel)
+        left = (split.mid - start == 1) ? objects[start] : std::make_shared<BVHNode>(SubtreeKey(), objects, start, split.mid, options);
+        right = (end - split.mid == 1) ? objects[split.mid] : std::make_shared<BVHNode>(SubtreeKey(), objects, split.mid, end, options);
+#pragma omp taskwait
+
+        auto num_child_nodes = [](const std::shared_ptr<Hittable> &child) {
+            return child->type() == Hittable::Type::bvhNode ? static_cast<const BVHNode &>(*child).numNodes : 1;
+        };
+        numNodes = 1 + num_child_nodes(left) + num_child_nodes(right);
     }
 
     node.aabb = AABB(left->bounding_box(), right->bounding_box());
@@ -86,45 +91,163 @@ Hittable::Type BVHNode::type() const {
     return Hittable::Type::bvhNode;
 }
 
-void gpu_serialize_internal(Scene &scene, Hittable *root, uint32_t nextRightNodeIndex, uint32_t nodeIndex) { // NOLINT
-    auto type = root->type();
-    auto &buffer = scene.get_buffer(type);
-    auto &bvh = scene.get_buffer(Hittable::Type::bvhNode);
+float BVHNode::sah_cost() const { // NOLINT
+    // Cost of a node is the cost of traversing it plus the cost of each child weighted by the probability a ray that
+    // hits this node also hits the child.
+    if (!leafObjects.empty()) return sah_leaf_cost((int) leafObjects.size());
+
+    auto cost = COST_TRAVERSAL;
+    auto area = node.aabb.area();
+    for (const auto &child : {left, right}) {
+        auto childCost = child->type() == Hittable::Type::bvhNode ? static_cast<BVHNode *>(child.get())->sah_cost() : COST_INTERSECTION;
+        cost += (area > 0.0f ? child->bounding_box().area() / area : 1.0f) * childCost;
+        if (left == right) break; // Leaf nodes point both children at the same object.
+    }
+    return cost;
+}
+
+const char *to_string(BVHNode::BuildMethod method) {
+    switch (method) {
+        case BVHNode::BuildMethod::sweep:   return "sweep";
+        case BVHNode::BuildMethod::binned:  return "binned";
+        case BVHNode::BuildMethod::morton:  return "morton";
+        case BVHNode::BuildMethod::spatial: return "spatial";
+        default:                            return "unknown";
+    }
+}
 
-    if (type != Hittable::Type::bvhNode) {
-        auto leaf = BVHNode::GPU_t();
-        auto startIndex = (uint32_t) buffer.size();
+const char *to_string(BVHNode::NodeLayout layout) {
+    switch (layout) {
+        case BVHNode::NodeLayout::depthFirst:   return "depth-first";
+        case BVHNode::NodeLayout::breadthFirst: return "breadth-first";
+        case BVHNode::NodeLayout::vanEmdeBoas:  return "van Emde Boas";
+        default:                                return "unknown";
+    }
+}
+
+void BVHNode::gpu_serialize(Scene &scene) {
+    // The root takes the first slot, and every other node the next free slot once its parent is visited. The number of
+    // nodes was counted while building, so the buffer only grows once. Serializing an `Instance` appends its bottom-level
+    // BVH to the same buffer, past every slot reserved here.
+    auto &bvh = scene.get_buffer<GPU_t>(Hittable::Type::bvhNode);
+    if (!bvh.empty()) throw std::runtime_error("ERROR: A BVH can only be serialized into an empty node buffer!");
+    if (numNodes >= BAD_INDEX)
+        throw std::runtime_error("ERROR: Cannot serialize a BVH of " + std::to_string(numNodes) + " nodes!");
+    bvh.resize(numNodes);
+    auto nextIndex = 1u;
+
+    // Trees over large meshes can be deeper than the call stack, so they are walked with a stack of their own. Left
+    // children are visited first, so nodes and primitives are written in the same order as a recursive walk.
+    struct StackEntry {
+        Hittable *hittable;
+        uint32_t nodeIndex;
+        uint32_t missIndex;
+    };
+    auto stack = std::vector<StackEntry> {{this, 0, BAD_INDEX}};
+    while (!stack.empty()) {
+        auto [hittable, nodeIndex, missIndex] = stack.back();
+        stack.pop_back();
+
+        auto type = hittable->type();
+        auto *bvhNode = type == Hittable::Type::bvhNode ? static_cast<BVHNode *>(hittable) : nullptr;
+        auto isMultiObjectLeaf = bvhNode != nullptr && !bvhNode->leafObjects.empty();
+        if (bvhNode != nullptr && !isMultiObjectLeaf) {
+            auto leftIndex = nextIndex, rightIndex = nextIndex + 1;
+            nextIndex += 2;
+            bvhNode->node.hitIndex = leftIndex;
+            bvhNode->node.missIndex = missIndex;
+            bvh[nodeIndex] = bvhNode->node;
+
+            stack.push_back({bvhNode->right.get(), rightIndex, missIndex});
+            stack.push_back({bvhNode->left.get(), leftIndex, rightIndex});
+            continue;
+        }
+
+        if (isMultiObjectLeaf) type = bvhNode->leafObjects.front()->type();
+        auto leaf = GPU_t();
+        auto startIndex = (uint32_t) scene.buffer_size(type);
 
         // Add children to the buffer. On the GPU, the BVH node will reference the contiguous sequence of children.
-        root->gpu_serialize(scene);
+        if (isMultiObjectLeaf) {
+            for (const auto &object : bvhNode->leafObjects) object->gpu_serialize(scene);
+        } else {
+            hittable->gpu_serialize(scene);
+        }
 
-        leaf.aabb = root->bounding_box();
+        leaf.aabb = hittable->bounding_box();
         leaf.objectIndex = startIndex;
         leaf.type = type;
-        leaf.numChildren = (uint32_t) buffer.size() - startIndex;
-
-        leaf.hitIndex = nextRightNodeIndex;
-        leaf.missIndex = nextRightNodeIndex;
-
+        leaf.numChildren = (uint32_t) scene.buffer_size(type) - startIndex;
+        leaf.hitIndex = missIndex;
+        leaf.missIndex = missIndex;
         bvh[nodeIndex] = leaf;
-    } else {
-        auto bvhNode = dynamic_cast<BVHNode *>(root);
-        if (bvhNode == nullptr)
-            throw std::runtime_error("ERROR: Could not create node when serializing BVH node!");
+    }
+}
 
-        auto leftIndex = (uint32_t) bvh.size() + 1;
-        auto rightIndex = (uint32_t) bvh.size() + 2;
-        bvh.resize(bvh.size() + 3); // Resize bvh to hold current node + children
+void BVHNode::gpu_serialize_octant_links(Scene &scene) {
+    scene.get_buffer<Links_t>(Hittable::Type::bvhLinks) = get_octant_links(scene.get_buffer<GPU_t>(Hittable::Type::bvhNode));
+}
 
-        bvhNode->node.hitIndex = leftIndex;
-        bvhNode->node.missIndex = nextRightNodeIndex;
+std::vector<BVHNode::Links_t> BVHNode::get_octant_links(const std::vector<GPU_t> &nodes) {
+    auto numNodes = (uint32_t) nodes.size();
+
+    // Free slots (interior nodes without children) are not part of any tree.
+    auto isUsed = [&](uint32_t i) { return nodes[i].numChildren != 0 || nodes[i].hitIndex != BAD_INDEX; };
+
+    // Whether the left child is the near one only depends on the sign of the ray's direction along the split axis.
+    auto splitAxes = std::vector<int>(numNodes);
+    auto isLeftLower = std::vector<bool>(numNodes);
+    auto isChild = std::vector<bool>(numNodes);
+    for (uint32_t i = 0; i < numNodes; i++) {
+        if (nodes[i].numChildren != 0 || !isUsed(i)) continue;
+        const auto &left = nodes[nodes[i].hitIndex], &right = nodes[left.missIndex];
+        auto offset = (right.aabb.min + right.aabb.max) - (left.aabb.min + left.aabb.max);
+        auto distance = glm::abs(offset);
+        splitAxes[i] = distance.x >= distance.y && distance.x >= distance.z ? 0 : distance.y >= distance.z ? 1 : 2;
+        isLeftLower[i] = offset[splitAxes[i]] >= 0.0f;
+        isChild[nodes[i].hitIndex] = isChild[left.missIndex] = true;
+    }
 
-        bvh[nodeIndex] = bvhNode->node;
-        gpu_serialize_internal(scene, bvhNode->left.get(), rightIndex, leftIndex);
-        gpu_serialize_internal(scene, bvhNode->right.get(), nextRightNodeIndex, rightIndex);
+    // Nodes are visited parents first, so every miss link is final by the time its node is reached. Roots (of the
+    // top-level BVH and of every bottom-level one) keep the miss link they were serialized with.
+    auto order = std::vector<uint32_t>();
+    order.reserve(numNodes);
+    auto stack = std::vector<uint32_t>();
+    for (uint32_t root = 0; root < numNodes; root++) {
+        if (isChild[root] || !isUsed(root)) continue;
+        stack.push_back(root);
+        while (!stack.empty()) {
+            auto i = stack.back();
+            stack.pop_back();
+            order.push_back(i);
+            if (nodes[i].numChildren != 0) continue;
+            stack.push_back(nodes[nodes[i].hitIndex].missIndex);
+            stack.push_back(nodes[i].hitIndex);
+        }
     }
-}
 
-void BVHNode::gpu_serialize(Scene &scene) {
-    gpu_serialize_internal(scene, this, BAD_INDEX, 0);
-};
\ No newline at end of file
+    auto links = std::vector<Links_t>();
+    links.reserve(NUM_OCTANTS * numNodes);
+    for (uint32_t octant = 0; octant < NUM_OCTANTS; octant++) {
+        auto octantLinks = std::vector<Links_t>(numNodes);
+        for (uint32_t i = 0; i < numNodes; i++) octantLinks[i] = {nodes[i].hitIndex, nodes[i].missIndex};
+
+        for (auto i : order) {
+            auto &link = octantLinks[i];
+            if (nodes[i].numChildren != 0) {
+                link.hitIndex = link.missIndex;
+                continue;
+            }
+            auto leftIndex = nodes[i].hitIndex, rightIndex = nodes[leftIndex].missIndex;
+            auto isNegative = (octant >> splitAxes[i] & 1) != 0;
+            auto nearIndex = isLeftLower[i] != isNegative ? leftIndex : rightIndex;
+            auto farIndex = nearIndex == leftIndex ? rightIndex : leftIndex;
+
+            link.hitIndex = nearIndex;
+            octantLinks[nearIndex].missIndex = farIndex;
+            octantLinks[farIndex].missIndex = link.missIndex;
+        }
+        links.insert(links.end(), octantLinks.begin(), octantLinks.end());
+    }
+    return links;
+}
\ No newline at end of file
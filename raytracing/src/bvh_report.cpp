@@ -0,0 +1,288 @@
+#include "../include/bvh_report.h"
+#include "../include/instance.h"
+#include "../include/primitives.h"
+#include "../include/surface_area_heuristic.h"
+#include "../include/tri_mesh.h"
+#include "../include/wide_bounding_volume_hierarchy.h"
+
+#include <nlohmann/json.hpp>
+
+#include <iomanip>
+
+constexpr size_t CACHE_LINE_SIZE = 128; // Of the GPU's L2 cache.
+
+static const char *type_name(uint32_t type) {
+    switch (type) {
+        case Hittable::Type::sphere:               return "sphere";
+        case Hittable::Type::quad:                 return "quad";
+        case Hittable::Type::tri:                  return "tri";
+        case Hittable::Type::bvhNode:              return "bvhNode";
+        case Hittable::Type::wideBvhNode:          return "wideBvhNode";
+        case Hittable::Type::instance:             return "instance";
+        case Hittable::Type::quantizedWideBvhNode: return "quantizedWideBvhNode";
+        case Hittable::Type::bvhLinks:             return "bvhLinks";
+        case Hittable::Type::meshTri:              return "meshTri";
+        case Hittable::Type::meshVertex:           return "meshVertex";
+        default:                                   return "unknown";
+    }
+}
+
+static size_t gpu_size(uint32_t type) {
+    switch (type) {
+        case Hittable::Type::sphere:               return sizeof(Sphere::GPU_t);
+        case Hittable::Type::quad:                 return sizeof(Quad::GPU_t);
+        case Hittable::Type::tri:                  return sizeof(Tri::GPU_t);
+        case Hittable::Type::bvhNode:              return sizeof(BVHNode::GPU_t);
+        case Hittable::Type::wideBvhNode:          return sizeof(WideBVH::GPU_t);
+        case Hittable::Type::instance:             return sizeof(Instance::GPU_t);
+        case Hittable::Type::quantizedWideBvhNode: return sizeof(WideBVH::QuantizedGPU_t);
+        case Hittable::Type::bvhLinks:             return sizeof(BVHNode::Links_t);
+        case Hittable::Type::meshTri:              return sizeof(TriMesh::GPU_t);
+        case Hittable::Type::meshVertex:           return sizeof(TriMesh::Vertex_t);
+        default:                                   return 0;
+    }
+}
+
+/** Buffers a primitive may be bounded from, looked up once so bounding a primitive does not search the scene's buffers. */
+struct PrimitiveBuffers {
+    const std::vector<Sphere::GPU_t> &spheres;
+    const std::vector<Quad::GPU_t> &quads;
+    const std::vector<Tri::GPU_t> &tris;
+    const std::vector<TriMesh::GPU_t> &meshTris;
+    const std::vector<TriMesh::Vertex_t> &meshVertices;
+    const std::vector<Instance::GPU_t> &instances;
+    const std::vector<BVHNode::GPU_t> &bvh;
+};
+
+/** @return The bounds of a serialized primitive, like `refit.comp` computes them. */
+static AABB primitive_bounds(const PrimitiveBuffers &buffers, uint32_t type, uint32_t index) {
+    switch (type) {
+        case Hittable::Type::sphere: {
+            const auto &sphere = buffers.spheres[index];
+            return {sphere.center - glm::vec3(std::abs(sphere.radius)), sphere.center + glm::vec3(std::abs(sphere.radius))};
+        }
+        case Hittable::Type::quad: {
+            const auto &quad = buffers.quads[index];
+            return AABB(AABB(quad.corner, quad.corner + quad.u + quad.v), AABB(quad.corner + quad.u, quad.corner + quad.v)).pad();
+        }
+        case Hittable::Type::tri: {
+            const auto &tri = buffers.tris[index];
+            return AABB(tri.v0, tri.v1, tri.v2).pad();
+        }
+        case Hittable::Type::meshTri: {
+            const auto &tri = buffers.meshTris[index];
+            const auto &vertices = buffers.meshVertices;
+            return AABB(vertices[tri.indices.x].position, vertices[tri.indices.y].position, vertices[tri.indices.z].position).pad();
+        }
+        case Hittable::Type::instance: {
+            const auto &instance = buffers.instances[index];
+            auto root = buffers.bvh[instance.rootIndex].aabb;
+            AABB aabb;
+            for (int i = 0; i < 8; i++) {
+                auto corner = glm::vec3(i & 1 ? root.max.x : root.min.x, i & 2 ? root.max.y : root.min.y, i & 4 ? root.max.z : root.min.z);
+                auto worldCorner = glm::vec3(instance.objectToWorld * glm::vec4(corner, 1.0f));
+                aabb = i == 0 ? AABB(worldCorner, worldCorner) : AABB(aabb, AABB(worldCorner, worldCorner));
+            }
+            return aabb;
+        }
+        default:
+            throw std::runtime_error("ERROR: Cannot bound a primitive of unknown type!");
+    }
+}
+
+/** @return The surface area of the intersection of two boxes, or 0 if they do not intersect. */
+static float intersection_area(const AABB &a, const AABB &b) {
+    auto min = glm::max(a.min, b.min), max = glm::min(a.max, b.max);
+    if (max.x < min.x || max.y < min.y || max.z < min.z) return 0.0f;
+    return AABB(min, max).area();
+}
+
+BVHReport::BVHReport(const Scene &scene) : sceneName(scene.name) {
+    const auto &bvh = scene.get_buffer<BVHNode::GPU_t>(Hittable::Type::bvhNode);
+    for (auto type : {Hittable::Type::sphere, Hittable::Type::quad, Hittable::Type::tri, Hittable::Type::meshTri, Hittable::Type::meshVertex,
+                      Hittable::Type::instance, Hittable::Type::bvhNode, Hittable::Type::wideBvhNode, Hittable::Type::quantizedWideBvhNode,
+                      Hittable::Type::bvhLinks}) {
+        auto size = scene.buffer_size(type) * gpu_size(type);
+        if (size > 0) bufferBytes[type_name(type)] = size;
+    }
+    if (bvh.empty()) return;
+
+    // --- Tree Walk ---
+    // Nodes are numbered in depth-first order, so a node's subtree is [order, subtreeEnd) regardless of how the buffer
+    // is laid out (e.g., breadth-first, or with bottom-level BVHs appended after the top-level nodes).
+    struct Visit {
+        uint32_t index, depth, order, subtreeEnd;
+        BVHNode::GPU_t node;
+    };
+    auto visits = std::vector<Visit>();
+    auto stack = std::vector<std::pair<uint32_t, uint32_t>>{{0, 0}};
+    auto parents = std::vector<uint32_t>(); // Visit of the parent of every visit.
+    auto parentStack = std::vector<uint32_t>{BAD_INDEX};
+    while (!stack.empty()) {
+        auto [index, depth] = stack.back();
+        auto parent = parentStack.back();
+        stack.pop_back();
+        parentStack.pop_back();
+
+        auto node = bvh[index];
+        auto order = (uint32_t) visits.size();
+        visits.push_back({index, depth, order, order + 1, node});
+        parents.push_back(parent);
+        if (node.numChildren == 0) {
+            // Push the right child first, so the left subtree is numbered first.
+            auto rightIndex = bvh[node.hitIndex].missIndex;
+            stack.emplace_back(rightIndex, depth + 1);
+            stack.emplace_back(node.hitIndex, depth + 1);
+            parentStack.push_back(order);
+            parentStack.push_back(order);
+        }
+    }
+    // Children are numbered after their parents, so walking backwards passes every subtree's end up to its parent.
+    for (auto i = (uint32_t) visits.size() - 1; i > 0; i--) {
+        visits[parents[i]].subtreeEnd = std::max(visits[parents[i]].subtreeEnd, visits[i].subtreeEnd);
+    }
+
+    // --- Tree Shape and Cost ---
+    auto rootArea = visits.front().node.aabb.area();
+    auto weight = [&](const AABB &aabb) { return rootArea > 0.0f ? aabb.area() / rootArea : 1.0f; };
+    auto node_cost = [](const BVHNode::GPU_t &node) {
+        return node.numChildren == 0 ? COST_TRAVERSAL : COST_INTERSECTION * (float) node.numChildren;
+    };
+
+    auto sumLeafDepths = 0.0, sumChildDistances = 0.0;
+    auto numSameLineChildren = 0u;
+    auto cache_line = [](uint32_t index) { return index * sizeof(BVHNode::GPU_t) / CACHE_LINE_SIZE; };
+    numNodes = (uint32_t) visits.size();
+    for (const auto &visit : visits) {
+        const auto &node = visit.node;
+        sahCost += weight(node.aabb) * node_cost(node);
+        if (node.numChildren != 0) {
+            numLeaves++;
+            numReferences += node.numChildren;
+            leafSizeHistogram[node.numChildren]++;
+            maxDepth = std::max(maxDepth, visit.depth);
+            sumLeafDepths += visit.depth;
+        } else {
+            const auto &left = bvh[node.hitIndex];
+            const auto &right = bvh[left.missIndex];
+            overlap += rootArea > 0.0f ? intersection_area(left.aabb, right.aabb) / rootArea : 0.0f;
+
+            for (auto childIndex : {node.hitIndex, left.missIndex}) {
+                sumChildDistances += std::abs((double) childIndex - (double) visit.index);
+                numSameLineChildren += cache_line(childIndex) == cache_line(visit.index);
+            }
+        }
+    }
+    averageLeafDepth = (float) (sumLeafDepths / numLeaves);
+    auto numChildren = 2 * (numNodes - numLeaves);
+    averageChildDistance = numChildren > 0 ? (float) (sumChildDistances / numChildren) : 0.0f;
+    sameLineChildRatio = numChildren > 0 ? (float) numSameLineChildren / (float) numChildren : 0.0f;
+
+    // --- EPO ---
+    // Every part of a primitive that lies within a node it is not referenced by costs that node's cost, relative to the
+    // total area of the primitives. Only nodes overlapping the primitive's bounds can contain a part of it, so every
+    // primitive only has to walk down the nodes it overlaps.
+    auto leaves = std::vector<uint32_t>();
+    for (uint32_t i = 0; i < numNodes; i++) {
+        if (visits[i].node.numChildren != 0) leaves.push_back(i);
+    }
+
+    auto orderOf = std::unordered_map<uint32_t, uint32_t>(); // Visit of every node in the buffer.
+    for (const auto &visit : visits) orderOf[visit.index] = visit.order;
+
+    auto buffers = PrimitiveBuffers {
+        scene.get_buffer<Sphere::GPU_t>(Hittable::Type::sphere),
+        scene.get_buffer<Quad::GPU_t>(Hittable::Type::quad),
+        scene.get_buffer<Tri::GPU_t>(Hittable::Type::tri),
+        scene.get_buffer<TriMesh::GPU_t>(Hittable::Type::meshTri),
+        scene.get_buffer<TriMesh::Vertex_t>(Hittable::Type::meshVertex),
+        scene.get_buffer<Instance::GPU_t>(Hittable::Type::instance),
+        bvh,
+    };
+    auto overlappedCost = 0.0, primitiveArea = 0.0;
+#pragma omp parallel for schedule(dynamic, 64) reduction(+:overlappedCost, primitiveArea) if(leaves.size() >= 64)
+    for (int i = 0; i < (int) leaves.size(); i++) {
+        const auto &leaf = visits[leaves[i]];
+        auto walk = std::vector<uint32_t>();
+        for (auto objectIndex = leaf.node.objectIndex; objectIndex < leaf.node.objectIndex + leaf.node.numChildren; objectIndex++) {
+            auto aabb = primitive_bounds(buffers, leaf.node.type, objectIndex);
+            primitiveArea += aabb.area();
+
+            walk.assign(1, 0);
+            while (!walk.empty()) {
+                const auto &visit = visits[walk.back()];
+                walk.pop_back();
+
+                auto area = intersection_area(visit.node.aabb, aabb);
+                if (area <= 0.0f) continue;
+                auto isAncestor = visit.order <= leaf.order && leaf.order < visit.subtreeEnd;
+                if (!isAncestor) overlappedCost += node_cost(visit.node) * area;
+
+                if (visit.node.numChildren == 0) {
+                    const auto &left = bvh[visit.node.hitIndex];
+                    walk.push_back(orderOf.at(visit.node.hitIndex));
+                    walk.push_back(orderOf.at(left.missIndex));
+                }
+            }
+        }
+    }
+    epo = primitiveArea > 0.0 ? (float) (overlappedCost / primitiveArea) : 0.0f;
+}
+
+void BVHReport::add_phase(const std::string &name, double milliseconds) {
+    phaseMilliseconds.emplace_back(name, milliseconds);
+}
+
+void BVHReport::print() const {
+    std::cout << "   --- BVH: " << numNodes << " nodes, " << numLeaves << " leaves, " << numReferences << " references (depth: "
+              << maxDepth << " max, " << std::fixed << std::setprecision(1) << averageLeafDepth << " average)...\n";
+
+    std::cout << "   --- Leaf sizes:";
+    for (const auto &[size, count] : leafSizeHistogram) std::cout << ' ' << size << 'x' << count;
+    std::cout << "...\n";
+
+    std::cout << std::setprecision(3) << "   --- SAH cost: " << sahCost << ", EPO: " << epo << ", sibling overlap: " << overlap << "...\n";
+
+    std::cout << "   --- Layout: " << layout << " (average child distance: " << averageChildDistance << " nodes, children in parent's cache line: "
+              << 100.0f * sameLineChildRatio << "%)...\n";
+
+    std::cout << "   --- GPU buffers:";
+    for (const auto &[type, bytes] : bufferBytes) std::cout << ' ' << type << ' ' << (double) bytes / 1024.0 << "KiB";
+    std::cout << "...\n";
+
+    std::cout << "   --- Phases:";
+    for (const auto &[phase, milliseconds] : phaseMilliseconds) std::cout << ' ' << phase << ' ' << milliseconds << "ms";
+    std::cout << "..." << std::defaultfloat << std::setprecision(6) << std::endl;
+}
+
+std::string BVHReport::to_json() const {
+    nlohmann::json report;
+    report["scene"] = sceneName;
+    report["buildMethod"] = buildMethod;
+    report["layout"] = layout;
+    report["objects"] = numObjects;
+
+    report["tree"]["nodes"] = numNodes;
+    report["tree"]["leaves"] = numLeaves;
+    report["tree"]["references"] = numReferences;
+    report["tree"]["maxDepth"] = maxDepth;
+    report["tree"]["averageLeafDepth"] = averageLeafDepth;
+    for (const auto &[size, count] : leafSizeHistogram) report["tree"]["leafSizeHistogram"][std::to_string(size)] = count;
+
+    report["wideTree"]["width"] = wideBvhWidth;
+    report["wideTree"]["nodes"] = numWideNodes;
+
+    report["quality"]["sahCost"] = sahCost;
+    report["quality"]["epo"] = epo;
+    report["quality"]["overlap"] = overlap;
+    report["quality"]["averageChildDistance"] = averageChildDistance;
+    report["quality"]["sameLineChildRatio"] = sameLineChildRatio;
+
+    report["bufferBytes"] = bufferBytes;
+
+    // Phases are kept in the order they ran, rather than sorted like the keys of an object.
+    report["phases"] = nlohmann::json::array();
+    for (const auto &[phase, milliseconds] : phaseMilliseconds) report["phases"].push_back({{"name", phase}, {"milliseconds", milliseconds}});
+
+    return report.dump(4);
+}
\ No newline at end of file
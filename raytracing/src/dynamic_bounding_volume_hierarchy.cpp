@@ -0,0 +1,342 @@
+#include "../include/dynamic_bounding_volume_hierarchy.h"
+#include "../include/flat_bounding_volume_hierarchy.h"
+#include "../include/primitive_arrays.h"
+#include "../include/scene_buffer_types.h"
+#include "../include/surface_area_heuristic.h"
+
+#include <algorithm>
+#include <queue>
+
+constexpr uint32_t MIN_CAPACITY = 64; // Spare entries every buffer starts out with, and grows by at least.
+
+static uint32_t capacity(size_t size) {
+    return (uint32_t) (size + size / 2 + MIN_CAPACITY);
+}
+
+DynamicBVH::DynamicBVH(Scene &scene, const std::vector<std::shared_ptr<Hittable>> &objects, BVHNode::BuildOptions options) {
+    for (const auto &object : objects) {
+        if (dynamic_cast<const PrimitiveArrays *>(object.get()) != nullptr)
+            throw std::runtime_error("ERROR: Dynamic BVHs cannot hold primitive arrays!");
+        if (object->type() == Hittable::Type::instance)
+            throw std::runtime_error("ERROR: Dynamic BVHs cannot hold instances!");
+        if (object->type() == Hittable::Type::meshTri)
+            throw std::runtime_error("ERROR: Dynamic BVHs cannot hold meshes!");
+    }
+
+    // With a single object per leaf, the tree has exactly `2n - 1` nodes and every node maps to a slot of its own.
+    options.maxLeafSize = 1;
+    if (options.method == BVHNode::BuildMethod::spatial) options.method = BVHNode::BuildMethod::binned;
+    auto flatBvh = FlatBVH(objects, options);
+
+    this->objects.resize(objects.size());
+    nodes.resize(flatBvh.nodes.size());
+    for (uint32_t i = 0; i < (uint32_t) flatBvh.nodes.size(); i++) {
+        const auto &flatNode = flatBvh.nodes[i];
+        auto &node = nodes[i];
+        node.aabb = flatNode.aabb;
+        if (flatNode.numChildren != 0) {
+            auto objectIndex = flatBvh.refs[flatNode.objectIndex].objectIndex;
+            node.objectIndex = objectIndex;
+            this->objects[objectIndex] = {objects[objectIndex], i, objects[objectIndex]->type()};
+            objectIndices[objects[objectIndex].get()] = objectIndex;
+        } else {
+            node.left = flatNode.hitIndex;
+            node.right = flatBvh.nodes[flatNode.hitIndex].missIndex;
+            nodes[node.left].parent = i;
+            nodes[node.right].parent = i;
+        }
+    }
+
+    auto numNodes = (uint32_t) nodes.size();
+    nodes.resize(capacity(numNodes));
+    for (auto i = (uint32_t) nodes.size(); i > numNodes; i--) freeNodes.push_back(i - 1);
+
+    // Primitives are written in leaf order, like `FlatBVH` does. Nothing has been uploaded yet, so the edit is dropped.
+    auto edit = SceneEdit();
+    for (const auto &node : nodes) {
+        if (node.is_leaf() && node.objectIndex != BAD_INDEX) write_primitives(scene, this->objects[node.objectIndex], edit);
+    }
+    for (const auto &[type, primitiveBuffer] : primitiveBuffers) {
+        visit_buffer_type(type, [&](auto prototype) {
+            auto &buffer = scene.get_buffer<decltype(prototype)>(type);
+            buffer.resize(std::max((uint32_t) buffer.size(), capacity(primitiveBuffer.end)));
+        });
+    }
+    write_nodes(scene, edit);
+}
+
+void DynamicBVH::insert(Scene &scene, const std::shared_ptr<Hittable> &object, SceneEdit &edit) {
+    if (dynamic_cast<const PrimitiveArrays *>(object.get()) != nullptr)
+        throw std::runtime_error("ERROR: Dynamic BVHs cannot hold primitive arrays!");
+    if (object->type() == Hittable::Type::instance)
+        throw std::runtime_error("ERROR: Dynamic BVHs cannot hold instances!");
+    if (object->type() == Hittable::Type::meshTri)
+        throw std::runtime_error("ERROR: Dynamic BVHs cannot hold meshes!");
+    if (objectIndices.contains(object.get()))
+        throw std::runtime_error("ERROR: Object is already in the BVH!");
+
+    auto objectIndex = (uint32_t) objects.size();
+    objects.push_back({object, BAD_INDEX, object->type()});
+    objectIndices[object.get()] = objectIndex;
+    write_primitives(scene, objects.back(), edit);
+
+    auto aabb = object->bounding_box();
+    auto leafIndex = allocate_node(edit);
+    nodes[leafIndex] = {aabb, BAD_INDEX, BAD_INDEX, BAD_INDEX, objectIndex};
+    objects[objectIndex].leafIndex = leafIndex;
+
+    auto siblingIndex = find_best_sibling(aabb);
+    auto parentIndex = allocate_node(edit);
+    if (siblingIndex == 0) {
+        // The root keeps the first slot, so the old root moves out of the way of the new one.
+        move_node(0, parentIndex);
+        std::swap(siblingIndex, parentIndex);
+    } else {
+        replace_child(nodes[siblingIndex].parent, siblingIndex, parentIndex);
+    }
+
+    nodes[parentIndex] = {AABB(nodes[siblingIndex].aabb, aabb), nodes[siblingIndex].parent, siblingIndex, leafIndex, BAD_INDEX};
+    nodes[siblingIndex].parent = parentIndex;
+    nodes[leafIndex].parent = parentIndex;
+    refit_ancestors(parentIndex);
+    write_nodes(scene, edit);
+}
+
+void DynamicBVH::remove(Scene &scene, const std::shared_ptr<Hittable> &object, SceneEdit &edit) {
+    auto it = objectIndices.find(object.get());
+    if (it == objectIndices.end())
+        throw std::runtime_error("ERROR: Object is not in the BVH!");
+    if (objects.size() == 1)
+        throw std::runtime_error("ERROR: Cannot remove the last object of a BVH!");
+
+    auto objectIndex = it->second;
+    auto leafIndex = objects[objectIndex].leafIndex;
+    auto parentIndex = nodes[leafIndex].parent;
+    auto siblingIndex = nodes[parentIndex].left == leafIndex ? nodes[parentIndex].right : nodes[parentIndex].left;
+    auto grandparentIndex = nodes[parentIndex].parent;
+
+    free_node(leafIndex);
+    if (grandparentIndex == BAD_INDEX) {
+        // The sibling becomes the root, which keeps the first slot.
+        nodes[siblingIndex].parent = BAD_INDEX;
+        move_node(siblingIndex, 0);
+        free_node(siblingIndex);
+    } else {
+        replace_child(grandparentIndex, parentIndex, siblingIndex);
+        nodes[siblingIndex].parent = grandparentIndex;
+        free_node(parentIndex);
+        refit_ancestors(grandparentIndex);
+    }
+
+    // No leaf references the object's primitives anymore, so they are left in place until the range is reused.
+    const auto &removed = objects[objectIndex];
+    primitiveBuffers[removed.type].freeRanges.emplace_back(removed.primitiveStart, removed.numPrimitives);
+
+    objectIndices.erase(it);
+    if (objectIndex != objects.size() - 1) {
+        objects[objectIndex] = std::move(objects.back());
+        nodes[objects[objectIndex].leafIndex].objectIndex = objectIndex;
+        objectIndices[objects[objectIndex].hittable.get()] = objectIndex;
+    }
+    objects.pop_back();
+    write_nodes(scene, edit);
+}
+
+float DynamicBVH::sah_cost() const {
+    auto cost = 0.0f;
+    for (const auto &node : nodes) {
+        if (node.is_leaf() && node.objectIndex == BAD_INDEX) continue;
+        cost += node.aabb.area() * (node.is_leaf() ? COST_INTERSECTION : COST_TRAVERSAL);
+    }
+    auto rootArea = nodes.front().aabb.area();
+    return rootArea > 0.0f ? cost / rootArea : cost;
+}
+
+uint32_t DynamicBVH::allocate_node(SceneEdit &edit) {
+    if (freeNodes.empty()) {
+        auto numNodes = (uint32_t) nodes.size();
+        nodes.resize(std::max(2 * numNodes, numNodes + MIN_CAPACITY));
+        for (auto i = (uint32_t) nodes.size(); i > numNodes; i--) freeNodes.push_back(i - 1);
+        edit.hasResized = true;
+    }
+    auto nodeIndex = freeNodes.back();
+    freeNodes.pop_back();
+    return nodeIndex;
+}
+
+void DynamicBVH::free_node(uint32_t nodeIndex) {
+    nodes[nodeIndex] = Node();
+    freeNodes.push_back(nodeIndex);
+}
+
+void DynamicBVH::move_node(uint32_t from, uint32_t to) {
+    nodes[to] = nodes[from];
+    const auto &node = nodes[to];
+    if (node.is_leaf()) {
+        objects[node.objectIndex].leafIndex = to;
+    } else {
+        nodes[node.left].parent = to;
+        nodes[node.right].parent = to;
+    }
+    if (node.parent != BAD_INDEX) replace_child(node.parent, from, to);
+}
+
+void DynamicBVH::replace_child(uint32_t parentIndex, uint32_t oldChild, uint32_t newChild) {
+    auto &parent = nodes[parentIndex];
+    (parent.left == oldChild ? parent.left : parent.right) = newChild;
+}
+
+uint32_t DynamicBVH::find_best_sibling(const AABB &aabb) const {
+    // Pairing the object with a node costs the area of their union, plus the area every ancestor of the node grows by.
+    // A subtree can never cost less than the object's own area plus what its ancestors grow by, so it is skipped once
+    // that bound is no better than the best node found so far.
+    struct Candidate {
+        uint32_t nodeIndex;
+        float inheritedCost;
+
+        bool operator>(const Candidate &other) const {
+            return inheritedCost > other.inheritedCost;
+        }
+    };
+    auto candidates = std::priority_queue<Candidate, std::vector<Candidate>, std::greater<>>();
+    candidates.push({0, 0.0f});
+
+    auto area = aabb.area();
+    auto bestIndex = 0u;
+    auto bestCost = AABB(nodes[0].aabb, aabb).area();
+    while (!candidates.empty()) {
+        auto [nodeIndex, inheritedCost] = candidates.top();
+        candidates.pop();
+
+        const auto &node = nodes[nodeIndex];
+        auto unionArea = AABB(node.aabb, aabb).area();
+        if (unionArea + inheritedCost < bestCost) {
+            bestIndex = nodeIndex;
+            bestCost = unionArea + inheritedCost;
+        }
+        if (node.is_leaf()) continue;
+
+        auto childInheritedCost = inheritedCost + unionArea - node.aabb.area();
+        if (area + childInheritedCost >= bestCost) continue;
+        candidates.push({node.left, childInheritedCost});
+        candidates.push({node.right, childInheritedCost});
+    }
+    return bestIndex;
+}
+
+void DynamicBVH::refit_ancestors(uint32_t nodeIndex) {
+    while (nodeIndex != BAD_INDEX) {
+        auto &node = nodes[nodeIndex];
+        node.aabb = AABB(nodes[node.left].aabb, nodes[node.right].aabb);
+        rotate(nodeIndex);
+        nodeIndex = nodes[nodeIndex].parent;
+    }
+}
+
+// Source: Dynamic Bounding Volume Hierarchies - Erin Catto
+// https://box2d.org/files/ErinCatto_DynamicBVH_GDC2019.pdf
+void DynamicBVH::rotate(uint32_t nodeIndex) {
+    // A rotation swaps a child with one of its sibling's children. The node bounds the same objects either way, so only
+    // the sibling's area changes.
+    auto bestGain = 0.0f;
+    auto bestChild = BAD_INDEX, bestGrandchild = BAD_INDEX;
+    auto consider = [&](uint32_t childIndex, uint32_t siblingIndex) {
+        const auto &sibling = nodes[siblingIndex];
+        if (sibling.is_leaf()) return;
+        for (auto [grandchildIndex, otherIndex] : {std::pair(sibling.left, sibling.right), std::pair(sibling.right, sibling.left)}) {
+            auto gain = sibling.aabb.area() - AABB(nodes[childIndex].aabb, nodes[otherIndex].aabb).area();
+            if (gain > bestGain) {
+                bestGain = gain;
+                bestChild = childIndex;
+                bestGrandchild = grandchildIndex;
+            }
+        }
+    };
+    consider(nodes[nodeIndex].left, nodes[nodeIndex].right);
+    consider(nodes[nodeIndex].right, nodes[nodeIndex].left);
+    if (bestChild == BAD_INDEX) return;
+
+    auto siblingIndex = nodes[bestGrandchild].parent;
+    replace_child(nodeIndex, bestChild, bestGrandchild);
+    replace_child(siblingIndex, bestGrandchild, bestChild);
+    nodes[bestGrandchild].parent = nodeIndex;
+    nodes[bestChild].parent = siblingIndex;
+
+    auto &sibling = nodes[siblingIndex];
+    sibling.aabb = AABB(nodes[sibling.left].aabb, nodes[sibling.right].aabb);
+}
+
+void DynamicBVH::write_primitives(Scene &scene, Object &object, SceneEdit &edit) {
+    visit_buffer_type(object.type, [&](auto prototype) {
+        using T = decltype(prototype);
+
+        // Objects serialize themselves by appending to the buffer, so their primitives are moved into place afterward.
+        auto &buffer = scene.get_buffer<T>(object.type);
+        auto oldSize = buffer.size();
+        auto numMaterials = scene.materials.size();
+        object.hittable->gpu_serialize(scene);
+        if (scene.materials.size() != numMaterials) edit.hasResized = true;
+
+        auto primitives = std::vector<T>(buffer.begin() + (long) oldSize, buffer.end());
+        buffer.resize(oldSize);
+        auto numPrimitives = (uint32_t) primitives.size();
+        if (numPrimitives == 0) throw std::runtime_error("ERROR: Cannot insert an object without primitives!");
+
+        // First fit among the ranges removed objects left behind, or else past every other primitive.
+        auto &primitiveBuffer = primitiveBuffers[object.type];
+        auto &freeRanges = primitiveBuffer.freeRanges;
+        auto range = std::find_if(freeRanges.begin(), freeRanges.end(), [&](const auto &range) { return range.second >= numPrimitives; });
+        if (range != freeRanges.end()) {
+            object.primitiveStart = range->first;
+            range->first += numPrimitives;
+            range->second -= numPrimitives;
+            if (range->second == 0) freeRanges.erase(range);
+        } else {
+            object.primitiveStart = primitiveBuffer.end;
+            primitiveBuffer.end += numPrimitives;
+            if (primitiveBuffer.end > buffer.size()) {
+                buffer.resize(std::max(2 * buffer.size(), (size_t) primitiveBuffer.end + MIN_CAPACITY));
+                edit.hasResized = true;
+            }
+        }
+
+        object.numPrimitives = numPrimitives;
+        for (uint32_t i = 0; i < numPrimitives; i++) {
+            buffer[object.primitiveStart + i] = primitives[i];
+            edit.dirtyIndices[object.type].push_back(object.primitiveStart + i);
+        }
+    });
+}
+
+void DynamicBVH::write_nodes(Scene &scene, SceneEdit &edit) const {
+    auto freeNode = BVHNode::GPU_t();
+    freeNode.hitIndex = BAD_INDEX;
+    freeNode.missIndex = BAD_INDEX;
+    auto gpuNodes = std::vector<BVHNode::GPU_t>(nodes.size(), freeNode);
+
+    // Any edit may change where rays continue after a subtree, so every link is threaded again. Only the nodes that
+    // end up different are written, though.
+    auto stack = std::vector<std::pair<uint32_t, uint32_t>>{{0, BAD_INDEX}}; // Node and its miss link.
+    while (!stack.empty()) {
+        auto [nodeIndex, missIndex] = stack.back();
+        stack.pop_back();
+
+        const auto &node = nodes[nodeIndex];
+        auto &gpuNode = gpuNodes[nodeIndex];
+        gpuNode = BVHNode::GPU_t();
+        gpuNode.aabb = node.aabb;
+        gpuNode.missIndex = missIndex;
+        if (node.is_leaf()) {
+            const auto &object = objects[node.objectIndex];
+            gpuNode.objectIndex = object.primitiveStart;
+            gpuNode.type = object.type;
+            gpuNode.numChildren = object.numPrimitives;
+            gpuNode.hitIndex = missIndex;
+        } else {
+            gpuNode.hitIndex = node.left;
+            stack.emplace_back(node.right, missIndex);
+            stack.emplace_back(node.left, node.right);
+        }
+    }
+    scene.update_buffer(Hittable::Type::bvhNode, gpuNodes, edit);
+}
\ No newline at end of file
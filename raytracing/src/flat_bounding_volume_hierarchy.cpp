@@ -0,0 +1,1053 @@
+#include "../include/flat_bounding_volume_hierarchy.h"
+#include "../include/primitive_arrays.h"
+#include "../include/tri_mesh.h"
+#include "../include/primitives.h"
+#include "../include/scene_buffer_types.h"
+#include "../include/surface_area_heuristic.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+static const AABB &ref_bounds(const FlatBVH::PrimitiveRef &ref) {
+    return ref.aabb;
+}
+
+/**
+ * @return `x` (10 bits) with two zero bits inserted between each bit.
+ */
+static uint64_t expand_bits_10(uint64_t x) {
+    x &= 0x3FF;
+    x = (x * 0x00010001u) & 0xFF0000FFu;
+    x = (x * 0x00000101u) & 0x0F00F00Fu;
+    x = (x * 0x00000011u) & 0xC30C30C3u;
+    x = (x * 0x00000005u) & 0x49249249u;
+    return x;
+}
+
+/**
+ * @return `x` (21 bits) with two zero bits inserted between each bit.
+ */
+static uint64_t expand_bits_21(uint64_t x) {
+    x &= 0x1FFFFF;
+    x = (x | x << 32) & 0x1F00000000FFFF;
+    x = (x | x << 16) & 0x1F0000FF0000FF;
+    x = (x | x << 8)  & 0x100F00F00F00F00F;
+    x = (x | x << 4)  & 0x10C30C30C30C30C3;
+    x = (x | x << 2)  & 0x1249249249249249;
+    return x;
+}
+
+FlatBVH::FlatBVH(const std::vector<std::shared_ptr<Hittable>> &objects, const BVHNode::BuildOptions &options) {
+    // Primitive arrays and meshes get a reference per primitive, as if every primitive were an object of its own.
+    auto numObjects = (int) objects.size();
+    auto arrays = std::vector<const PrimitiveArrays *>(numObjects);
+    auto meshes = std::vector<const TriMesh *>(numObjects);
+    auto refOffsets = std::vector<uint32_t>(numObjects + 1);
+    for (int i = 0; i < numObjects; i++) {
+        arrays[i] = dynamic_cast<const PrimitiveArrays *>(objects[i].get());
+        meshes[i] = dynamic_cast<const TriMesh *>(objects[i].get());
+        auto numPrimitives = arrays[i] != nullptr ? arrays[i]->size() : meshes[i] != nullptr ? meshes[i]->size() : 1;
+        refOffsets[i + 1] = refOffsets[i] + numPrimitives;
+    }
+    auto numRefs = (int) refOffsets.back();
+    if (numRefs == 0) throw std::runtime_error("ERROR: Cannot build a BVH over zero objects!");
+
+    // Query every object's bounds exactly once. The build only ever touches the references from here on.
+    refs.resize(numRefs);
+#pragma omp parallel for if(options.shouldBuildParallel && numObjects >= PARALLEL_TASK_SPAN)
+    for (int i = 0; i < numObjects; i++) {
+        if (arrays[i] != nullptr || meshes[i] != nullptr) continue;
+        auto aabb = objects[i]->bounding_box();
+        refs[refOffsets[i]] = PrimitiveRef(aabb, centroid(aabb), (uint32_t) i, objects[i]->type());
+    }
+    for (int i = 0; i < numObjects; i++) {
+        if (arrays[i] == nullptr) continue;
+        auto offset = refOffsets[i];
+        for (auto type : {Hittable::Type::sphere, Hittable::Type::quad, Hittable::Type::tri}) {
+            auto numPrimitives = (int) arrays[i]->size(type);
+#pragma omp parallel for if(options.shouldBuildParallel && numPrimitives >= PARALLEL_TASK_SPAN)
+            for (int j = 0; j < numPrimitives; j++) {
+                auto aabb = arrays[i]->bounding_box(type, j);
+                refs[offset + j] = PrimitiveRef(aabb, centroid(aabb), (uint32_t) i, type, (uint32_t) j);
+            }
+            offset += numPrimitives;
+        }
+    }
+    for (int i = 0; i < numObjects; i++) {
+        if (meshes[i] == nullptr) continue;
+        auto numTris = (int) meshes[i]->size();
+#pragma omp parallel for if(options.shouldBuildParallel && numTris >= PARALLEL_TASK_SPAN)
+        for (int j = 0; j < numTris; j++) {
+            auto aabb = meshes[i]->bounding_box(j);
+            refs[refOffsets[i] + j] = PrimitiveRef(aabb, centroid(aabb), (uint32_t) i, Hittable::Type::meshTri, (uint32_t) j);
+        }
+    }
+
+    if (options.method == BVHNode::BuildMethod::spatial) {
+        build_spatial(objects, options);
+        return;
+    }
+
+    // A binary tree with one reference per leaf always has exactly `2n - 1` nodes. Trees with larger leaves have fewer.
+    nodes.resize(2 * refs.size() - 1);
+
+    auto build_tree = [&]() {
+        if (options.method == BVHNode::BuildMethod::morton) sort_morton(options);
+        build(0, 0, numRefs, 0, options);
+        compact();
+    };
+
+#ifdef _OPENMP
+    if (options.shouldBuildParallel && !omp_in_parallel()) {
+#pragma omp parallel
+#pragma omp single
+        build_tree();
+        return;
+    }
+#endif
+    build_tree();
+}
+
+void FlatBVH::sort_morton(const BVHNode::BuildOptions &options) {
+    auto numRefs = (int) refs.size();
+    auto isParallel = options.shouldBuildParallel && numRefs >= PARALLEL_TASK_SPAN;
+
+    centroidMin = glm::vec3(std::numeric_limits<float>::max());
+    auto centroidMax = glm::vec3(std::numeric_limits<float>::lowest());
+    for (const auto &ref : refs) {
+        centroidMin = glm::min(centroidMin, ref.centroid);
+        centroidMax = glm::max(centroidMax, ref.centroid);
+    }
+
+    // Every axis is quantized over its own extent. Flat axes (e.g., a single quad) map everything to cell zero.
+    isMortonCodeWide = options.shouldUseWideMortonCodes;
+    auto numCells = (float) (isMortonCodeWide ? 1 << 21 : 1 << 10);
+    auto extent = centroidMax - centroidMin;
+    for (int axis = 0; axis < 3; axis++) centroidScale[axis] = extent[axis] > 0.0f ? numCells / extent[axis] : 0.0f;
+
+    auto codes = std::vector<uint64_t>(numRefs);
+    auto order = std::vector<uint32_t>(numRefs);
+    for_each_chunk(0, numRefs, isParallel, [&](int, int chunkStart, int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; i++) {
+            codes[i] = morton_code(refs[i]);
+            order[i] = i;
+        }
+    });
+
+    radix_sort(codes, order, isMortonCodeWide ? 63 : 30, isParallel);
+
+    auto sortedRefs = std::vector<PrimitiveRef>(numRefs);
+    for_each_chunk(0, numRefs, isParallel, [&](int, int chunkStart, int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; i++) sortedRefs[i] = refs[order[i]];
+    });
+    refs = std::move(sortedRefs);
+}
+
+uint64_t FlatBVH::morton_code(const PrimitiveRef &ref) const {
+    auto maxCell = isMortonCodeWide ? (1 << 21) - 1 : (1 << 10) - 1;
+    auto cell = glm::clamp(glm::ivec3((ref.centroid - centroidMin) * centroidScale), 0, maxCell);
+
+    if (isMortonCodeWide)
+        return (expand_bits_21(cell.x) << 2) | (expand_bits_21(cell.y) << 1) | expand_bits_21(cell.z);
+    return (expand_bits_10(cell.x) << 2) | (expand_bits_10(cell.y) << 1) | expand_bits_10(cell.z);
+}
+
+/**
+ * @return Whether every reference in [start, end) has the same type, so they can share a leaf.
+ */
+static bool has_single_type(const std::vector<FlatBVH::PrimitiveRef> &refs, int start, int end) {
+    return std::all_of(refs.begin() + start + 1, refs.begin() + end, [&](const auto &ref) {
+        return ref.type == refs[start].type;
+    });
+}
+
+/**
+ * Finds the split of a range of references sorted by Morton code: the first reference whose code differs from the
+ * first one in the highest bit that differs across the range. Splitting there halves the range's Morton cell.
+ */
+template<typename F>
+static SplitInfo get_morton_split(const std::vector<FlatBVH::PrimitiveRef> &refs, int start, int end, F &&morton_code) {
+    auto firstCode = morton_code(refs[start]);
+    auto lastCode = morton_code(refs[end - 1]);
+
+    // Every reference lies in the same cell, so there is nothing to split on--fall back to an object median split.
+    if (firstCode == lastCode) return {0, start + (end - start) / 2};
+
+    auto highestBit = 63 - std::countl_zero(firstCode ^ lastCode);
+    auto first = std::partition_point(refs.begin() + start, refs.begin() + end, [&](const auto &ref) {
+        return (morton_code(ref) >> highestBit) == (firstCode >> highestBit);
+    });
+    return {2 - highestBit % 3, (int) (first - refs.begin())}; // Codes interleave bits as ...xyzxyz
+}
+
+void FlatBVH::build(uint32_t nodeIndex, int start, int end, int depth, const BVHNode::BuildOptions &options) { // NOLINT
+    auto span = end - start;
+    auto &node = nodes[nodeIndex];
+
+    // Nodes are laid out depth-first, so the subtree of this node occupies (at most) the next `2 * span - 1` slots and
+    // a ray that misses it continues right after them. Unused slots are skipped when compacting.
+    auto nextIndex = nodeIndex + 2 * span - 1;
+    node.missIndex = nextIndex == nodes.size() ? BAD_INDEX : nextIndex;
+
+    auto make_leaf = [&]() {
+        node.aabb = refs[start].aabb;
+        for (int i = start + 1; i < end; i++) node.aabb = AABB(node.aabb, refs[i].aabb);
+        node.objectIndex = start;
+        node.numChildren = span;
+        node.hitIndex = node.missIndex;
+    };
+
+    if (span == 1) return make_leaf();
+
+    auto isParallel = options.shouldBuildParallel && span >= PARALLEL_TASK_SPAN;
+    SplitInfo split;
+    if (options.method == BVHNode::BuildMethod::morton && depth >= options.numRefinedLevels) {
+        split = get_morton_split(refs, start, end, [this](const auto &ref) { return morton_code(ref); });
+    } else if (options.method == BVHNode::BuildMethod::sweep) {
+        split = get_best_split(refs, start, end, ref_bounds);
+    } else {
+        // Refined top levels of a Morton build are binned as well. The partition is stable, so both sides stay sorted
+        // by Morton code.
+        split = get_binned_split(refs, start, end, options.numBins, isParallel, ref_bounds);
+    }
+
+    // Small ranges of one type become a leaf, unless splitting them is expected to be cheaper.
+    if (span <= options.maxLeafSize && has_single_type(refs, start, end)) {
+        if (split.cost == std::numeric_limits<float>::max()) split.cost = get_split_cost(refs, start, split.mid, end, ref_bounds);
+        if (sah_leaf_cost(span) <= split.cost) return make_leaf();
+    }
+
+    auto leftIndex = nodeIndex + 1;
+    auto rightIndex = leftIndex + 2 * (split.mid - start) - 1;
+
+    // Children write to disjoint ranges of both `nodes` and `refs`, so they can be built concurrently.
+#pragma omp task default(shared) if(isParallel)
+    build(leftIndex, start, split.mid, depth + 1, options);
+    build(rightIndex, split.mid, end, depth + 1, options);
+#pragma omp taskwait
+
+    node.aabb = AABB(nodes[leftIndex].aabb, nodes[rightIndex].aabb);
+    node.objectIndex = BAD_INDEX;
+    node.numChildren = 0;
+    node.hitIndex = leftIndex;
+}
+
+void FlatBVH::compact() {
+    // Every node written by `build()` is either a leaf or links to its left child, which is never the root.
+    auto is_used = [](const BVHNode::GPU_t &node) { return node.numChildren != 0 || node.hitIndex != 0; };
+
+    // Maps every slot to the index of the first used node at or after it, so links to unused slots (e.g., the miss link
+    // of a subtree that did not use all of its slots) move forward to the next node in depth-first order.
+    auto newIndices = std::vector<uint32_t>(nodes.size() + 1);
+    uint32_t numUsed = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        newIndices[i] = numUsed;
+        numUsed += is_used(nodes[i]);
+    }
+    newIndices.back() = numUsed;
+    if (numUsed == nodes.size()) return;
+
+    auto remap = [&](uint32_t index) {
+        if (index == BAD_INDEX || newIndices[index] == numUsed) return BAD_INDEX;
+        return newIndices[index];
+    };
+
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (!is_used(nodes[i])) continue;
+
+        auto node = nodes[i];
+        node.hitIndex = remap(node.hitIndex);
+        node.missIndex = remap(node.missIndex);
+        nodes[newIndices[i]] = node;
+    }
+    nodes.resize(numUsed);
+    nodes.shrink_to_fit();
+}
+
+// --- Spatial Splits ---
+// Source: Spatial Splits in Bounding Volume Hierarchies - Stich, Friedrich, and Dietrich
+// https://www.nvidia.com/docs/IO/77714/sbvh.pdf
+
+constexpr float SPATIAL_SPLIT_ALPHA = 1e-5f; // Spatial splits are only tried if children overlap by more than this.
+
+struct SpatialNode {
+    AABB aabb;
+    int left {-1}, right {-1};
+    uint32_t firstRef {}, numRefs {};
+};
+
+struct SpatialSplit {
+    int axis {-1};
+    float position {};
+    float cost {std::numeric_limits<float>::max()};
+    AABB leftBounds, rightBounds;
+    int numLeft {}, numRight {};
+};
+
+struct SpatialBuild {
+    const BVHNode::BuildOptions &options;
+    // Triangles are clipped exactly. Other objects are only split by their bounds.
+    std::vector<const Tri *> tris {};
+    std::vector<const PrimitiveArrays *> arrays {};
+    std::vector<const TriMesh *> meshes {};
+    float rootArea {};
+    size_t numRefs {}, maxNumRefs {};
+    std::vector<SpatialNode> tree {}; // In depth-first order.
+    std::vector<FlatBVH::PrimitiveRef> leafRefs {};
+};
+
+static AABB empty_aabb() {
+    auto aabb = AABB();
+    aabb.min = glm::vec3(std::numeric_limits<float>::max());
+    aabb.max = glm::vec3(std::numeric_limits<float>::lowest());
+    return aabb;
+}
+
+static bool is_empty(const AABB &aabb) {
+    return aabb.min.x > aabb.max.x || aabb.min.y > aabb.max.y || aabb.min.z > aabb.max.z;
+}
+
+static float area(const AABB &aabb) {
+    return is_empty(aabb) ? 0.0f : aabb.area();
+}
+
+static AABB intersect(const AABB &a, const AABB &b) {
+    auto aabb = AABB();
+    aabb.min = glm::max(a.min, b.min);
+    aabb.max = glm::min(a.max, b.max);
+    return aabb;
+}
+
+/** @return Whether the reference is to a triangle, in which case its vertices are written to `vertices`. */
+static bool tri_vertices(const SpatialBuild &build, const FlatBVH::PrimitiveRef &ref, glm::vec3 (&vertices)[3]) {
+    if (const auto *mesh = build.meshes[ref.objectIndex]) {
+        mesh->tri_positions(ref.primitiveIndex, vertices);
+        return true;
+    }
+    if (const auto *arrays = build.arrays[ref.objectIndex]) {
+        if (ref.type != Hittable::Type::tri) return false;
+        vertices[0] = arrays->tris.v0s[ref.primitiveIndex];
+        vertices[1] = arrays->tris.v1s[ref.primitiveIndex];
+        vertices[2] = arrays->tris.v2s[ref.primitiveIndex];
+        return true;
+    }
+    if (const auto *tri = build.tris[ref.objectIndex]) {
+        vertices[0] = tri->tri.v0;
+        vertices[1] = tri->tri.v1;
+        vertices[2] = tri->tri.v2;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Splits `ref` at `position` along `axis`, clipping triangles so each side only bounds the part of the triangle on it.
+ * A side the triangle does not reach is empty.
+ */
+static std::pair<FlatBVH::PrimitiveRef, FlatBVH::PrimitiveRef> split_reference(const SpatialBuild &build, const FlatBVH::PrimitiveRef &ref, int axis, float position) {
+    auto leftBounds = ref.aabb, rightBounds = ref.aabb;
+    leftBounds.max[axis] = rightBounds.min[axis] = position;
+
+    glm::vec3 vertices[3];
+    if (tri_vertices(build, ref, vertices)) {
+        auto leftClip = empty_aabb(), rightClip = empty_aabb();
+        for (int i = 0; i < 3; i++) {
+            const auto &a = vertices[i], &b = vertices[(i + 1) % 3];
+            if (a[axis] <= position) leftClip = AABB(leftClip, AABB(a, a));
+            if (a[axis] >= position) rightClip = AABB(rightClip, AABB(a, a));
+
+            // Edges crossing the plane add their intersection with it to both sides.
+            if ((a[axis] < position && position < b[axis]) || (b[axis] < position && position < a[axis])) {
+                auto intersection = glm::mix(a, b, (position - a[axis]) / (b[axis] - a[axis]));
+                intersection[axis] = position;
+                leftClip = AABB(leftClip, AABB(intersection, intersection));
+                rightClip = AABB(rightClip, AABB(intersection, intersection));
+            }
+        }
+        leftBounds = intersect(leftBounds, leftClip);
+        rightBounds = intersect(rightBounds, rightClip);
+    }
+
+    // Clipped triangles may be flat--pad them like `Tri::bounding_box()` does, so they can still be hit.
+    auto left = ref, right = ref;
+    left.aabb = is_empty(leftBounds) ? leftBounds : leftBounds.pad();
+    right.aabb = is_empty(rightBounds) ? rightBounds : rightBounds.pad();
+    left.centroid = centroid(left.aabb);
+    right.centroid = centroid(right.aabb);
+    return {left, right};
+}
+
+/**
+ * Finds the best spatial split by bucketing the parts of every reference into `numBins` equally-sized bins along each
+ * axis of `bounds`, tracking how many references enter and exit each bin.
+ */
+static SpatialSplit get_spatial_split(const SpatialBuild &build, const std::vector<FlatBVH::PrimitiveRef> &refs, const AABB &bounds) {
+    struct Bin {
+        AABB aabb {empty_aabb()};
+        int numEntries {}, numExits {};
+    };
+
+    auto numBins = build.options.numBins;
+    auto parentArea = bounds.area();
+    auto bins = std::vector<Bin>(numBins);
+    auto rightBounds = std::vector<AABB>(numBins);
+    SpatialSplit bestSplit;
+
+    for (int axis = 0; axis < 3; axis++) {
+        auto binWidth = (bounds.max[axis] - bounds.min[axis]) / (float) numBins;
+        if (binWidth <= 0.0f) continue;
+
+        auto bin_index = [&](float position) {
+            return std::clamp((int) ((position - bounds.min[axis]) / binWidth), 0, numBins - 1);
+        };
+
+        std::fill(bins.begin(), bins.end(), Bin());
+        for (const auto &ref : refs) {
+            auto firstBin = bin_index(ref.aabb.min[axis]);
+            auto lastBin = bin_index(ref.aabb.max[axis]);
+
+            // Chop the reference at every bin boundary it crosses.
+            auto rest = ref;
+            for (int i = firstBin; i < lastBin; i++) {
+                auto [left, right] = split_reference(build, rest, axis, bounds.min[axis] + (float) (i + 1) * binWidth);
+                if (!is_empty(left.aabb)) bins[i].aabb = AABB(bins[i].aabb, left.aabb);
+                rest = right;
+            }
+            if (!is_empty(rest.aabb)) bins[lastBin].aabb = AABB(bins[lastBin].aabb, rest.aabb);
+
+            bins[firstBin].numEntries++;
+            bins[lastBin].numExits++;
+        }
+
+        // Sweep from the right to accumulate the bounds to the right of each plane, then from the left to evaluate them.
+        rightBounds[numBins - 1] = bins[numBins - 1].aabb;
+        for (int i = numBins - 2; i > 0; i--) rightBounds[i] = AABB(rightBounds[i + 1], bins[i].aabb);
+
+        auto leftBounds = empty_aabb();
+        int numLeft = 0, numRight = (int) refs.size();
+        for (int i = 0; i < numBins - 1; i++) {
+            leftBounds = AABB(leftBounds, bins[i].aabb);
+            numLeft += bins[i].numEntries;
+            numRight -= bins[i].numExits;
+            if (numLeft == 0 || numRight == 0) continue;
+
+            auto cost = sah_cost(parentArea, area(leftBounds), area(rightBounds[i + 1]), numLeft, numRight);
+            if (cost < bestSplit.cost) {
+                bestSplit = {axis, bounds.min[axis] + (float) (i + 1) * binWidth, cost, leftBounds, rightBounds[i + 1], numLeft, numRight};
+            }
+        }
+    }
+    return bestSplit;
+}
+
+/**
+ * Distributes `refs` between the children of a spatial split. References straddling the plane are split, unless keeping
+ * them whole on one side is cheaper ("reference unsplitting") or the reference budget is spent.
+ */
+static void apply_spatial_split(SpatialBuild &build, const std::vector<FlatBVH::PrimitiveRef> &refs, const SpatialSplit &split,
+                                std::vector<FlatBVH::PrimitiveRef> &leftRefs, std::vector<FlatBVH::PrimitiveRef> &rightRefs) {
+    auto areaLeft = area(split.leftBounds), areaRight = area(split.rightBounds);
+    auto costSplit = areaLeft * (float) split.numLeft + areaRight * (float) split.numRight;
+
+    for (const auto &ref : refs) {
+        if (ref.aabb.max[split.axis] <= split.position) {
+            leftRefs.push_back(ref);
+        } else if (ref.aabb.min[split.axis] >= split.position) {
+            rightRefs.push_back(ref);
+        } else {
+            auto costLeft = area(AABB(split.leftBounds, ref.aabb)) * (float) split.numLeft + areaRight * (float) (split.numRight - 1);
+            auto costRight = areaLeft * (float) (split.numLeft - 1) + area(AABB(split.rightBounds, ref.aabb)) * (float) split.numRight;
+            auto [left, right] = split_reference(build, ref, split.axis, split.position);
+
+            auto isSplit = costSplit < std::min(costLeft, costRight) && build.numRefs < build.maxNumRefs;
+            if (isSplit && !is_empty(left.aabb) && !is_empty(right.aabb)) {
+                leftRefs.push_back(left);
+                rightRefs.push_back(right);
+                build.numRefs++;
+            } else if (is_empty(right.aabb) || (!is_empty(left.aabb) && costLeft <= costRight)) {
+                leftRefs.push_back(ref);
+            } else {
+                rightRefs.push_back(ref);
+            }
+        }
+    }
+}
+
+static int build_spatial_node(SpatialBuild &build, std::vector<FlatBVH::PrimitiveRef> &refs) { // NOLINT
+    const auto &options = build.options;
+    auto span = (int) refs.size();
+    auto nodeIndex = (int) build.tree.size();
+
+    auto bounds = refs.front().aabb;
+    for (const auto &ref : refs) bounds = AABB(bounds, ref.aabb);
+    build.tree.emplace_back(bounds);
+
+    auto make_leaf = [&]() {
+        build.tree[nodeIndex].firstRef = (uint32_t) build.leafRefs.size();
+        build.tree[nodeIndex].numRefs = (uint32_t) span;
+        build.leafRefs.insert(build.leafRefs.end(), refs.begin(), refs.end());
+        return nodeIndex;
+    };
+
+    if (span == 1) return make_leaf();
+
+    // --- Object Split ---
+    auto objectSplit = get_binned_split(refs, 0, span, options.numBins, false, ref_bounds);
+    auto leftBounds = refs.front().aabb, rightBounds = refs.back().aabb;
+    for (int i = 0; i < objectSplit.mid; i++) leftBounds = AABB(leftBounds, refs[i].aabb);
+    for (int i = objectSplit.mid; i < span; i++) rightBounds = AABB(rightBounds, refs[i].aabb);
+
+    // --- Spatial Split ---
+    // Only worth trying if the object split's children overlap noticeably, relative to the whole scene.
+    SpatialSplit spatialSplit;
+    auto overlap = intersect(leftBounds, rightBounds);
+    if (build.numRefs < build.maxNumRefs && area(overlap) > SPATIAL_SPLIT_ALPHA * build.rootArea)
+        spatialSplit = get_spatial_split(build, refs, bounds);
+
+    // Small ranges of one type become a leaf, unless splitting them is expected to be cheaper.
+    auto bestCost = std::min(objectSplit.cost, spatialSplit.cost);
+    if (span <= options.maxLeafSize && has_single_type(refs, 0, span)) {
+        if (bestCost == std::numeric_limits<float>::max()) bestCost = get_split_cost(refs, 0, objectSplit.mid, span, ref_bounds);
+        if (sah_leaf_cost(span) <= bestCost) return make_leaf();
+    }
+
+    auto leftRefs = std::vector<FlatBVH::PrimitiveRef>(), rightRefs = std::vector<FlatBVH::PrimitiveRef>();
+    if (spatialSplit.cost < objectSplit.cost) {
+        apply_spatial_split(build, refs, spatialSplit, leftRefs, rightRefs);
+    }
+    if (leftRefs.empty() || rightRefs.empty()) {
+        // Either the object split is cheaper, or unsplitting moved every reference to one side.
+        leftRefs.assign(refs.begin(), refs.begin() + objectSplit.mid);
+        rightRefs.assign(refs.begin() + objectSplit.mid, refs.end());
+    }
+    refs = {}; // Children only need their own references.
+
+    auto left = build_spatial_node(build, leftRefs);
+    auto right = build_spatial_node(build, rightRefs);
+    build.tree[nodeIndex].left = left;
+    build.tree[nodeIndex].right = right;
+    return nodeIndex;
+}
+
+void FlatBVH::build_spatial(const std::vector<std::shared_ptr<Hittable>> &objects, const BVHNode::BuildOptions &options) {
+    auto build = SpatialBuild(options);
+    build.tris.resize(objects.size());
+    build.arrays.resize(objects.size());
+    build.meshes.resize(objects.size());
+    for (size_t i = 0; i < objects.size(); i++) {
+        build.tris[i] = dynamic_cast<const Tri *>(objects[i].get());
+        build.arrays[i] = dynamic_cast<const PrimitiveArrays *>(objects[i].get());
+        build.meshes[i] = dynamic_cast<const TriMesh *>(objects[i].get());
+    }
+
+    auto bounds = refs.front().aabb;
+    for (const auto &ref : refs) bounds = AABB(bounds, ref.aabb);
+    build.rootArea = bounds.area();
+    build.numRefs = refs.size();
+    build.maxNumRefs = refs.size() + (size_t) (options.maxDuplication * (float) refs.size());
+
+    build_spatial_node(build, refs);
+
+    // The temporary tree is already in depth-first order--only the hit/miss links have to be added.
+    nodes.resize(build.tree.size());
+    auto link = [&](auto &&link, int nodeIndex, uint32_t missIndex) -> void {
+        const auto &spatialNode = build.tree[nodeIndex];
+        auto &node = nodes[nodeIndex];
+        node.aabb = spatialNode.aabb;
+        node.missIndex = missIndex;
+
+        if (spatialNode.left == -1) {
+            node.objectIndex = spatialNode.firstRef;
+            node.numChildren = spatialNode.numRefs;
+            node.hitIndex = missIndex;
+        } else {
+            node.hitIndex = spatialNode.left;
+            link(link, spatialNode.left, spatialNode.right);
+            link(link, spatialNode.right, missIndex);
+        }
+    };
+    link(link, 0, BAD_INDEX);
+
+    refs = std::move(build.leafRefs);
+}
+
+/** Appends the primitive of a reference (or every primitive of its object) to its type's scene buffer. */
+static void serialize_ref(Scene &scene, const std::vector<std::shared_ptr<Hittable>> &objects, const FlatBVH::PrimitiveRef &ref) {
+    if (ref.type == Hittable::Type::meshTri) {
+        static_cast<TriMesh &>(*objects[ref.objectIndex]).gpu_serialize(scene, ref.primitiveIndex);
+    } else if (ref.primitiveIndex != BAD_INDEX) {
+        static_cast<PrimitiveArrays &>(*objects[ref.objectIndex]).gpu_serialize(scene, ref.type, ref.primitiveIndex);
+    } else {
+        objects[ref.objectIndex]->gpu_serialize(scene);
+    }
+}
+
+void FlatBVH::gpu_serialize(Scene &scene, const std::vector<std::shared_ptr<Hittable>> &objects) const {
+    // Every reference writes (at least) one primitive of its type, so each buffer is grown once up front.
+    auto numRefsByType = std::array<size_t, 32>();
+    for (const auto &ref : refs) numRefsByType[std::countr_zero((uint32_t) ref.type)]++;
+    for (int bit = 0; bit < 32; bit++) {
+        if (numRefsByType[bit] > 0) scene.reserve_buffer(1 << bit, numRefsByType[bit]);
+    }
+
+    // Every node is reserved up front, since serializing an `Instance` appends its bottom-level BVH to the same buffer.
+    auto &bvh = scene.get_buffer<BVHNode::GPU_t>(Hittable::Type::bvhNode);
+    auto nodeOffset = (uint32_t) bvh.size();
+    bvh.resize(bvh.size() + nodes.size());
+
+    for (uint32_t i = 0; i < (uint32_t) nodes.size(); i++) {
+        auto node = nodes[i];
+        if (node.numChildren != 0) {
+            // Leaves reference a range of `refs`--replace it with the range of primitives written to the type buffer.
+            auto firstRef = node.objectIndex, numRefs = node.numChildren;
+            auto type = refs[firstRef].type;
+            auto startIndex = (uint32_t) scene.buffer_size(type);
+
+            for (auto i = firstRef; i < firstRef + numRefs; i++) serialize_ref(scene, objects, refs[i]);
+
+            node.type = type;
+            node.objectIndex = startIndex;
+            node.numChildren = (uint32_t) scene.buffer_size(type) - startIndex;
+        }
+
+        if (node.hitIndex != BAD_INDEX) node.hitIndex += nodeOffset;
+        if (node.missIndex != BAD_INDEX) node.missIndex += nodeOffset;
+        bvh[nodeOffset + i] = node;
+    }
+}
+
+void FlatBVH::gpu_serialize_primitives(Scene &scene, const std::vector<std::shared_ptr<Hittable>> &objects, SceneEdit &edit) const {
+    // Objects serialize themselves by appending to the buffer, so every leaf's primitives are written past the end of
+    // it, then only copied over the ones it references where they changed.
+    const auto &bvh = scene.get_buffer<BVHNode::GPU_t>(Hittable::Type::bvhNode);
+    auto meshes = std::vector<const TriMesh *>();
+    for (uint32_t i = 0; i < (uint32_t) nodes.size(); i++) {
+        const auto &node = nodes[i];
+        if (node.numChildren == 0) continue;
+
+        auto type = refs[node.objectIndex].type;
+        visit_buffer_type(type, [&](auto prototype) {
+            using T = decltype(prototype);
+            auto &buffer = scene.get_buffer<T>(type);
+            auto oldSize = buffer.size();
+            for (auto j = node.objectIndex; j < node.objectIndex + node.numChildren; j++) serialize_ref(scene, objects, refs[j]);
+            if (buffer.size() - oldSize != bvh[i].numChildren)
+                throw std::runtime_error("ERROR: Objects must serialize into as many primitives as they did before!");
+
+            auto &dirtyIndices = edit.dirtyIndices[type];
+            for (uint32_t j = 0; j < bvh[i].numChildren; j++) {
+                auto index = bvh[i].objectIndex + j;
+                if (std::memcmp(&buffer[index], &buffer[oldSize + j], sizeof(T)) == 0) continue;
+                buffer[index] = buffer[oldSize + j];
+                dirtyIndices.push_back(index);
+            }
+            buffer.resize(oldSize);
+        });
+
+        if (type == Hittable::Type::meshTri) {
+            for (auto j = node.objectIndex; j < node.objectIndex + node.numChildren; j++)
+                meshes.push_back(static_cast<const TriMesh *>(objects[refs[j].objectIndex].get()));
+        }
+    }
+
+    // Mesh vertices are only serialized once per scene, so they are compared against the mesh itself.
+    std::sort(meshes.begin(), meshes.end());
+    meshes.erase(std::unique(meshes.begin(), meshes.end()), meshes.end());
+    auto &vertexBuffer = scene.get_buffer<TriMesh::Vertex_t>(Hittable::Type::meshVertex);
+    for (const auto *mesh : meshes) {
+        auto vertexOffset = scene.meshVertexOffsets.at(mesh);
+        for (uint32_t i = 0; i < (uint32_t) mesh->vertices.size(); i++) {
+            if (std::memcmp(&vertexBuffer[vertexOffset + i], &mesh->vertices[i], sizeof(TriMesh::Vertex_t)) == 0) continue;
+            vertexBuffer[vertexOffset + i] = mesh->vertices[i];
+            edit.dirtyIndices[Hittable::Type::meshVertex].push_back(vertexOffset + i);
+        }
+    }
+}
+
+// --- Treelet Restructuring ---
+// Source: Fast Parallel Construction of High-Quality Bounding Volume Hierarchies - Karras and Aila
+// https://research.nvidia.com/sites/default/files/pubs/2013-07_Fast-Parallel-Construction/karras2013hpg_paper.pdf
+
+constexpr int TREELET_SIZE = 7;           // Leaves of every treelet, which is optimal at 2^7 subsets per treelet.
+constexpr int TREELET_PARALLEL_SPAN = 64; // Levels with fewer nodes than this are restructured serially.
+
+struct TreeletNode {
+    AABB aabb;
+    int left {-1}, right {-1};
+    uint32_t firstRef {}, numRefs {};
+    float cost {}; // SAH cost of the subtree, weighted by area rather than by the probability of hitting it.
+};
+
+/**
+ * Replaces the topology of the treelet rooted at `rootIndex` with the one of lowest SAH cost. The treelet's leaves are
+ * found by repeatedly opening its largest interior leaf, and the optimal topology over them is found by dynamic
+ * programming over every subset of them. Only nodes in the subtree of the root are touched.
+ */
+static void restructure_treelet(std::vector<TreeletNode> &tree, int rootIndex) {
+    auto &root = tree[rootIndex];
+    auto leaves = std::vector<int>{root.left, root.right};
+    auto interiors = std::vector<int>{rootIndex}; // Nodes that may be reused for the new topology.
+    while ((int) leaves.size() < TREELET_SIZE) {
+        auto largest = leaves.end();
+        auto largestArea = -1.0f;
+        for (auto it = leaves.begin(); it != leaves.end(); it++) {
+            if (tree[*it].left != -1 && tree[*it].aabb.area() > largestArea) {
+                largest = it;
+                largestArea = tree[*it].aabb.area();
+            }
+        }
+        if (largest == leaves.end()) break; // Every leaf of the treelet is a leaf of the tree.
+
+        interiors.push_back(*largest);
+        auto opened = *largest;
+        *largest = tree[opened].left;
+        leaves.push_back(tree[opened].right);
+    }
+
+    auto numLeaves = (int) leaves.size();
+    if (numLeaves < 3) {
+        // Two leaves only have one topology.
+        root.cost = COST_TRAVERSAL * root.aabb.area() + tree[root.left].cost + tree[root.right].cost;
+        return;
+    }
+
+    // --- Optimal Partitions ---
+    auto numSubsets = 1 << numLeaves;
+    std::array<float, 1 << TREELET_SIZE> costs;
+    std::array<AABB, 1 << TREELET_SIZE> bounds;
+    std::array<int, 1 << TREELET_SIZE> partitions;
+    for (int subset = 1; subset < numSubsets; subset++) {
+        auto lowest = std::countr_zero((uint32_t) subset);
+        if (subset == 1 << lowest) {
+            bounds[subset] = tree[leaves[lowest]].aabb;
+            costs[subset] = tree[leaves[lowest]].cost;
+            continue;
+        }
+        bounds[subset] = AABB(bounds[subset & (subset - 1)], tree[leaves[lowest]].aabb);
+    }
+
+    // Subsets are evaluated in order of their size, so every partition of a subset has already been evaluated.
+    static const auto subsetsBySize = []() {
+        std::array<int, 1 << TREELET_SIZE> subsets;
+        for (int i = 0; i < (int) subsets.size(); i++) subsets[i] = i;
+        std::stable_sort(subsets.begin(), subsets.end(), [](int a, int b) { return std::popcount((uint32_t) a) < std::popcount((uint32_t) b); });
+        return subsets;
+    }();
+    for (auto subset : subsetsBySize) {
+        if (subset >= numSubsets || std::popcount((uint32_t) subset) < 2) continue;
+
+        // Enumerates every non-empty proper subset of `subset`.
+        auto bestCost = std::numeric_limits<float>::max();
+        auto delta = (subset - 1) & subset;
+        auto partition = (-delta) & subset;
+        do {
+            auto cost = costs[partition] + costs[subset ^ partition];
+            if (cost < bestCost) {
+                bestCost = cost;
+                partitions[subset] = partition;
+            }
+            partition = (partition - delta) & subset;
+        } while (partition != 0);
+        costs[subset] = COST_TRAVERSAL * bounds[subset].area() + bestCost;
+    }
+
+    // Floating-point noise must not churn the tree.
+    auto allLeaves = numSubsets - 1;
+    auto oldCost = COST_TRAVERSAL * root.aabb.area() + tree[root.left].cost + tree[root.right].cost;
+    if (costs[allLeaves] >= oldCost * (1.0f - 1e-5f)) {
+        root.cost = oldCost;
+        return;
+    }
+
+    // --- Reconstruction ---
+    auto nextInterior = 0;
+    auto rebuild = [&](auto &&rebuild, int subset) -> int {
+        if (std::popcount((uint32_t) subset) == 1) return leaves[std::countr_zero((uint32_t) subset)];
+
+        auto nodeIndex = interiors[nextInterior++]; // The root is reused first, so the treelet keeps its place.
+        auto left = rebuild(rebuild, partitions[subset]);
+        auto right = rebuild(rebuild, subset ^ partitions[subset]);
+        tree[nodeIndex].left = left;
+        tree[nodeIndex].right = right;
+        tree[nodeIndex].aabb = bounds[subset];
+        tree[nodeIndex].cost = costs[subset];
+        return nodeIndex;
+    };
+    rebuild(rebuild, allLeaves);
+}
+
+/**
+ * @return The interior nodes of the tree grouped by height, lowest first, like `FlatBVH::get_refit_order()`.
+ * @param levelOffsets Receives the start of every group, followed by the end of the last one.
+ */
+static std::vector<uint32_t> get_treelet_order(const std::vector<TreeletNode> &tree, std::vector<uint32_t> &levelOffsets) {
+    // Restructured nodes are no longer laid out after their parent, so the tree is walked in preorder first.
+    auto preorder = std::vector<int>();
+    preorder.reserve(tree.size());
+    auto stack = std::vector<int>{0};
+    while (!stack.empty()) {
+        auto treeIndex = stack.back();
+        stack.pop_back();
+        preorder.push_back(treeIndex);
+        if (tree[treeIndex].left == -1) continue;
+        stack.push_back(tree[treeIndex].right);
+        stack.push_back(tree[treeIndex].left);
+    }
+
+    auto heights = std::vector<uint32_t>(tree.size());
+    auto maxHeight = 0u;
+    for (auto it = preorder.rbegin(); it != preorder.rend(); it++) {
+        const auto &node = tree[*it];
+        if (node.left == -1) continue;
+        heights[*it] = 1 + std::max(heights[node.left], heights[node.right]);
+        maxHeight = std::max(maxHeight, heights[*it]);
+    }
+
+    levelOffsets.assign(maxHeight + 2, 0);
+    for (auto treeIndex : preorder) levelOffsets[heights[treeIndex] + 1]++;
+    for (uint32_t level = 0; level <= maxHeight; level++) levelOffsets[level + 1] += levelOffsets[level];
+
+    auto order = std::vector<uint32_t>(preorder.size());
+    auto insertOffsets = levelOffsets;
+    for (auto treeIndex : preorder) order[insertOffsets[heights[treeIndex]]++] = (uint32_t) treeIndex;
+    return order;
+}
+
+void FlatBVH::optimize(int numPasses, bool isParallel) {
+    if (nodes.size() < 3) return;
+
+    auto tree = std::vector<TreeletNode>(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const auto &node = nodes[i];
+        tree[i].aabb = node.aabb;
+        if (node.numChildren != 0) {
+            tree[i].firstRef = node.objectIndex;
+            tree[i].numRefs = node.numChildren;
+            tree[i].cost = COST_INTERSECTION * (float) node.numChildren * node.aabb.area();
+        } else {
+            tree[i].left = (int) node.hitIndex;
+            tree[i].right = (int) nodes[node.hitIndex].missIndex;
+        }
+    }
+
+    // Treelets only span the subtree of their root, so nodes of the same height never share one. Restructuring moves
+    // interior nodes to other heights, so they are found again every pass. Within a pass, a restructured treelet keeps
+    // every node within the subtree of its root, so the heights found before the pass keep every root after its subtree.
+    auto levelOffsets = std::vector<uint32_t>();
+    for (int pass = 0; pass < numPasses; pass++) {
+        auto order = get_treelet_order(tree, levelOffsets);
+        for (int level = 1; level + 1 < (int) levelOffsets.size(); level++) {
+            auto levelStart = (int) levelOffsets[level], levelEnd = (int) levelOffsets[level + 1];
+#pragma omp parallel for schedule(dynamic, 16) if(isParallel && levelEnd - levelStart >= TREELET_PARALLEL_SPAN)
+            for (int i = levelStart; i < levelEnd; i++) restructure_treelet(tree, (int) order[i]);
+        }
+    }
+
+    // --- Layout ---
+    // Numbers the restructured tree depth-first, then links it like `build_spatial()` does. Leaves take their references
+    // along, so the references stay in leaf order.
+    auto newIndices = std::vector<uint32_t>(tree.size());
+    uint32_t numNumbered = 0;
+    auto number = [&](auto &&number, int treeIndex) -> void { // NOLINT
+        newIndices[treeIndex] = numNumbered++;
+        if (tree[treeIndex].left == -1) return;
+        number(number, tree[treeIndex].left);
+        number(number, tree[treeIndex].right);
+    };
+    number(number, 0);
+
+    auto newRefs = std::vector<PrimitiveRef>();
+    newRefs.reserve(refs.size());
+    auto link = [&](auto &&link, int treeIndex, uint32_t missIndex) -> void { // NOLINT
+        const auto &treeletNode = tree[treeIndex];
+        auto &node = nodes[newIndices[treeIndex]];
+        node = BVHNode::GPU_t();
+        node.aabb = treeletNode.aabb;
+        node.missIndex = missIndex;
+
+        if (treeletNode.left == -1) {
+            node.objectIndex = (uint32_t) newRefs.size();
+            node.numChildren = treeletNode.numRefs;
+            node.hitIndex = missIndex;
+            newRefs.insert(newRefs.end(), refs.begin() + treeletNode.firstRef, refs.begin() + treeletNode.firstRef + treeletNode.numRefs);
+        } else {
+            node.hitIndex = newIndices[treeletNode.left];
+            link(link, treeletNode.left, newIndices[treeletNode.right]);
+            link(link, treeletNode.right, missIndex);
+        }
+    };
+    link(link, 0, BAD_INDEX);
+    refs = std::move(newRefs);
+}
+
+// --- Node Layouts ---
+
+constexpr int BREADTH_FIRST_LEVELS = 8; // Top levels of `NodeLayout::breadthFirst`, i.e., up to 255 nodes (16 KiB).
+
+void FlatBVH::reorder(BVHNode::NodeLayout layout) {
+    auto is_leaf = [&](uint32_t index) { return nodes[index].numChildren != 0; };
+    auto left_child = [&](uint32_t index) { return nodes[index].hitIndex; };
+    auto right_child = [&](uint32_t index) { return nodes[nodes[index].hitIndex].missIndex; };
+
+    // Old index of every node, in the new order.
+    auto order = std::vector<uint32_t>();
+    order.reserve(nodes.size());
+
+    auto depth_first = [&](uint32_t rootIndex) {
+        auto stack = std::vector<uint32_t>{rootIndex};
+        while (!stack.empty()) {
+            auto index = stack.back();
+            stack.pop_back();
+            order.push_back(index);
+            if (is_leaf(index)) continue;
+            stack.push_back(right_child(index));
+            stack.push_back(left_child(index));
+        }
+    };
+
+    switch (layout) {
+        case BVHNode::NodeLayout::depthFirst:
+            depth_first(0);
+            break;
+
+        case BVHNode::NodeLayout::breadthFirst: {
+            auto level = std::vector<uint32_t>{0}, nextLevel = std::vector<uint32_t>();
+            for (int depth = 0; depth < BREADTH_FIRST_LEVELS && !level.empty(); depth++) {
+                nextLevel.clear();
+                for (auto index : level) {
+                    order.push_back(index);
+                    if (is_leaf(index)) continue;
+                    nextLevel.push_back(left_child(index));
+                    nextLevel.push_back(right_child(index));
+                }
+                std::swap(level, nextLevel);
+            }
+            for (auto index : level) depth_first(index);
+            break;
+        }
+
+        case BVHNode::NodeLayout::vanEmdeBoas: {
+            // Children come after their parent in every layout, so walking backward finds every height bottom-up.
+            auto heights = std::vector<int>(nodes.size(), 1);
+            for (auto i = (int) nodes.size() - 1; i >= 0; i--) {
+                if (!is_leaf(i)) heights[i] = 1 + std::max(heights[left_child(i)], heights[right_child(i)]);
+            }
+
+            // Lays out the top `numLevels` levels below `rootIndex`: first the treelet of the top half of them, then
+            // every treelet of the bottom half hanging off of it, from left to right.
+            auto lay_out = [&](auto &&lay_out, uint32_t rootIndex, int numLevels) -> void { // NOLINT
+                if (numLevels == 1 || is_leaf(rootIndex)) {
+                    order.push_back(rootIndex);
+                    return;
+                }
+                auto numTopLevels = numLevels / 2;
+                lay_out(lay_out, rootIndex, numTopLevels);
+
+                auto bottomRoots = std::vector<uint32_t>();
+                auto stack = std::vector<std::pair<uint32_t, int>>{{rootIndex, 0}};
+                while (!stack.empty()) {
+                    auto [index, depth] = stack.back();
+                    stack.pop_back();
+                    if (depth == numTopLevels) {
+                        bottomRoots.push_back(index);
+                    } else if (!is_leaf(index)) {
+                        stack.emplace_back(right_child(index), depth + 1);
+                        stack.emplace_back(left_child(index), depth + 1);
+                    }
+                }
+                for (auto bottomRoot : bottomRoots) lay_out(lay_out, bottomRoot, numLevels - numTopLevels);
+            };
+            lay_out(lay_out, 0, heights[0]);
+            break;
+        }
+
+        default:
+            throw std::runtime_error("ERROR: Unknown BVH node layout!");
+    }
+
+    auto newIndices = std::vector<uint32_t>(nodes.size());
+    for (uint32_t i = 0; i < (uint32_t) order.size(); i++) newIndices[order[i]] = i;
+    auto remap = [&](uint32_t index) { return index == BAD_INDEX ? BAD_INDEX : newIndices[index]; };
+
+    auto reordered = std::vector<BVHNode::GPU_t>(nodes.size());
+    for (uint32_t i = 0; i < (uint32_t) order.size(); i++) {
+        auto node = nodes[order[i]];
+        node.hitIndex = remap(node.hitIndex);
+        node.missIndex = remap(node.missIndex);
+        reordered[i] = node;
+    }
+    nodes = std::move(reordered);
+}
+
+float FlatBVH::sah_cost() const {
+    // Equivalent to the recursive definition, where every node costs a traversal weighted by the probability of a ray
+    // hitting it given it hit the root.
+    auto cost = 0.0f;
+    for (const auto &node : nodes) {
+        cost += node.aabb.area() * (node.numChildren == 0 ? COST_TRAVERSAL : COST_INTERSECTION * (float) node.numChildren);
+    }
+    auto rootArea = nodes.front().aabb.area();
+    return rootArea > 0.0f ? cost / rootArea : cost;
+}
+
+void FlatBVH::refit(const std::vector<std::shared_ptr<Hittable>> &objects, bool isParallel) {
+    auto numRefs = (int) refs.size();
+#pragma omp parallel for if(isParallel && numRefs >= PARALLEL_TASK_SPAN)
+    for (int i = 0; i < numRefs; i++) {
+        const auto &object = objects[refs[i].objectIndex];
+        if (refs[i].type == Hittable::Type::meshTri) {
+            refs[i].aabb = static_cast<const TriMesh &>(*object).bounding_box(refs[i].primitiveIndex);
+        } else if (refs[i].primitiveIndex != BAD_INDEX) {
+            refs[i].aabb = static_cast<const PrimitiveArrays &>(*object).bounding_box(refs[i].type, refs[i].primitiveIndex);
+        } else {
+            refs[i].aabb = object->bounding_box();
+        }
+        refs[i].centroid = centroid(refs[i].aabb);
+    }
+
+    auto levelOffsets = std::vector<uint32_t>();
+    auto order = get_refit_order(levelOffsets);
+    for (int level = 0; level + 1 < (int) levelOffsets.size(); level++) {
+        auto levelStart = (int) levelOffsets[level], levelEnd = (int) levelOffsets[level + 1];
+#pragma omp parallel for if(isParallel && levelEnd - levelStart >= PARALLEL_TASK_SPAN)
+        for (int i = levelStart; i < levelEnd; i++) {
+            auto &node = nodes[order[i]];
+            if (node.numChildren != 0) {
+                node.aabb = refs[node.objectIndex].aabb;
+                for (auto j = node.objectIndex + 1; j < node.objectIndex + node.numChildren; j++) node.aabb = AABB(node.aabb, refs[j].aabb);
+            } else {
+                const auto &left = nodes[node.hitIndex];
+                node.aabb = AABB(left.aabb, nodes[left.missIndex].aabb);
+            }
+        }
+    }
+}
+
+std::vector<uint32_t> FlatBVH::get_refit_order(std::vector<uint32_t> &levelOffsets) const {
+    // Children are always laid out after their parent, so walking the nodes backward visits children first.
+    auto numNodes = (int) nodes.size();
+    auto heights = std::vector<uint32_t>(numNodes);
+    auto maxHeight = 0u;
+    for (int i = numNodes - 1; i >= 0; i--) {
+        if (nodes[i].numChildren == 0) {
+            auto leftIndex = nodes[i].hitIndex;
+            heights[i] = 1 + std::max(heights[leftIndex], heights[nodes[leftIndex].missIndex]);
+            maxHeight = std::max(maxHeight, heights[i]);
+        }
+    }
+
+    levelOffsets.assign(maxHeight + 2, 0);
+    for (auto height : heights) levelOffsets[height + 1]++;
+    for (uint32_t level = 0; level <= maxHeight; level++) levelOffsets[level + 1] += levelOffsets[level];
+
+    auto order = std::vector<uint32_t>(numNodes);
+    auto insertOffsets = levelOffsets;
+    for (int i = 0; i < numNodes; i++) order[insertOffsets[heights[i]]++] = (uint32_t) i;
+    return order;
+}
\ No newline at end of file
@@ -0,0 +1,61 @@
+#include "../include/instance.h"
+#include "../include/primitive_arrays.h"
+#include "glm/matrix.hpp"
+
+#include <utility>
+
+BottomLevelBVH::BottomLevelBVH(std::vector<std::shared_ptr<Hittable>> objects, const BVHNode::BuildOptions &options)
+    : objects(std::move(objects))
+{
+    for (const auto &object : this->objects) {
+        const auto *arrays = dynamic_cast<const PrimitiveArrays *>(object.get());
+        auto hasSpheres = arrays != nullptr ? arrays->size(Hittable::Type::sphere) > 0 : object->type() == Hittable::Type::sphere;
+        if (hasSpheres || (arrays == nullptr && object->type() == Hittable::Type::instance))
+            throw std::runtime_error("ERROR: Bottom-level BVHs cannot hold spheres or instances!");
+    }
+    bvh = FlatBVH(this->objects, options);
+}
+
+uint32_t BottomLevelBVH::gpu_serialize(Scene &scene) {
+    if (scene.bottomLevelRoots.contains(this)) return scene.bottomLevelRoots[this];
+
+    auto rootIndex = (uint32_t) scene.buffer_size(Hittable::Type::bvhNode);
+    bvh.gpu_serialize(scene, objects);
+    scene.bottomLevelRoots[this] = rootIndex;
+    return rootIndex;
+}
+
+AABB BottomLevelBVH::bounding_box() const {
+    return bvh.nodes.front().aabb;
+}
+
+Instance::Instance(std::shared_ptr<BottomLevelBVH> bottomLevelBvh, const glm::mat4 &objectToWorld)
+    : bottomLevelBvh(std::move(bottomLevelBvh))
+{
+    instance.objectToWorld = objectToWorld;
+    instance.worldToObject = glm::inverse(objectToWorld);
+    calculate_bounds();
+}
+
+void Instance::gpu_serialize(Scene &scene) {
+    // The bottom-level BVH is serialized first, so the instance can reference its root.
+    instance.rootIndex = bottomLevelBvh->gpu_serialize(scene);
+    scene.get_buffer<Instance::GPU_t>(Hittable::Type::instance).push_back(instance);
+}
+
+void Instance::transform(const glm::mat4 &transform) {
+    instance.objectToWorld = transform * instance.objectToWorld;
+    instance.worldToObject = glm::inverse(instance.objectToWorld);
+    calculate_bounds();
+}
+
+void Instance::calculate_bounds() {
+    auto objectBounds = bottomLevelBvh->bounding_box();
+    for (int i = 0; i < 8; i++) {
+        auto corner = glm::vec3(i & 1 ? objectBounds.max.x : objectBounds.min.x,
+                                i & 2 ? objectBounds.max.y : objectBounds.min.y,
+                                i & 4 ? objectBounds.max.z : objectBounds.min.z);
+        auto worldCorner = glm::vec3(instance.objectToWorld * glm::vec4(corner, 1.0f));
+        aabb = i == 0 ? AABB(worldCorner, worldCorner) : AABB(aabb, AABB(worldCorner, worldCorner));
+    }
+}
\ No newline at end of file
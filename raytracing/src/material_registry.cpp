@@ -0,0 +1,83 @@
+#include "../include/material_registry.h"
+
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+struct RegistryEntry {
+    RTMaterial material;
+    uint32_t textureHandle;
+};
+
+// Deques never move their elements, so references handed out stay valid while other threads intern.
+struct Registry {
+    std::shared_mutex mutex;
+    std::deque<RegistryEntry> materials;
+    std::deque<std::string> textures;
+    std::unordered_map<RTMaterial, uint32_t> materialHandles;
+    std::unordered_map<std::string, uint32_t> textureHandles;
+};
+
+static Registry &registry() {
+    static auto instance = Registry();
+    return instance;
+}
+
+static uint32_t intern_texture_locked(Registry &registry, const std::string &name) {
+    auto [entry, isNew] = registry.textureHandles.try_emplace(name, (uint32_t) registry.textures.size());
+    if (isNew) registry.textures.push_back(name);
+    return entry->second;
+}
+
+uint32_t MaterialRegistry::intern(const RTMaterial &material) {
+    // Texture indices belong to the scene a material is registered in, so they are no part of the interned material.
+    auto key = material;
+    key.material.textureIndex = BAD_INDEX;
+
+    auto &registry = ::registry();
+    {
+        auto lock = std::shared_lock(registry.mutex);
+        auto entry = registry.materialHandles.find(key);
+        if (entry != registry.materialHandles.end()) return entry->second;
+    }
+
+    auto lock = std::unique_lock(registry.mutex);
+    auto [entry, isNew] = registry.materialHandles.try_emplace(key, (uint32_t) registry.materials.size());
+    if (isNew) {
+        auto textureHandle = key.texture.empty() ? BAD_INDEX : intern_texture_locked(registry, key.texture);
+        registry.materials.push_back(RegistryEntry(key, textureHandle));
+    }
+    return entry->second;
+}
+
+uint32_t MaterialRegistry::intern_texture(const std::string &name) {
+    auto &registry = ::registry();
+    auto lock = std::unique_lock(registry.mutex);
+    return intern_texture_locked(registry, name);
+}
+
+const RTMaterial &MaterialRegistry::material(uint32_t handle) {
+    auto &registry = ::registry();
+    auto lock = std::shared_lock(registry.mutex);
+    if (handle >= registry.materials.size())
+        throw std::runtime_error("ERROR: Material handle " + std::to_string(handle) + " was never interned!");
+    return registry.materials[handle].material;
+}
+
+uint32_t MaterialRegistry::texture_handle(uint32_t materialHandle) {
+    auto &registry = ::registry();
+    auto lock = std::shared_lock(registry.mutex);
+    if (materialHandle >= registry.materials.size())
+        throw std::runtime_error("ERROR: Material handle " + std::to_string(materialHandle) + " was never interned!");
+    return registry.materials[materialHandle].textureHandle;
+}
+
+const std::string &MaterialRegistry::texture(uint32_t textureHandle) {
+    auto &registry = ::registry();
+    auto lock = std::shared_lock(registry.mutex);
+    if (textureHandle >= registry.textures.size())
+        throw std::runtime_error("ERROR: Texture handle " + std::to_string(textureHandle) + " was never interned!");
+    return registry.textures[textureHandle];
+}
\ No newline at end of file
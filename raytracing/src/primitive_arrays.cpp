@@ -0,0 +1,187 @@
+#include "../include/primitive_arrays.h"
+#include "../include/material_registry.h"
+#include "../include/primitives.h"
+#include "../include/surface_area_heuristic.h"
+
+// Bounds are computed like the primitives' own `bounding_box()`, so moving a world over to arrays keeps its BVH.
+static AABB sphere_bounds(glm::vec3 center, float radius) {
+    return {center - glm::vec3(radius), center + glm::vec3(radius)};
+}
+
+static AABB quad_bounds(glm::vec3 corner, glm::vec3 u, glm::vec3 v) {
+    return AABB(AABB(corner, corner + u + v), AABB(corner + u, corner + v)).pad();
+}
+
+static AABB tri_bounds(glm::vec3 v0, glm::vec3 v1, glm::vec3 v2) {
+    return AABB(v0, v1, v2).pad();
+}
+
+uint32_t PrimitiveArrays::add_material(const RTMaterial &material) {
+    return MaterialRegistry::intern(material);
+}
+
+void PrimitiveArrays::add_sphere(glm::vec3 center, float radius, uint32_t materialId) {
+    spheres.centers.push_back(center);
+    spheres.radii.push_back(radius);
+    spheres.materialIds.push_back(materialId);
+    spheres.bounds.push_back(sphere_bounds(center, radius));
+}
+
+void PrimitiveArrays::add_quad(glm::vec3 corner, glm::vec3 u, glm::vec3 v, uint32_t materialId) {
+    quads.corners.push_back(corner);
+    quads.us.push_back(u);
+    quads.vs.push_back(v);
+    quads.materialIds.push_back(materialId);
+    quads.bounds.push_back(quad_bounds(corner, u, v));
+}
+
+void PrimitiveArrays::add_tri(glm::vec3 v0, glm::vec3 v1, glm::vec3 v2, glm::vec3 u, glm::vec3 v, uint32_t materialId) {
+    tris.v0s.push_back(v0);
+    tris.v1s.push_back(v1);
+    tris.v2s.push_back(v2);
+    tris.us.push_back(u);
+    tris.vs.push_back(v);
+    tris.materialIds.push_back(materialId);
+    tris.bounds.push_back(tri_bounds(v0, v1, v2));
+}
+
+void PrimitiveArrays::add(const Hittable &object) {
+    if (const auto *sphere = dynamic_cast<const Sphere *>(&object)) {
+        add_sphere(sphere->sphere.center, sphere->sphere.radius, sphere->get_material_handle());
+    } else if (const auto *quad = dynamic_cast<const Quad *>(&object)) {
+        add_quad(quad->quad.corner, quad->quad.u, quad->quad.v, quad->get_material_handle());
+    } else if (const auto *tri = dynamic_cast<const Tri *>(&object)) {
+        add_tri(tri->tri.v0, tri->tri.v1, tri->tri.v2, tri->tri.u, tri->tri.v, tri->get_material_handle());
+    } else if (const auto *sphereList = dynamic_cast<const HittableList<Sphere> *>(&object)) {
+        for (const auto &child : sphereList->objects) add(*child);
+    } else if (const auto *quadList = dynamic_cast<const HittableList<Quad> *>(&object)) {
+        for (const auto &child : quadList->objects) add(*child);
+    } else if (const auto *triList = dynamic_cast<const HittableList<Tri> *>(&object)) {
+        for (const auto &child : triList->objects) add(*child);
+    } else if (const auto *list = dynamic_cast<const HittableList<Hittable> *>(&object)) {
+        for (const auto &child : list->objects) add(*child);
+    } else {
+        throw std::runtime_error("ERROR: Only spheres, quads, triangles and lists of them can be added to primitive arrays!");
+    }
+}
+
+void PrimitiveArrays::update_bounds() {
+    auto numSpheres = (int) size(Hittable::Type::sphere);
+    spheres.bounds.resize(numSpheres);
+#pragma omp parallel for if(numSpheres >= PARALLEL_TASK_SPAN)
+    for (int i = 0; i < numSpheres; i++) spheres.bounds[i] = sphere_bounds(spheres.centers[i], spheres.radii[i]);
+
+    auto numQuads = (int) size(Hittable::Type::quad);
+    quads.bounds.resize(numQuads);
+#pragma omp parallel for if(numQuads >= PARALLEL_TASK_SPAN)
+    for (int i = 0; i < numQuads; i++) quads.bounds[i] = quad_bounds(quads.corners[i], quads.us[i], quads.vs[i]);
+
+    auto numTris = (int) size(Hittable::Type::tri);
+    tris.bounds.resize(numTris);
+#pragma omp parallel for if(numTris >= PARALLEL_TASK_SPAN)
+    for (int i = 0; i < numTris; i++) tris.bounds[i] = tri_bounds(tris.v0s[i], tris.v1s[i], tris.v2s[i]);
+}
+
+uint32_t PrimitiveArrays::size(Hittable::Type type) const {
+    switch (type) {
+        case Hittable::Type::sphere: return (uint32_t) spheres.centers.size();
+        case Hittable::Type::quad:   return (uint32_t) quads.corners.size();
+        case Hittable::Type::tri:    return (uint32_t) tris.v0s.size();
+        default:                     return 0;
+    }
+}
+
+uint32_t PrimitiveArrays::size() const {
+    return size(Hittable::Type::sphere) + size(Hittable::Type::quad) + size(Hittable::Type::tri);
+}
+
+AABB PrimitiveArrays::bounding_box(Hittable::Type type, uint32_t index) const {
+    switch (type) {
+        case Hittable::Type::sphere: return spheres.bounds[index];
+        case Hittable::Type::quad:   return quads.bounds[index];
+        case Hittable::Type::tri:    return tris.bounds[index];
+        default: throw std::runtime_error("ERROR: Primitive arrays only hold spheres, quads and triangles!");
+    }
+}
+
+void PrimitiveArrays::gpu_serialize(Scene &scene, Hittable::Type type, uint32_t index) {
+    switch (type) {
+        case Hittable::Type::sphere: {
+            auto materialIndex = scene.register_material(spheres.materialIds[index]);
+            auto sphere = Sphere::GPU_t(spheres.centers[index], spheres.radii[index], glm::vec3(PAD), materialIndex);
+            scene.get_buffer<Sphere::GPU_t>(type).push_back(sphere);
+            break;
+        }
+        case Hittable::Type::quad: {
+            auto quad = Quad::GPU_t(quads.corners[index], PAD, quads.us[index], PAD, quads.vs[index]);
+            Quad::calculate_plane(quad);
+            quad.materialIndex = scene.register_material(quads.materialIds[index]);
+            scene.get_buffer<Quad::GPU_t>(type).push_back(quad);
+            break;
+        }
+        case Hittable::Type::tri: {
+            auto materialIndex = scene.register_material(tris.materialIds[index]);
+            auto tri = Tri::GPU_t(tris.v0s[index], PAD, tris.v1s[index], PAD, tris.v2s[index], PAD, tris.us[index], PAD,
+                                  tris.vs[index], PAD, glm::vec3(PAD), materialIndex);
+            scene.get_buffer<Tri::GPU_t>(type).push_back(tri);
+            break;
+        }
+        default:
+            throw std::runtime_error("ERROR: Primitive arrays only hold spheres, quads and triangles!");
+    }
+}
+
+AABB PrimitiveArrays::bounding_box() const {
+    auto aabb = AABB();
+    auto isEmpty = true;
+    for (const auto *bounds : {&spheres.bounds, &quads.bounds, &tris.bounds}) {
+        for (const auto &primitiveBounds : *bounds) {
+            aabb = isEmpty ? primitiveBounds : AABB(aabb, primitiveBounds);
+            isEmpty = false;
+        }
+    }
+    return aabb;
+}
+
+Hittable::Type PrimitiveArrays::type() const {
+    auto numTypes = 0;
+    auto type = Hittable::Type::sphere;
+    for (auto primitiveType : {Hittable::Type::sphere, Hittable::Type::quad, Hittable::Type::tri}) {
+        if (size(primitiveType) == 0) continue;
+        numTypes++;
+        type = primitiveType;
+    }
+    if (numTypes != 1)
+        throw std::runtime_error("ERROR: Cannot serialize primitive arrays holding " + std::to_string(numTypes) + " types as a single object!");
+    return type;
+}
+
+void PrimitiveArrays::gpu_serialize(Scene &scene) {
+    for (auto type : {Hittable::Type::sphere, Hittable::Type::quad, Hittable::Type::tri}) {
+        for (uint32_t i = 0; i < size(type); i++) gpu_serialize(scene, type, i);
+    }
+}
+
+void PrimitiveArrays::transform(const glm::mat4 &transform) {
+    auto transform_point = [&](glm::vec3 &point) { point = glm::vec3(transform * glm::vec4(point, 1.0f)); };
+    auto transform_vector = [&](glm::vec3 &vector) { vector = glm::vec3(transform * glm::vec4(vector, 0.0f)); };
+
+    auto scale = glm::length(glm::vec3(transform[0]));
+    for (uint32_t i = 0; i < size(Hittable::Type::sphere); i++) {
+        transform_point(spheres.centers[i]);
+        spheres.radii[i] *= scale;
+        spheres.bounds[i] = sphere_bounds(spheres.centers[i], spheres.radii[i]);
+    }
+    for (uint32_t i = 0; i < size(Hittable::Type::quad); i++) {
+        transform_point(quads.corners[i]);
+        transform_vector(quads.us[i]);
+        transform_vector(quads.vs[i]);
+        quads.bounds[i] = quad_bounds(quads.corners[i], quads.us[i], quads.vs[i]);
+    }
+    for (uint32_t i = 0; i < size(Hittable::Type::tri); i++) {
+        transform_point(tris.v0s[i]);
+        transform_point(tris.v1s[i]);
+        transform_point(tris.v2s[i]);
+        tris.bounds[i] = tri_bounds(tris.v0s[i], tris.v1s[i], tris.v2s[i]);
+    }
+}
\ No newline at end of file
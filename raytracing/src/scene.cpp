@@ -1,29 +1,84 @@
 #include "../include/scene.h"
+#include "../include/bounding_volume_hierarchy.h"
+#include "../include/instance.h"
+#include "../include/material_registry.h"
+#include "../include/primitives.h"
+#include "../include/scene_buffer_types.h"
+#include "../include/tri_mesh.h"
 
+#include <algorithm>
 #include <vector>
 
-std::vector<std::any> &Scene::get_buffer(int type) {
-    return primitives[type];
+/** Still grows the buffer geometrically, so reserving a little at a time never copies it over and over. */
+template<typename T>
+static void reserve(std::vector<T> &buffer, size_t numEntries) {
+    auto capacity = buffer.size() + numEntries;
+    if (capacity > buffer.capacity()) buffer.reserve(std::max(capacity, 2 * buffer.capacity()));
 }
 
-void Scene::register_material(RTMaterial &material) {
-    // Register texture first so the material texture index field can be set before it is hashed
-    auto textureIndex = BAD_INDEX;
-    auto textureName = material.texture;
-    if (!material.texture.empty()) {
-        if (textures.contains(textureName)) {
-            textureIndex = textures[textureName];
-        } else {
-            textureIndex = (uint32_t) textures.size();
-            textures[textureName] = textureIndex;
+size_t Scene::buffer_size(int type) const {
+    auto buffer = buffers.find(type);
+    return buffer != buffers.end() ? buffer->second.size() : 0;
+}
+
+void Scene::reserve_buffer(int type, size_t numEntries) {
+    switch (type) {
+        case Hittable::Type::sphere:   reserve(get_buffer<Sphere::GPU_t>(type), numEntries); break;
+        case Hittable::Type::quad:     reserve(get_buffer<Quad::GPU_t>(type), numEntries); break;
+        case Hittable::Type::tri:      reserve(get_buffer<Tri::GPU_t>(type), numEntries); break;
+        case Hittable::Type::bvhNode:  reserve(get_buffer<BVHNode::GPU_t>(type), numEntries); break;
+        case Hittable::Type::instance: reserve(get_buffer<Instance::GPU_t>(type), numEntries); break;
+        case Hittable::Type::meshTri:  reserve(get_buffer<TriMesh::GPU_t>(type), numEntries); break;
+        default:                       break;
+    }
+}
+
+void Scene::copy_buffers(const Scene &other) {
+    buffers = other.buffers;
+}
+
+void Scene::copy_entries(const Scene &other, const SceneEdit &edit) {
+    for (const auto &[type, indices] : edit.dirtyIndices) {
+        visit_buffer_type(type, [&](auto prototype) {
+            using T = decltype(prototype);
+            auto &buffer = get_buffer<T>(type);
+            const auto &otherBuffer = other.get_buffer<T>(type);
+            for (auto index : indices) buffer[index] = otherBuffer[index];
+        });
+    }
+}
+
+void Scene::copy_materials(const Scene &other) {
+    materials = other.materials;
+    textures = other.textures;
+    materialIndices = other.materialIndices;
+    textureIndices = other.textureIndices;
+}
+
+void Scene::clear_buffers() {
+    buffers.clear();
+    bottomLevelRoots.clear();
+    meshVertexOffsets.clear();
+}
+
+uint32_t Scene::register_material(uint32_t materialHandle) {
+    if (materialHandle < materialIndices.size() && materialIndices[materialHandle] != BAD_INDEX)
+        return materialIndices[materialHandle];
+
+    // Register the texture first, so the material points at the scene's index of it.
+    auto material = MaterialRegistry::material(materialHandle).material;
+    auto textureHandle = MaterialRegistry::texture_handle(materialHandle);
+    if (textureHandle != BAD_INDEX) {
+        if (textureHandle >= textureIndices.size()) textureIndices.resize(textureHandle + 1, BAD_INDEX);
+        if (textureIndices[textureHandle] == BAD_INDEX) {
+            textureIndices[textureHandle] = (uint32_t) textures.size();
+            textures.push_back(MaterialRegistry::texture(textureHandle));
         }
+        material.textureIndex = textureIndices[textureHandle];
     }
-    material.material.textureIndex = textureIndex; // Initialize material texture index field
-
-    auto materialIndex = (uint32_t) materials.size();
-    if (materials.contains(material))
-        materialIndex = materials[material];
-    else
-        materials[material] = materialIndex;
-    material.index = materialIndex; // Initialize material index field
+
+    if (materialHandle >= materialIndices.size()) materialIndices.resize(materialHandle + 1, BAD_INDEX);
+    materialIndices[materialHandle] = (uint32_t) materials.size();
+    materials.push_back(material);
+    return materialIndices[materialHandle];
 }
\ No newline at end of file
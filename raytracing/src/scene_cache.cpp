@@ -0,0 +1,178 @@
+#include "../include/scene_cache.h"
+#include "../include/scene_buffer_types.h"
+#include "../include/material_registry.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+constexpr uint32_t CACHE_MAGIC = 0x43535452; // "RTSC"
+constexpr uint32_t CACHE_VERSION = 3;        // Bump whenever the file layout, or a cached GPU type, changes.
+
+// --- Writing ---
+template<typename T> requires std::is_trivially_copyable_v<T>
+static void write(std::vector<char> &bytes, const T &value) {
+    auto offset = bytes.size();
+    bytes.resize(offset + sizeof(T));
+    std::memcpy(bytes.data() + offset, &value, sizeof(T));
+}
+
+static void write(std::vector<char> &bytes, const std::string &string) {
+    write(bytes, (uint32_t) string.size());
+    bytes.insert(bytes.end(), string.begin(), string.end());
+}
+
+// --- Reading ---
+/** Reads values back in the order they were written, throwing if the file ends early. */
+class Reader {
+public:
+    explicit Reader(const std::vector<char> &bytes) : bytes(bytes) {}
+
+    template<typename T> requires std::is_trivially_copyable_v<T>
+    T read() {
+        auto value = T();
+        std::memcpy(&value, advance(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    std::string read_string() {
+        auto size = read<uint32_t>();
+        return {advance(size), size};
+    }
+
+    const char *advance(size_t size) {
+        if (size > bytes.size() - offset)
+            throw std::runtime_error("ERROR: Scene cache ends early!");
+        auto *data = bytes.data() + offset;
+        offset += size;
+        return data;
+    }
+
+private:
+    const std::vector<char> &bytes;
+    size_t offset {};
+};
+
+bool SceneCache::load(Scene &scene, uint64_t key) const {
+    auto file = std::ifstream(path(scene), std::ios::binary | std::ios::ate);
+    if (!file.is_open()) return false;
+
+    auto bytes = std::vector<char>((size_t) file.tellg());
+    file.seekg(0);
+    if (!file.read(bytes.data(), (std::streamsize) bytes.size())) return false;
+
+    // Everything is read into a scene of its own first, so a stale or corrupt file leaves the scene as it was.
+    auto cached = Scene();
+    try {
+        auto reader = Reader(bytes);
+        if (reader.read<uint32_t>() != CACHE_MAGIC || reader.read<uint32_t>() != CACHE_VERSION || reader.read<uint64_t>() != key)
+            return false;
+
+        auto isValid = true;
+        for_each_buffer_type([&](Hittable::Type type, auto prototype) {
+            using T = decltype(prototype);
+            auto count = reader.read<uint64_t>();
+            if (reader.read<uint32_t>() != sizeof(T)) isValid = false;
+            if (!isValid) return;
+
+            const auto *data = reader.advance(count * sizeof(T));
+            auto &buffer = cached.get_buffer<T>(type);
+            buffer.resize(count);
+            std::memcpy(buffer.data(), data, count * sizeof(T));
+        });
+        if (!isValid) return false;
+
+        auto numTextures = reader.read<uint32_t>();
+        auto textures = std::vector<std::string>(numTextures);
+        for (auto &name : textures) name = reader.read_string();
+
+        // Materials are interned and registered again in their saved order, which gives them (and their textures) the
+        // same indices as before, and lets the scene look up their handles if it is ever serialized into again.
+        auto numMaterials = reader.read<uint32_t>();
+        for (uint32_t i = 0; i < numMaterials; i++) {
+            auto material = RTMaterial();
+            material.material = reader.read<RTMaterial::GPU_t>();
+            auto textureIndex = material.material.textureIndex;
+            if (textureIndex != BAD_INDEX && textureIndex >= numTextures)
+                throw std::runtime_error("ERROR: Scene cache refers to texture " + std::to_string(textureIndex) + ", which it does not hold!");
+            if (textureIndex != BAD_INDEX) material.texture = textures[textureIndex];
+            if (cached.register_material(MaterialRegistry::intern(material)) != i)
+                throw std::runtime_error("ERROR: Scene cache holds material " + std::to_string(i) + " twice!");
+        }
+        if (cached.textures != textures) throw std::runtime_error("ERROR: Scene cache holds textures no material refers to!");
+    } catch (const std::runtime_error &error) {
+        std::cout << "   --- Ignoring scene cache \"" << path(scene) << "\": " << error.what() << '\n';
+        return false;
+    }
+
+    for_each_buffer_type([&](Hittable::Type type, auto prototype) {
+        using T = decltype(prototype);
+        scene.get_buffer<T>(type) = std::move(cached.get_buffer<T>(type));
+    });
+    scene.copy_materials(cached);
+    scene.bottomLevelRoots.clear();
+    scene.meshVertexOffsets.clear();
+    return true;
+}
+
+void SceneCache::save(Scene &scene, uint64_t key) const {
+    auto bytes = std::vector<char>();
+    write(bytes, CACHE_MAGIC);
+    write(bytes, CACHE_VERSION);
+    write(bytes, key);
+
+    for_each_buffer_type([&](Hittable::Type type, auto prototype) {
+        using T = decltype(prototype);
+        const auto &buffer = std::as_const(scene).get_buffer<T>(type);
+        write(bytes, (uint64_t) buffer.size());
+        write(bytes, (uint32_t) sizeof(T));
+        const auto *data = reinterpret_cast<const char *>(buffer.data());
+        bytes.insert(bytes.end(), data, data + buffer.size() * sizeof(T));
+    });
+
+    // Both tables are saved in index order, textures first, since materials refer to them by index.
+    write(bytes, (uint32_t) scene.textures.size());
+    for (const auto &name : scene.textures) write(bytes, name);
+
+    write(bytes, (uint32_t) scene.materials.size());
+    for (const auto &material : scene.materials) write(bytes, material);
+
+    // The file is swapped in whole, so an interrupted save never leaves a truncated cache behind.
+    std::filesystem::create_directories(directory);
+    auto temporaryPath = path(scene) + ".tmp";
+    {
+        auto file = std::ofstream(temporaryPath, std::ios::binary | std::ios::trunc);
+        if (!file.is_open() || !file.write(bytes.data(), (std::streamsize) bytes.size()))
+            throw std::runtime_error("ERROR: Could not write scene cache to \"" + temporaryPath + "\"!");
+    }
+    std::filesystem::rename(temporaryPath, path(scene));
+}
+
+std::string SceneCache::path(const Scene &scene) const {
+    return (std::filesystem::path(directory) / (scene.name + ".scene")).string();
+}
+
+uint64_t SceneCache::hash(const void *data, size_t size, uint64_t seed) {
+    constexpr uint64_t FNV_PRIME = 0x100000001B3;
+    const auto *bytes = static_cast<const unsigned char *>(data);
+    auto hash = seed;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+uint64_t SceneCache::hash_file(const std::string &path, uint64_t seed) {
+    auto file = std::ifstream(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+        throw std::runtime_error("ERROR: Could not open \"" + path + "\" to hash it!");
+
+    auto bytes = std::vector<char>((size_t) file.tellg());
+    file.seekg(0);
+    file.read(bytes.data(), (std::streamsize) bytes.size());
+    return hash(bytes.data(), bytes.size(), seed);
+}
\ No newline at end of file
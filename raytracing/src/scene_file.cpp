@@ -0,0 +1,603 @@
+#include "../include/scene_file.h"
+#include "../include/material_registry.h"
+
+#include "glm/ext/matrix_transform.hpp"
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using json = nlohmann::json;
+
+constexpr uint32_t SCENE_FILE_MAGIC = 0x46535452;  // "RTSF"
+constexpr uint32_t SCENE_FILE_VERSION = 1;         // Bump whenever the layout of a section changes.
+constexpr uint64_t SECTION_ALIGNMENT = 16;         // Every section starts aligned, so it can be read in place.
+constexpr size_t PARALLEL_COPY_SPAN = 1 << 20;     // Sections are copied out of the mapped file in chunks of this size.
+constexpr int PARALLEL_PARSE_SPAN = 4096;          // Smaller arrays are converted serially.
+
+// --- Compiled Layout ---
+enum class Section : uint32_t {
+    name = 1,
+    camera,
+    background,
+    strings, // Texture and mesh names, referenced by offset and length.
+    materials,
+    sphereCenters,
+    sphereRadii,
+    sphereMaterials,
+    quadCorners,
+    quadUs,
+    quadVs,
+    quadMaterials,
+    triV0s,
+    triV1s,
+    triV2s,
+    triUs,
+    triVs,
+    triMaterials,
+    meshes,
+};
+
+struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numSections;
+    uint32_t pad;
+};
+
+struct SectionHeader {
+    Section id;
+    uint32_t elementSize; // Checked against the type the section is read as.
+    uint64_t offset;      // From the start of the file.
+    uint64_t count;
+};
+
+struct MaterialRecord {
+    RTMaterial::GPU_t material; // The texture index is unused.
+    uint32_t textureOffset, textureLength;
+    uint32_t pad[2];
+};
+
+struct MeshRecord {
+    glm::mat4 transform;
+    uint32_t nameOffset, nameLength;
+    uint32_t materialId;
+    uint32_t pad;
+};
+
+/** Read-only view of a whole file, mapped into memory so pages are only loaded as they are read. */
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER fileSize;
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &fileSize))
+            throw std::runtime_error("ERROR: Could not open scene file \"" + path + "\"!");
+        size = (size_t) fileSize.QuadPart;
+        if (size == 0) return;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        data = mapping != nullptr ? (const char *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+#else
+        descriptor = open(path.c_str(), O_RDONLY);
+        struct stat status {};
+        if (descriptor < 0 || fstat(descriptor, &status) != 0)
+            throw std::runtime_error("ERROR: Could not open scene file \"" + path + "\"!");
+        size = (size_t) status.st_size;
+        if (size == 0) return;
+        auto *address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        data = address != MAP_FAILED ? (const char *) address : nullptr;
+#endif
+        if (data == nullptr) throw std::runtime_error("ERROR: Could not map scene file \"" + path + "\" into memory!");
+    }
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (data != nullptr) UnmapViewOfFile(data);
+        if (mapping != nullptr) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (data != nullptr) munmap(const_cast<char *>(data), size);
+        if (descriptor >= 0) close(descriptor);
+#endif
+    }
+
+public:
+    const char *data {};
+    size_t size {};
+
+private:
+#ifdef _WIN32
+    HANDLE file {INVALID_HANDLE_VALUE};
+    HANDLE mapping {};
+#else
+    int descriptor {-1};
+#endif
+};
+
+// --- JSON ---
+static float read_float(const json &object, const char *key, float fallback) {
+    if (!object.contains(key)) return fallback;
+    if (!object[key].is_number()) throw std::runtime_error(std::string("ERROR: Scene file field \"") + key + "\" is not a number!");
+    return object[key].get<float>();
+}
+
+static glm::vec3 read_vec3(const json &value, const std::string &what) {
+    if (!value.is_array() || value.size() != 3 || !value[0].is_number() || !value[1].is_number() || !value[2].is_number())
+        throw std::runtime_error("ERROR: Scene file field \"" + what + "\" is not a vector of three numbers!");
+    return {value[0].get<float>(), value[1].get<float>(), value[2].get<float>()};
+}
+
+/** Converts a flat array of numbers, every `N` of which make up a value, in parallel. */
+template<int N, typename T>
+static std::vector<T> read_array(const json &object, const char *key, size_t expectedSize = SIZE_MAX) {
+    if (!object.contains(key)) {
+        if (expectedSize == SIZE_MAX) throw std::runtime_error(std::string("ERROR: Scene file is missing the array \"") + key + "\"!");
+        return std::vector<T>(expectedSize);
+    }
+    const auto &array = object[key];
+    if (!array.is_array() || array.size() % N != 0)
+        throw std::runtime_error(std::string("ERROR: Scene file array \"") + key + "\" does not hold a multiple of " + std::to_string(N) + " numbers!");
+
+    auto numValues = (int) (array.size() / N);
+    if (expectedSize != SIZE_MAX && (size_t) numValues != expectedSize)
+        throw std::runtime_error(std::string("ERROR: Scene file array \"") + key + "\" holds " + std::to_string(numValues) + " values instead of " + std::to_string(expectedSize) + "!");
+
+    auto values = std::vector<T>(numValues);
+    auto isInvalid = false;
+#pragma omp parallel for reduction(||:isInvalid) if(numValues >= PARALLEL_PARSE_SPAN)
+    for (int i = 0; i < numValues; i++) {
+        for (int j = 0; j < N; j++) {
+            const auto &element = array[N * i + j];
+            isInvalid = isInvalid || !element.is_number();
+            if (!element.is_number()) continue;
+            if constexpr (N == 1) values[i] = element.get<float>();
+            else values[i][j] = element.get<float>();
+        }
+    }
+    if (isInvalid) throw std::runtime_error(std::string("ERROR: Scene file array \"") + key + "\" holds something other than numbers!");
+    return values;
+}
+
+static uint32_t material_index(const json &value, const std::unordered_map<std::string, uint32_t> &materialIndices, size_t numMaterials) {
+    if (value.is_string()) {
+        auto entry = materialIndices.find(value.get_ref<const std::string &>());
+        return entry != materialIndices.end() ? entry->second : BAD_INDEX;
+    }
+    if (value.is_number_unsigned() && value.get<uint64_t>() < numMaterials) return value.get<uint32_t>();
+    return BAD_INDEX;
+}
+
+/** Resolves every primitive's material, named or indexed, into the handle of the file's material. In parallel. */
+static std::vector<uint32_t> read_material_ids(const json &object, size_t numPrimitives, const std::unordered_map<std::string, uint32_t> &materialIndices,
+                                               const std::vector<uint32_t> &materialHandles, const std::string &what) {
+    auto ids = std::vector<uint32_t>(numPrimitives);
+    if (object.contains("material") && !object.contains("materials")) {
+        auto index = material_index(object["material"], materialIndices, materialHandles.size());
+        if (index == BAD_INDEX) throw std::runtime_error("ERROR: Scene file " + what + " use a material that is not declared!");
+        std::fill(ids.begin(), ids.end(), materialHandles[index]);
+        return ids;
+    }
+    if (!object.contains("materials") || !object["materials"].is_array() || object["materials"].size() != numPrimitives)
+        throw std::runtime_error("ERROR: Scene file " + what + " need either a \"material\" or one of \"materials\" each!");
+
+    const auto &array = object["materials"];
+    auto numIds = (int) numPrimitives;
+    auto isInvalid = false;
+#pragma omp parallel for reduction(||:isInvalid) if(numIds >= PARALLEL_PARSE_SPAN)
+    for (int i = 0; i < numIds; i++) {
+        auto index = material_index(array[i], materialIndices, materialHandles.size());
+        isInvalid = isInvalid || index == BAD_INDEX;
+        ids[i] = index != BAD_INDEX ? materialHandles[index] : BAD_INDEX;
+    }
+    if (isInvalid) throw std::runtime_error("ERROR: Scene file " + what + " use a material that is not declared!");
+    return ids;
+}
+
+static RTMaterial read_material(const json &object) {
+    auto type = object.value("type", std::string());
+    if (type == "lambertian" && object.contains("texture")) return Lambertian(object["texture"].get<std::string>().c_str());
+    if (type == "lambertian")   return Lambertian(read_vec3(object.value("albedo", json()), "albedo"));
+    if (type == "metal")        return Metal(read_vec3(object.value("albedo", json()), "albedo"), read_float(object, "fuzziness", 0.0f));
+    if (type == "dielectric")   return Dielectric(read_float(object, "refractiveIndex", 1.5f));
+    if (type == "diffuseLight") return DiffuseLight(read_vec3(object.value("albedo", json()), "albedo"));
+    throw std::runtime_error("ERROR: Scene file material type \"" + type + "\" is unknown!");
+}
+
+static glm::mat4 read_transform(const json &object) {
+    auto transform = glm::mat4(1.0f);
+    if (object.contains("translate")) transform = glm::translate(transform, read_vec3(object["translate"], "translate"));
+    if (object.contains("rotate")) {
+        const auto &rotate = object["rotate"];
+        if (!rotate.is_array() || rotate.size() != 4 || !rotate[0].is_number())
+            throw std::runtime_error("ERROR: Scene file field \"rotate\" is not an angle followed by an axis!");
+        auto axis = read_vec3(json {rotate[1], rotate[2], rotate[3]}, "rotate");
+        transform = glm::rotate(transform, glm::radians(rotate[0].get<float>()), axis);
+    }
+    if (object.contains("scale")) {
+        auto scale = object["scale"].is_number() ? glm::vec3(object["scale"].get<float>()) : read_vec3(object["scale"], "scale");
+        transform = glm::scale(transform, scale);
+    }
+    return transform;
+}
+
+static SceneFile parse_scene(const json &document, const std::string &path) {
+    if (!document.is_object() || !document.contains("name") || !document["name"].is_string() || !document.contains("camera"))
+        throw std::runtime_error("ERROR: Scene file \"" + path + "\" needs a name and a camera!");
+
+    auto file = SceneFile();
+    file.name = document["name"].get<std::string>();
+
+    const auto &camera = document["camera"];
+    file.camera.position = read_vec3(camera.value("position", json()), "position");
+    file.camera.at = read_vec3(camera.value("at", json()), "at");
+    file.camera.fovDegrees = read_float(camera, "fov", file.camera.fovDegrees);
+    file.camera.aspectRatio = read_float(camera, "aspectRatio", file.camera.aspectRatio);
+    file.camera.aperture = read_float(camera, "aperture", file.camera.aperture);
+    file.camera.focusDistance = read_float(camera, "focusDistance", file.camera.focusDistance);
+    if (document.contains("background")) file.backgroundColor = read_vec3(document["background"], "background");
+
+    // Materials are interned once here, so primitives only ever hold their handle.
+    auto materialIndices = std::unordered_map<std::string, uint32_t>();
+    auto materialHandles = std::vector<uint32_t>();
+    for (const auto &material : document.value("materials", json::array())) {
+        if (material.contains("name")) materialIndices[material["name"].get<std::string>()] = (uint32_t) file.materials.size();
+        file.materials.push_back(read_material(material));
+        materialHandles.push_back(MaterialRegistry::intern(file.materials.back()));
+    }
+
+    if (document.contains("spheres")) {
+        const auto &spheres = document["spheres"];
+        auto &arrays = file.primitives.spheres;
+        arrays.centers = read_array<3, glm::vec3>(spheres, "centers");
+        arrays.radii = read_array<1, float>(spheres, "radii", arrays.centers.size());
+        arrays.materialIds = read_material_ids(spheres, arrays.centers.size(), materialIndices, materialHandles, "spheres");
+    }
+    if (document.contains("quads")) {
+        const auto &quads = document["quads"];
+        auto &arrays = file.primitives.quads;
+        arrays.corners = read_array<3, glm::vec3>(quads, "corners");
+        arrays.us = read_array<3, glm::vec3>(quads, "us", arrays.corners.size());
+        arrays.vs = read_array<3, glm::vec3>(quads, "vs", arrays.corners.size());
+        arrays.materialIds = read_material_ids(quads, arrays.corners.size(), materialIndices, materialHandles, "quads");
+    }
+    if (document.contains("tris")) {
+        const auto &tris = document["tris"];
+        auto &arrays = file.primitives.tris;
+        arrays.v0s = read_array<3, glm::vec3>(tris, "v0s");
+        arrays.v1s = read_array<3, glm::vec3>(tris, "v1s", arrays.v0s.size());
+        arrays.v2s = read_array<3, glm::vec3>(tris, "v2s", arrays.v0s.size());
+        if (tris.contains("us")) arrays.us = read_array<3, glm::vec3>(tris, "us", arrays.v0s.size());
+        else arrays.us.resize(arrays.v0s.size());
+        if (tris.contains("vs")) arrays.vs = read_array<3, glm::vec3>(tris, "vs", arrays.v0s.size());
+        else arrays.vs.resize(arrays.v0s.size());
+        arrays.materialIds = read_material_ids(tris, arrays.v0s.size(), materialIndices, materialHandles, "triangles");
+    }
+    file.primitives.update_bounds();
+
+    for (const auto &mesh : document.value("meshes", json::array())) {
+        if (!mesh.contains("mesh") || !mesh["mesh"].is_string() || !mesh.contains("material"))
+            throw std::runtime_error("ERROR: Scene file \"" + path + "\" references a mesh without a name or material!");
+        auto materialId = material_index(mesh["material"], materialIndices, file.materials.size());
+        if (materialId == BAD_INDEX)
+            throw std::runtime_error("ERROR: Scene file \"" + path + "\" gives a mesh a material that is not declared!");
+        file.meshes.push_back(SceneFile::MeshReference(mesh["mesh"].get<std::string>(), materialId, read_transform(mesh)));
+    }
+    return file;
+}
+
+SceneFile SceneFile::load_json(const std::string &path) {
+    auto stream = std::ifstream(path);
+    if (!stream.is_open()) throw std::runtime_error("ERROR: Could not open scene file \"" + path + "\"!");
+
+    // Fields of the wrong type are only caught by the JSON library, whose errors are rethrown like any other.
+    try {
+        return parse_scene(json::parse(stream), path);
+    } catch (const json::exception &error) {
+        throw std::runtime_error("ERROR: Could not parse scene file \"" + path + "\": " + error.what());
+    }
+}
+
+// --- Compiled ---
+static const std::unordered_map<Section, uint32_t> SECTION_ELEMENT_SIZES = {
+    {Section::name, 1}, {Section::camera, sizeof(SceneFile::CameraDescription)}, {Section::background, sizeof(glm::vec3)},
+    {Section::strings, 1}, {Section::materials, sizeof(MaterialRecord)}, {Section::meshes, sizeof(MeshRecord)},
+    {Section::sphereCenters, sizeof(glm::vec3)}, {Section::sphereRadii, sizeof(float)}, {Section::sphereMaterials, sizeof(uint32_t)},
+    {Section::quadCorners, sizeof(glm::vec3)}, {Section::quadUs, sizeof(glm::vec3)}, {Section::quadVs, sizeof(glm::vec3)},
+    {Section::quadMaterials, sizeof(uint32_t)}, {Section::triV0s, sizeof(glm::vec3)}, {Section::triV1s, sizeof(glm::vec3)},
+    {Section::triV2s, sizeof(glm::vec3)}, {Section::triUs, sizeof(glm::vec3)}, {Section::triVs, sizeof(glm::vec3)},
+    {Section::triMaterials, sizeof(uint32_t)},
+};
+
+SceneFile SceneFile::load_compiled(const std::string &path) {
+    auto mappedFile = MappedFile(path);
+    auto fail = [&path](const std::string &reason) {
+        return std::runtime_error("ERROR: Compiled scene file \"" + path + "\" " + reason + "!");
+    };
+
+    auto header = FileHeader();
+    if (mappedFile.size < sizeof(FileHeader)) throw fail("is truncated");
+    std::memcpy(&header, mappedFile.data, sizeof(FileHeader));
+    if (header.magic != SCENE_FILE_MAGIC || header.version != SCENE_FILE_VERSION) throw fail("is of another version");
+    if (mappedFile.size < sizeof(FileHeader) + (uint64_t) header.numSections * sizeof(SectionHeader)) throw fail("is truncated");
+
+    auto sections = std::unordered_map<Section, SectionHeader>();
+    for (uint32_t i = 0; i < header.numSections; i++) {
+        auto section = SectionHeader();
+        std::memcpy(&section, mappedFile.data + sizeof(FileHeader) + i * sizeof(SectionHeader), sizeof(SectionHeader));
+        auto elementSize = SECTION_ELEMENT_SIZES.find(section.id);
+        if (elementSize == SECTION_ELEMENT_SIZES.end()) continue;
+        if (section.elementSize != elementSize->second) throw fail("holds a section of another layout");
+        if (section.offset > mappedFile.size || section.count > (mappedFile.size - section.offset) / section.elementSize)
+            throw fail("holds a section past its end");
+        sections[section.id] = section;
+    }
+    auto count = [&sections](Section id) { return sections.contains(id) ? sections[id].count : 0; };
+
+    // Every section is copied into its destination in chunks, all of which are copied in parallel.
+    struct CopyChunk {
+        const char *source;
+        char *destination;
+        size_t size;
+    };
+    auto chunks = std::vector<CopyChunk>();
+    auto copy_section = [&]<typename T>(Section id, std::vector<T> &destination, uint64_t expectedCount) {
+        if (count(id) != expectedCount) throw fail("holds arrays of different lengths");
+        destination.resize(expectedCount);
+        const auto *source = mappedFile.data + (expectedCount > 0 ? sections[id].offset : 0);
+        auto size = expectedCount * sizeof(T);
+        for (size_t offset = 0; offset < size; offset += PARALLEL_COPY_SPAN) {
+            auto *chunkDestination = reinterpret_cast<char *>(destination.data()) + offset;
+            chunks.push_back(CopyChunk(source + offset, chunkDestination, std::min(PARALLEL_COPY_SPAN, size - offset)));
+        }
+    };
+
+    auto file = SceneFile();
+    auto cameras = std::vector<CameraDescription>();
+    auto backgrounds = std::vector<glm::vec3>();
+    auto materialRecords = std::vector<MaterialRecord>();
+    auto meshRecords = std::vector<MeshRecord>();
+    auto nameChars = std::vector<char>(), stringChars = std::vector<char>();
+    copy_section(Section::name, nameChars, count(Section::name));
+    copy_section(Section::strings, stringChars, count(Section::strings));
+    copy_section(Section::camera, cameras, 1);
+    copy_section(Section::background, backgrounds, 1);
+    copy_section(Section::materials, materialRecords, count(Section::materials));
+    copy_section(Section::meshes, meshRecords, count(Section::meshes));
+
+    auto &spheres = file.primitives.spheres;
+    auto numSpheres = count(Section::sphereCenters);
+    copy_section(Section::sphereCenters, spheres.centers, numSpheres);
+    copy_section(Section::sphereRadii, spheres.radii, numSpheres);
+    copy_section(Section::sphereMaterials, spheres.materialIds, numSpheres);
+
+    auto &quads = file.primitives.quads;
+    auto numQuads = count(Section::quadCorners);
+    copy_section(Section::quadCorners, quads.corners, numQuads);
+    copy_section(Section::quadUs, quads.us, numQuads);
+    copy_section(Section::quadVs, quads.vs, numQuads);
+    copy_section(Section::quadMaterials, quads.materialIds, numQuads);
+
+    auto &tris = file.primitives.tris;
+    auto numTris = count(Section::triV0s);
+    copy_section(Section::triV0s, tris.v0s, numTris);
+    copy_section(Section::triV1s, tris.v1s, numTris);
+    copy_section(Section::triV2s, tris.v2s, numTris);
+    copy_section(Section::triUs, tris.us, numTris);
+    copy_section(Section::triVs, tris.vs, numTris);
+    copy_section(Section::triMaterials, tris.materialIds, numTris);
+
+    auto numChunks = (int) chunks.size();
+#pragma omp parallel for schedule(dynamic, 1) if(numChunks > 1)
+    for (int i = 0; i < numChunks; i++) std::memcpy(chunks[i].destination, chunks[i].source, chunks[i].size);
+
+    auto read_string = [&](uint32_t offset, uint32_t length) {
+        if (offset > stringChars.size() || length > stringChars.size() - offset) throw fail("holds a name past its strings");
+        return std::string(stringChars.data() + offset, length);
+    };
+    file.name = std::string(nameChars.begin(), nameChars.end());
+    file.camera = cameras[0];
+    file.backgroundColor = backgrounds[0];
+
+    auto materialHandles = std::vector<uint32_t>();
+    for (const auto &record : materialRecords) {
+        auto material = RTMaterial();
+        material.material = record.material;
+        material.material.textureIndex = BAD_INDEX;
+        material.texture = read_string(record.textureOffset, record.textureLength);
+        file.materials.push_back(material);
+        materialHandles.push_back(MaterialRegistry::intern(material));
+    }
+    for (const auto &record : meshRecords) {
+        if (record.materialId >= file.materials.size()) throw fail("gives a mesh a material it does not hold");
+        file.meshes.push_back(MeshReference(read_string(record.nameOffset, record.nameLength), record.materialId, record.transform));
+    }
+
+    // Primitives are compiled with the index of their material in the file, which is swapped for its handle.
+    for (auto *ids : {&spheres.materialIds, &quads.materialIds, &tris.materialIds}) {
+        auto numIds = (int) ids->size();
+        auto isInvalid = false;
+#pragma omp parallel for reduction(||:isInvalid) if(numIds >= PARALLEL_PARSE_SPAN)
+        for (int i = 0; i < numIds; i++) {
+            auto index = (*ids)[i];
+            isInvalid = isInvalid || index >= materialHandles.size();
+            (*ids)[i] = index < materialHandles.size() ? materialHandles[index] : BAD_INDEX;
+        }
+        if (isInvalid) throw fail("gives a primitive a material it does not hold");
+    }
+    file.primitives.update_bounds();
+    return file;
+}
+
+void SceneFile::compile(const std::string &path) const {
+    // Primitives may use materials the file does not declare (if they were added in code), which are declared here.
+    auto materialRecords = std::vector<MaterialRecord>();
+    auto strings = std::string();
+    auto fileIndices = std::unordered_map<uint32_t, uint32_t>(); // By handle.
+    auto add_string = [&strings](const std::string &string) {
+        auto offset = (uint32_t) strings.size();
+        strings += string;
+        return std::pair(offset, (uint32_t) string.size());
+    };
+    auto add_material = [&](const RTMaterial &material) {
+        auto [entry, isNew] = fileIndices.try_emplace(MaterialRegistry::intern(material), (uint32_t) materialRecords.size());
+        if (!isNew) return entry->second;
+        auto [textureOffset, textureLength] = add_string(material.texture);
+        materialRecords.push_back(MaterialRecord(material.material, textureOffset, textureLength, {0, 0}));
+        return entry->second;
+    };
+    for (const auto &material : materials) add_material(material);
+
+    auto to_file_ids = [&](const std::vector<uint32_t> &handles) {
+        auto ids = std::vector<uint32_t>(handles.size());
+        for (size_t i = 0; i < handles.size(); i++) {
+            auto entry = fileIndices.find(handles[i]);
+            ids[i] = entry != fileIndices.end() ? entry->second : add_material(MaterialRegistry::material(handles[i]));
+        }
+        return ids;
+    };
+    auto sphereMaterials = to_file_ids(primitives.spheres.materialIds);
+    auto quadMaterials = to_file_ids(primitives.quads.materialIds);
+    auto triMaterials = to_file_ids(primitives.tris.materialIds);
+
+    auto meshRecords = std::vector<MeshRecord>();
+    for (const auto &mesh : meshes) {
+        auto [nameOffset, nameLength] = add_string(mesh.name);
+        auto materialId = add_material(materials.at(mesh.materialId));
+        meshRecords.push_back(MeshRecord(mesh.transform, nameOffset, nameLength, materialId, 0));
+    }
+
+    struct SectionSource {
+        SectionHeader header;
+        const void *data;
+    };
+    auto sources = std::vector<SectionSource>();
+    auto add_section = [&sources]<typename T>(Section id, const T *data, size_t count) {
+        sources.push_back(SectionSource(SectionHeader(id, (uint32_t) sizeof(T), 0, count), data));
+    };
+    add_section(Section::name, name.data(), name.size());
+    add_section(Section::camera, &camera, 1);
+    add_section(Section::background, &backgroundColor, 1);
+    add_section(Section::strings, strings.data(), strings.size());
+    add_section(Section::materials, materialRecords.data(), materialRecords.size());
+    add_section(Section::meshes, meshRecords.data(), meshRecords.size());
+    add_section(Section::sphereCenters, primitives.spheres.centers.data(), primitives.spheres.centers.size());
+    add_section(Section::sphereRadii, primitives.spheres.radii.data(), primitives.spheres.radii.size());
+    add_section(Section::sphereMaterials, sphereMaterials.data(), sphereMaterials.size());
+    add_section(Section::quadCorners, primitives.quads.corners.data(), primitives.quads.corners.size());
+    add_section(Section::quadUs, primitives.quads.us.data(), primitives.quads.us.size());
+    add_section(Section::quadVs, primitives.quads.vs.data(), primitives.quads.vs.size());
+    add_section(Section::quadMaterials, quadMaterials.data(), quadMaterials.size());
+    add_section(Section::triV0s, primitives.tris.v0s.data(), primitives.tris.v0s.size());
+    add_section(Section::triV1s, primitives.tris.v1s.data(), primitives.tris.v1s.size());
+    add_section(Section::triV2s, primitives.tris.v2s.data(), primitives.tris.v2s.size());
+    add_section(Section::triUs, primitives.tris.us.data(), primitives.tris.us.size());
+    add_section(Section::triVs, primitives.tris.vs.data(), primitives.tris.vs.size());
+    add_section(Section::triMaterials, triMaterials.data(), triMaterials.size());
+
+    auto offset = (uint64_t) (sizeof(FileHeader) + sources.size() * sizeof(SectionHeader));
+    for (auto &source : sources) {
+        offset = (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+        source.header.offset = offset;
+        offset += source.header.count * source.header.elementSize;
+    }
+
+    // Sections are streamed out of the scene as they are, so compiling never holds a second copy of the primitives.
+    auto temporaryPath = path + ".tmp";
+    {
+        auto stream = std::ofstream(temporaryPath, std::ios::binary | std::ios::trunc);
+        auto header = FileHeader(SCENE_FILE_MAGIC, SCENE_FILE_VERSION, (uint32_t) sources.size(), 0);
+        stream.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        for (const auto &source : sources) stream.write(reinterpret_cast<const char *>(&source.header), sizeof(SectionHeader));
+        for (const auto &source : sources) {
+            auto padding = std::vector<char>(source.header.offset - (uint64_t) stream.tellp());
+            stream.write(padding.data(), (std::streamsize) padding.size());
+            stream.write(static_cast<const char *>(source.data), (std::streamsize) (source.header.count * source.header.elementSize));
+        }
+        if (!stream.good()) throw std::runtime_error("ERROR: Could not write compiled scene file \"" + temporaryPath + "\"!");
+    }
+    std::filesystem::rename(temporaryPath, path);
+}
+
+SceneFile SceneFile::load(const std::string &path) {
+    auto stream = std::ifstream(path, std::ios::binary);
+    auto magic = uint32_t();
+    if (stream.read(reinterpret_cast<char *>(&magic), sizeof(magic)) && magic == SCENE_FILE_MAGIC) return load_compiled(path);
+    return load_json(path);
+}
+
+SceneFile SceneFile::load_and_compile(const std::string &path) {
+    auto compiledPath = std::filesystem::path(path).replace_extension(".rtscene").string();
+    auto jsonError = std::error_code(), compiledError = std::error_code();
+    auto jsonTime = std::filesystem::last_write_time(path, jsonError);
+    auto compiledTime = std::filesystem::last_write_time(compiledPath, compiledError);
+    if (!compiledError && (jsonError || compiledTime >= jsonTime)) {
+        try {
+            return load_compiled(compiledPath);
+        } catch (const std::runtime_error &loadError) {
+            std::cout << "   --- Ignoring compiled scene file: " << loadError.what() << '\n';
+        }
+    }
+
+    auto file = load_json(path);
+    try {
+        file.compile(compiledPath);
+    } catch (const std::exception &compileError) {
+        std::cout << "   --- Could not compile scene file: " << compileError.what() << '\n';
+    }
+    return file;
+}
+
+Scene SceneFile::make_scene() const {
+    auto sceneCamera = Camera(camera.position, camera.at, camera.fovDegrees, camera.aspectRatio, camera.aperture, camera.focusDistance);
+    return {name, sceneCamera, backgroundColor};
+}
+
+std::vector<std::shared_ptr<Hittable>> SceneFile::make_world(const MeshResolver &resolveMesh) {
+    auto world = std::vector<std::shared_ptr<Hittable>>();
+    if (primitives.size(Hittable::Type::sphere) > 0) {
+        auto spheres = std::make_shared<PrimitiveArrays>();
+        spheres->spheres = std::move(primitives.spheres);
+        world.push_back(spheres);
+    }
+    if (primitives.size(Hittable::Type::quad) > 0) {
+        auto quads = std::make_shared<PrimitiveArrays>();
+        quads->quads = std::move(primitives.quads);
+        world.push_back(quads);
+    }
+    if (primitives.size(Hittable::Type::tri) > 0) {
+        auto tris = std::make_shared<PrimitiveArrays>();
+        tris->tris = std::move(primitives.tris);
+        world.push_back(tris);
+    }
+    primitives = PrimitiveArrays();
+
+    for (const auto &mesh : meshes) {
+        auto bottomLevelBvh = resolveMesh ? resolveMesh(mesh.name, materials[mesh.materialId]) : nullptr;
+        if (bottomLevelBvh == nullptr)
+            throw std::runtime_error("ERROR: Scene \"" + name + "\" references the unknown mesh \"" + mesh.name + "\"!");
+        world.push_back(std::make_shared<Instance>(bottomLevelBvh, mesh.transform));
+    }
+    return world;
+}
\ No newline at end of file
@@ -0,0 +1,194 @@
+#include "../include/tri_mesh.h"
+#include "../include/material_registry.h"
+#include "../include/surface_area_heuristic.h"
+#include "glm/gtc/packing.hpp"
+
+#include <array>
+#include <bit>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+/** @return A hash of the vertex's contents. Both zeros hash equally, since they compare equal. */
+static uint64_t vertex_key(const TriMesh::Vertex_t &vertex) {
+    auto position = vertex.position + glm::vec3(0.0f); // -0 + 0 is +0.
+    auto words = std::array<uint32_t, 4> {std::bit_cast<uint32_t>(position.x), std::bit_cast<uint32_t>(position.y),
+                                          std::bit_cast<uint32_t>(position.z), vertex.uv};
+    uint64_t hash = 0;
+    for (auto word : words) hash ^= word + 0x9E3779B97F4A7C15 + (hash << 6) + (hash >> 2);
+    return hash;
+}
+
+TriMesh::TriMesh(const std::vector<glm::vec3> &positions, const std::vector<glm::vec2> &uvs, const std::vector<uint32_t> &indices, const RTMaterial &material)
+    : materialHandle(MaterialRegistry::intern(material))
+{
+    if (positions.size() != uvs.size())
+        throw std::runtime_error("ERROR: A mesh needs texture coordinates for every vertex!");
+
+    auto source = VertexSource(reinterpret_cast<const std::byte *>(positions.data()), sizeof(glm::vec3),
+                               reinterpret_cast<const std::byte *>(uvs.data()), sizeof(glm::vec2), positions.size());
+    build(source, indices, glm::mat4(1.0f), true);
+}
+
+TriMesh::TriMesh(const VertexSource &source, const std::vector<uint32_t> &indices, const glm::mat4 &transform, const RTMaterial &material,
+                 bool isParallel)
+    : materialHandle(MaterialRegistry::intern(material))
+{
+    build(source, indices, transform, isParallel);
+}
+
+void TriMesh::build(const VertexSource &source, const std::vector<uint32_t> &indices, const glm::mat4 &transform, bool isParallel) {
+    if (indices.empty() || indices.size() % 3 != 0)
+        throw std::runtime_error("ERROR: A mesh needs a non-empty list of triangles, not " + std::to_string(indices.size()) + " indices!");
+    if (source.count >= BAD_INDEX)
+        throw std::runtime_error("ERROR: A mesh cannot have " + std::to_string(source.count) + " vertices!");
+
+    auto numVertices = (int) source.count;
+    auto isVertexParallel = isParallel && numVertices >= PARALLEL_TASK_SPAN;
+    auto packed = std::vector<Vertex_t>(numVertices);
+    auto keys = std::vector<uint64_t>(numVertices);
+    auto order = std::vector<uint32_t>(numVertices);
+#pragma omp parallel for if(isVertexParallel)
+    for (int i = 0; i < numVertices; i++) {
+        glm::vec3 position;
+        glm::vec2 uv;
+        std::memcpy(&position, source.positions + i * source.positionStride, sizeof(position));
+        std::memcpy(&uv, source.uvs + i * source.uvStride, sizeof(uv));
+        packed[i] = Vertex_t(glm::vec3(transform * glm::vec4(position, 1.0f)), glm::packHalf2x16(uv));
+        keys[i] = vertex_key(packed[i]);
+        order[i] = i;
+    }
+
+    // Only the lower half of each hash is sorted by. Vertices that merely share it are told apart below.
+#pragma omp parallel if(isVertexParallel)
+#pragma omp single
+    radix_sort(keys, order, 32, isVertexParallel);
+
+    // Every vertex is merged into the first vertex equal to it, which the stable sort put first among its equals. Runs
+    // of equal keys are handled by the chunk they start in.
+    auto firsts = std::vector<uint32_t>(numVertices);
+    auto numChunks = num_chunks(0, numVertices);
+#pragma omp parallel for if(isVertexParallel)
+    for (int chunk = 0; chunk < numChunks; chunk++) {
+        auto runStart = chunk * PARALLEL_CHUNK_SPAN, chunkEnd = std::min(numVertices, runStart + PARALLEL_CHUNK_SPAN);
+        auto key_bits = [&keys](int i) { return keys[i] & 0xFFFFFFFF; };
+        while (runStart > 0 && runStart < chunkEnd && key_bits(runStart - 1) == key_bits(runStart)) runStart++;
+
+        while (runStart < chunkEnd) {
+            auto runEnd = runStart + 1;
+            while (runEnd < numVertices && key_bits(runEnd) == key_bits(runStart)) runEnd++;
+            for (auto i = runStart; i < runEnd; i++) {
+                auto first = order[i];
+                for (auto j = runStart; j < i; j++) {
+                    if (firsts[order[j]] == order[j] && packed[order[j]] == packed[order[i]]) {
+                        first = order[j];
+                        break;
+                    }
+                }
+                firsts[order[i]] = first;
+            }
+            runStart = runEnd;
+        }
+    }
+
+    // First vertices are numbered in the order they appear in, counted per chunk, then offset by the chunks before.
+    auto chunkOffsets = std::vector<uint32_t>(numChunks + 1);
+#pragma omp parallel for if(isVertexParallel)
+    for (int chunk = 0; chunk < numChunks; chunk++) {
+        auto chunkStart = chunk * PARALLEL_CHUNK_SPAN, chunkEnd = std::min(numVertices, chunkStart + PARALLEL_CHUNK_SPAN);
+        for (auto i = chunkStart; i < chunkEnd; i++) chunkOffsets[chunk + 1] += firsts[i] == (uint32_t) i;
+    }
+    for (int chunk = 0; chunk < numChunks; chunk++) chunkOffsets[chunk + 1] += chunkOffsets[chunk];
+
+    auto remap = std::move(order); // No longer needed, and just as large.
+    vertices.resize(chunkOffsets.back());
+#pragma omp parallel for if(isVertexParallel)
+    for (int chunk = 0; chunk < numChunks; chunk++) {
+        auto chunkStart = chunk * PARALLEL_CHUNK_SPAN, chunkEnd = std::min(numVertices, chunkStart + PARALLEL_CHUNK_SPAN);
+        auto vertexId = chunkOffsets[chunk];
+        for (auto i = chunkStart; i < chunkEnd; i++) {
+            if (firsts[i] != (uint32_t) i) continue;
+            vertices[vertexId] = packed[i];
+            remap[i] = vertexId++;
+        }
+    }
+    // Only after every first vertex was numbered, since a vertex may come before the first vertex equal to it.
+#pragma omp parallel for if(isVertexParallel)
+    for (int i = 0; i < numVertices; i++) {
+        if (firsts[i] != (uint32_t) i) remap[i] = remap[firsts[i]];
+    }
+
+    auto numIndices = (int) indices.size();
+    auto isIndexParallel = isParallel && numIndices >= PARALLEL_TASK_SPAN;
+    uint32_t maxIndex = 0;
+#pragma omp parallel for reduction(max : maxIndex) if(isIndexParallel)
+    for (int i = 0; i < numIndices; i++) maxIndex = std::max(maxIndex, indices[i]);
+    if (maxIndex >= (uint32_t) numVertices)
+        throw std::runtime_error("ERROR: Mesh index " + std::to_string(maxIndex) + " is out of range!");
+
+    auto numTriangles = numIndices / 3;
+    triangles.resize(numTriangles);
+#pragma omp parallel for if(isIndexParallel)
+    for (int i = 0; i < numTriangles; i++) {
+        triangles[i] = glm::uvec3(remap[indices[3 * i]], remap[indices[3 * i + 1]], remap[indices[3 * i + 2]]);
+    }
+    calculate_bounds();
+}
+
+AABB TriMesh::bounding_box(uint32_t index) const {
+    const auto &triangle = triangles[index];
+    return AABB(vertices[triangle.x].position, vertices[triangle.y].position, vertices[triangle.z].position).pad();
+}
+
+void TriMesh::tri_positions(uint32_t index, glm::vec3 (&positions)[3]) const {
+    for (int i = 0; i < 3; i++) positions[i] = vertices[triangles[index][i]].position;
+}
+
+void TriMesh::gpu_serialize(Scene &scene, uint32_t index) {
+    auto vertexOffset = gpu_serialize_vertices(scene);
+    auto tri = GPU_t(triangles[index] + vertexOffset, scene.register_material(materialHandle));
+    scene.get_buffer<TriMesh::GPU_t>(Hittable::Type::meshTri).push_back(tri);
+}
+
+void TriMesh::gpu_serialize(Scene &scene) {
+    // The whole mesh at once: the buffer grows once, and the material and vertices are looked up once.
+    auto vertexOffset = gpu_serialize_vertices(scene);
+    auto materialIndex = scene.register_material(materialHandle);
+    auto &buffer = scene.get_buffer<TriMesh::GPU_t>(Hittable::Type::meshTri);
+    auto offset = buffer.size();
+    auto numTriangles = (int) size();
+    buffer.resize(offset + numTriangles);
+#pragma omp parallel for if(numTriangles >= PARALLEL_TASK_SPAN)
+    for (int i = 0; i < numTriangles; i++) buffer[offset + i] = GPU_t(triangles[i] + vertexOffset, materialIndex);
+}
+
+void TriMesh::transform(const glm::mat4 &transform) {
+    for (auto &vertex : vertices) vertex.position = glm::vec3(transform * glm::vec4(vertex.position, 1.0f));
+    calculate_bounds();
+}
+
+uint32_t TriMesh::gpu_serialize_vertices(Scene &scene) const {
+    if (scene.meshVertexOffsets.contains(this)) return scene.meshVertexOffsets[this];
+
+    auto &buffer = scene.get_buffer<TriMesh::Vertex_t>(Hittable::Type::meshVertex);
+    auto vertexOffset = (uint32_t) buffer.size();
+    buffer.insert(buffer.end(), vertices.begin(), vertices.end());
+    scene.meshVertexOffsets[this] = vertexOffset;
+    return vertexOffset;
+}
+
+void TriMesh::calculate_bounds() {
+    // Merged per chunk, in chunk order, so the result does not depend on the number of threads.
+    auto numTriangles = (int) size();
+    auto numChunks = num_chunks(0, numTriangles);
+    auto chunkBounds = std::vector<AABB>(numChunks);
+#pragma omp parallel for if(numTriangles >= PARALLEL_TASK_SPAN)
+    for (int chunk = 0; chunk < numChunks; chunk++) {
+        auto chunkStart = chunk * PARALLEL_CHUNK_SPAN, chunkEnd = std::min(numTriangles, chunkStart + PARALLEL_CHUNK_SPAN);
+        chunkBounds[chunk] = bounding_box(chunkStart);
+        for (auto i = chunkStart + 1; i < chunkEnd; i++) chunkBounds[chunk] = AABB(chunkBounds[chunk], bounding_box(i));
+    }
+
+    aabb = chunkBounds[0];
+    for (int chunk = 1; chunk < numChunks; chunk++) aabb = AABB(aabb, chunkBounds[chunk]);
+}
\ No newline at end of file
@@ -0,0 +1,150 @@
+#include "../include/wide_bounding_volume_hierarchy.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string>
+
+constexpr uint32_t MAX_LEAF_PRIMITIVES = 0xFFFF; // The number of primitives shares `childTypes` with the type.
+
+static bool is_leaf(const BVHNode::GPU_t &node) {
+    return node.numChildren != 0;
+}
+
+static void set_bounds(WideBVH::GPU_t &node, int lane, const AABB &aabb) {
+    node.minX[lane] = aabb.min.x;
+    node.minY[lane] = aabb.min.y;
+    node.minZ[lane] = aabb.min.z;
+    node.maxX[lane] = aabb.max.x;
+    node.maxY[lane] = aabb.max.y;
+    node.maxZ[lane] = aabb.max.z;
+}
+
+WideBVH::WideBVH(const std::vector<BVHNode::GPU_t> &binaryNodes, int width) : width(width) {
+    if (width != 4 && width != 8) throw std::runtime_error("ERROR: Wide BVHs must be 4- or 8-wide!");
+    if (binaryNodes.empty()) throw std::runtime_error("ERROR: Cannot collapse an empty BVH!");
+
+    collapse(binaryNodes, 0, 0);
+}
+
+uint32_t WideBVH::collapse(const std::vector<BVHNode::GPU_t> &binaryNodes, uint32_t binaryIndex, int stackSize) { // NOLINT
+    // The children of a binary node are its hit node and, in turn, that node's miss node.
+    auto children = std::vector<uint32_t>();
+    if (is_leaf(binaryNodes[binaryIndex])) {
+        children.push_back(binaryIndex); // The whole tree is a single leaf.
+    } else {
+        auto leftIndex = binaryNodes[binaryIndex].hitIndex;
+        children = {leftIndex, binaryNodes[leftIndex].missIndex};
+    }
+
+    while ((int) children.size() < width) {
+        auto largest = children.end();
+        auto largestArea = -1.0f;
+        for (auto it = children.begin(); it != children.end(); it++) {
+            const auto &child = binaryNodes[*it];
+            if (!is_leaf(child) && child.aabb.area() > largestArea) {
+                largest = it;
+                largestArea = child.aabb.area();
+            }
+        }
+        if (largest == children.end()) break; // Every child is a leaf.
+
+        // Keep the children in depth-first order by opening the child in place.
+        auto leftIndex = binaryNodes[*largest].hitIndex;
+        *largest = binaryNodes[leftIndex].missIndex;
+        children.insert(largest, leftIndex);
+    }
+
+    // Interior children are pushed onto the shader's stack while one of them is traversed.
+    auto numInteriorChildren = (int) std::count_if(children.begin(), children.end(), [&](auto index) {
+        return !is_leaf(binaryNodes[index]);
+    });
+    maxStackSize = std::max(maxStackSize, stackSize + numInteriorChildren);
+
+    auto nodeIndex = (uint32_t) nodes.size();
+    nodes.resize(nodes.size() + width / 4);
+    binaryIndices.resize(4 * nodes.size(), BAD_INDEX);
+
+    for (int i = 0; i < (int) children.size(); i++) {
+        const auto &child = binaryNodes[children[i]];
+        if (is_leaf(child) && child.numChildren > MAX_LEAF_PRIMITIVES)
+            throw std::runtime_error("ERROR: Wide BVH leaves cannot hold more than " + std::to_string(MAX_LEAF_PRIMITIVES) + " primitives!");
+        auto childIndex = is_leaf(child) ? child.objectIndex : collapse(binaryNodes, children[i], stackSize + numInteriorChildren - 1);
+        auto childType = is_leaf(child) ? child.type | child.numChildren << 16 : Hittable::Type::bvhNode;
+
+        // `collapse()` may have grown `nodes`, so only look up the node once the child is done.
+        auto &node = nodes[nodeIndex + i / 4];
+        auto lane = i % 4;
+        set_bounds(node, lane, child.aabb);
+        node.childIndices[lane] = childIndex;
+        node.childTypes[lane] = childType;
+        binaryIndices[4 * nodeIndex + i] = children[i];
+    }
+
+    return nodeIndex;
+}
+
+void WideBVH::refit(const std::vector<BVHNode::GPU_t> &binaryNodes) {
+    for (int i = 0; i < (int) binaryIndices.size(); i++) {
+        if (binaryIndices[i] == BAD_INDEX) continue;
+        set_bounds(nodes[i / 4], i % 4, binaryNodes[binaryIndices[i]].aabb);
+    }
+}
+
+/** Must match `dequantize()` in `compute.comp`. The product is exact, so only the sum is rounded. */
+static float dequantize(float origin, uint32_t plane, float scale) {
+    return origin + (float) plane * scale;
+}
+
+WideBVH::QuantizedGPU_t WideBVH::quantize(const GPU_t &node) {
+    auto quantized = QuantizedGPU_t();
+    quantized.childIndices = node.childIndices;
+    quantized.childTypes = node.childTypes;
+
+    const glm::vec4 *mins[] = {&node.minX, &node.minY, &node.minZ};
+    const glm::vec4 *maxs[] = {&node.maxX, &node.maxY, &node.maxZ};
+    for (int axis = 0; axis < 3; axis++) {
+        auto origin = std::numeric_limits<float>::max(), top = std::numeric_limits<float>::lowest();
+        for (int lane = 0; lane < 4; lane++) {
+            if (node.childTypes[lane] == 0) continue;
+            origin = std::min(origin, (*mins[axis])[lane]);
+            top = std::max(top, (*maxs[axis])[lane]);
+        }
+        if (origin > top) origin = top = 0.0f; // Every lane is empty.
+
+        // Smallest power of two that spans the frame in 255 steps, which may take one more once the sum is rounded.
+        int exponent;
+        std::frexp((top - origin) / 255.0f, &exponent);
+        auto biasedExponent = (uint32_t) std::clamp(exponent + 127, 1, 254);
+        auto scale = std::ldexp(1.0f, (int) biasedExponent - 127);
+        while (biasedExponent < 254 && dequantize(origin, 255, scale) < top) {
+            biasedExponent++;
+            scale *= 2.0f;
+        }
+
+        quantized.origin[axis] = origin;
+        quantized.exponents |= biasedExponent << (8 * axis);
+        for (int lane = 0; lane < 4; lane++) {
+            if (node.childTypes[lane] == 0) continue;
+            auto min = (*mins[axis])[lane], max = (*maxs[axis])[lane];
+
+            auto lower = (uint32_t) std::clamp(std::floor((min - origin) / scale), 0.0f, 255.0f);
+            while (lower > 0 && dequantize(origin, lower, scale) > min) lower--;
+            auto upper = (uint32_t) std::clamp(std::ceil((max - origin) / scale), 0.0f, 255.0f);
+            while (upper < 255 && dequantize(origin, upper, scale) < max) upper++;
+
+            quantized.quantizedMin[axis] |= lower << (8 * lane);
+            quantized.quantizedMax[axis] |= upper << (8 * lane);
+        }
+    }
+    return quantized;
+}
+
+void WideBVH::gpu_serialize(Scene &scene) const {
+    auto &buffer = scene.get_buffer<GPU_t>(Hittable::Type::wideBvhNode);
+    buffer.insert(buffer.end(), nodes.begin(), nodes.end());
+
+    auto &quantizedBuffer = scene.get_buffer<QuantizedGPU_t>(Hittable::Type::quantizedWideBvhNode);
+    quantizedBuffer.reserve(quantizedBuffer.size() + nodes.size());
+    for (const auto &node : nodes) quantizedBuffer.push_back(quantize(node));
+}
\ No newline at end of file